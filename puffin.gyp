@@ -58,13 +58,16 @@
       'sources': [
         'src/bit_reader.cc',
         'src/bit_writer.cc',
+        'src/huff_write_behind.cc',
         'src/huffer.cc',
         'src/huffman_table.cc',
+        'src/puff_read_ahead.cc',
         'src/puff_reader.cc',
         'src/puff_writer.cc',
         'src/puffer.cc',
         'src/puffin_stream.cc',
         'src/puffpatch.cc',
+        'src/stats.cc',
       ],
       'dependencies': [
         'libpuffin-proto',
@@ -175,6 +178,17 @@
             'src/utils_unittest.cc',
           ],
         },
+        # Puff/huff throughput benchmark.
+        {
+          'target_name': 'puffin_benchmark',
+          'type': 'executable',
+          'dependencies': [
+            'libpuffdiff-static',
+          ],
+          'sources': [
+            'src/puffin_benchmark.cc',
+          ],
+        },
       ],
     }],
     # fuzzer target
@@ -13,6 +13,7 @@ import os
 import subprocess
 import sys
 import tempfile
+import time
 
 
 class Error(Exception):
@@ -34,6 +35,9 @@ def ParseArguments(argv):
                       help='The source corpus directory with compressed files.')
   parser.add_argument('--tgt-corpus', metavar='DIR',
                       help='The target corpus directory with compressed files.')
+  parser.add_argument('--puff-formats', metavar='FORMATS', default='1',
+                      help='Comma separated list of puff layouts to run '
+                      'puffdiff with: 1 (interleaved) and/or 2 (columnar).')
   parser.add_argument('--debug', action='store_true',
                       help='Turns on verbosity.')
 
@@ -44,6 +48,10 @@ def ParseArguments(argv):
     if not corpus or not os.path.isdir(corpus):
       raise Error('Corpus directory {} is non-existent or inaccesible'
                   .format(corpus))
+  args.puff_formats = args.puff_formats.split(',')
+  for puff_format in args.puff_formats:
+    if puff_format not in ('1', '2'):
+      raise Error('Invalid puff format {}'.format(puff_format))
   return args
 
 
@@ -70,22 +78,28 @@ def main(argv):
                 .format(files_mismatch, args.tgt_corpus))
 
   for src in src_files:
-    with tempfile.NamedTemporaryFile() as puffdiff_patch, \
-         tempfile.NamedTemporaryFile() as bsdiff_patch:
-
-      tgt = os.path.join(args.tgt_corpus, os.path.basename(src))
-
-      operation = 'puffdiff'
-      cmd = ['puffin',
-             '--operation={}'.format(operation),
-             '--src_file={}'.format(src),
-             '--dst_file={}'.format(tgt),
-             '--patch_file={}'.format(puffdiff_patch.name)]
-      # Running the puffdiff operation
-      if subprocess.call(cmd) != 0:
-        raise Error('Puffin failed to do {} command: {}'
-                    .format(operation, cmd))
-
+    tgt = os.path.join(args.tgt_corpus, os.path.basename(src))
+
+    puffdiff_results = []
+    for puff_format in args.puff_formats:
+      with tempfile.NamedTemporaryFile() as puffdiff_patch:
+        operation = 'puffdiff'
+        cmd = ['puffin',
+               '--operation={}'.format(operation),
+               '--src_file={}'.format(src),
+               '--dst_file={}'.format(tgt),
+               '--patch_file={}'.format(puffdiff_patch.name),
+               '--puff_format={}'.format(puff_format)]
+        # Running the puffdiff operation
+        start = time.time()
+        if subprocess.call(cmd) != 0:
+          raise Error('Puffin failed to do {} command: {}'
+                      .format(operation, cmd))
+        puffdiff_results.append('puffdiff-v{}({}, {:.2f}s)'.format(
+            puff_format, os.stat(puffdiff_patch.name).st_size,
+            time.time() - start))
+
+    with tempfile.NamedTemporaryFile() as bsdiff_patch:
       operation = 'bsdiff'
       cmd = ['bsdiff', '--type', 'bz2', src, tgt, bsdiff_patch.name]
       # Running the bsdiff operation
@@ -93,11 +107,11 @@ def main(argv):
         raise Error('Failed to do {} command: {}'
                     .format(operation, cmd))
 
-      logging.debug('%s(%d -> %d) : bsdiff(%d), puffdiff(%d)',
+      logging.debug('%s(%d -> %d) : bsdiff(%d), %s',
                     os.path.basename(src),
                     os.stat(src).st_size, os.stat(tgt).st_size,
                     os.stat(bsdiff_patch.name).st_size,
-                    os.stat(puffdiff_patch.name).st_size)
+                    ', '.join(puffdiff_results))
 
   return 0
 
@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
 #include <cstring>
 
 #include "gtest/gtest.h"
@@ -9,6 +10,7 @@
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/memory_stream.h"
 #include "puffin/src/unittest_common.h"
 
 namespace puffin {
@@ -24,13 +26,7 @@ TEST(BitIOTest, BitWriterAndBitReaderTest) {
   ASSERT_TRUE(bw.WriteBits(8, 0xFF));
   ASSERT_TRUE(bw.WriteBoundaryBits(0x0F));
   uint8_t tmp[] = {1, 2};
-  size_t index = 0;
-  ASSERT_TRUE(bw.WriteBytes(2, [&tmp, &index](uint8_t* buffer, size_t count) {
-    if (count > 2 - index)
-      return false;
-    memcpy(buffer, &tmp[index], count);
-    return true;
-  }));
+  ASSERT_TRUE(bw.WriteBytes(2, tmp));
   ASSERT_FALSE(bw.WriteBits(9, 0x1C));
   ASSERT_TRUE(bw.WriteBits(4, 0x0A));
   ASSERT_TRUE(bw.WriteBoundaryBits(0xBB));
@@ -45,12 +41,12 @@ TEST(BitIOTest, BitWriterAndBitReaderTest) {
   br.DropBits(8);
   ASSERT_EQ(br.ReadBoundaryBits(), 0x0F);
   ASSERT_EQ(br.SkipBoundaryBits(), 5);
-  std::function<bool(uint8_t*, size_t)> read_fn;
-  ASSERT_TRUE(br.GetByteReaderFn(2, &read_fn));
-  ASSERT_TRUE(read_fn(tmp, 2));
+  const uint8_t* bytes;
+  ASSERT_FALSE(br.GetBytes(4, &bytes));
+  ASSERT_TRUE(br.GetBytes(2, &bytes));
+  ASSERT_EQ(bytes, &buf[2]);
+  ASSERT_EQ(0, memcmp(bytes, tmp, 2));
   ASSERT_EQ(br.Offset(), 4);
-  ASSERT_TRUE(read_fn(tmp, 0));
-  ASSERT_FALSE(read_fn(tmp, 1));
   ASSERT_FALSE(br.CacheBits(9));
   ASSERT_TRUE(br.CacheBits(8));
   ASSERT_EQ(br.ReadBits(4), 0x0A);
@@ -62,4 +58,108 @@ TEST(BitIOTest, BitWriterAndBitReaderTest) {
   ASSERT_FALSE(br.CacheBits(1));
 }
 
+// Testing |BufferBitReader| on a buffer long enough to go through both its
+// word-sized and byte-sized cache refills.
+TEST(BitIOTest, BitReaderLongBufferTest) {
+  static const size_t kSize = 37;
+  uint8_t buf[kSize];
+  for (size_t idx = 0; idx < kSize; idx++) {
+    buf[idx] = idx * 7 + 3;
+  }
+
+  // Read the buffer in chunks of varying bit lengths and reconstruct it.
+  puffin::BufferBitReader br(buf, kSize);
+  uint8_t out[kSize] = {0};
+  size_t bit_offset = 0;
+  for (size_t nbits = 1; bit_offset < kSize * 8; nbits = nbits % 32 + 1) {
+    nbits = std::min(nbits, kSize * 8 - bit_offset);
+    ASSERT_TRUE(br.CacheBits(nbits));
+    ASSERT_EQ(br.OffsetInBits(), bit_offset);
+    auto bits = nbits % 2 ? br.ReadAndDropBits(nbits) : br.ReadBits(nbits);
+    if (nbits % 2 == 0) {
+      br.DropBits(nbits);
+    }
+    for (size_t idx = 0; idx < nbits; idx++, bit_offset++) {
+      out[bit_offset / 8] |= ((bits >> idx) & 1) << (bit_offset % 8);
+    }
+  }
+  ASSERT_EQ(0, memcmp(buf, out, kSize));
+  ASSERT_EQ(br.Offset(), kSize);
+  ASSERT_FALSE(br.CacheBits(1));
+  ASSERT_FALSE(br.CacheBits(33));
+}
+
+// Testing |BufferBitWriter| with writes of up to |kMaxLongBits| bits into a
+// buffer long enough to go through both its word-sized and byte-sized flushes.
+TEST(BitIOTest, BitWriterLongBitsTest) {
+  static const size_t kSize = 61;
+  uint8_t expected[kSize];
+  for (size_t idx = 0; idx < kSize; idx++) {
+    expected[idx] = idx * 7 + 3;
+  }
+
+  // Write the bits of |expected| in chunks of varying bit lengths. Also pass
+  // garbage above the requested bits, which should be ignored.
+  uint8_t buf[kSize];
+  puffin::BufferBitWriter bw(buf, kSize);
+  size_t bit_offset = 0;
+  for (size_t nbits = 0; bit_offset < kSize * 8; nbits = (nbits + 5) % 58) {
+    nbits = std::min(nbits, kSize * 8 - bit_offset);
+    uint64_t bits = ~0ULL << nbits;
+    for (size_t idx = 0; idx < nbits; idx++, bit_offset++) {
+      uint64_t bit = (expected[bit_offset / 8] >> (bit_offset % 8)) & 1;
+      bits |= bit << idx;
+    }
+    ASSERT_TRUE(bw.WriteLongBits(nbits, bits));
+  }
+  ASSERT_FALSE(bw.WriteBits(1, 1));
+  ASSERT_FALSE(bw.WriteLongBits(puffin::BitWriterInterface::kMaxLongBits + 1,
+                                0));
+  ASSERT_TRUE(bw.Flush());
+  ASSERT_EQ(kSize, bw.Size());
+  ASSERT_EQ(0, memcmp(buf, expected, kSize));
+}
+
+// Testing that |StreamBitReader| reads the same bits and bytes as
+// |BufferBitReader| across many refills of its window, even if the stream is
+// used by someone else in between.
+TEST(BitIOTest, StreamBitReaderTest) {
+  const size_t kOffset = 3;
+  const size_t kSize = 3 * StreamBitReader::kWindowSize + 1234;
+  Buffer buf(kOffset + kSize + 5);
+  for (size_t idx = 0; idx < buf.size(); idx++) {
+    buf[idx] = (idx * idx + 7) >> 3;
+  }
+  auto stream = MemoryStream::CreateForRead(buf);
+  puffin::StreamBitReader sbr(stream.get(), kOffset, kSize);
+  puffin::BufferBitReader br(&buf[kOffset], kSize);
+
+  size_t step = 0;
+  for (size_t nbits = 1; br.CacheBits(1); nbits = nbits % 32 + 1, step++) {
+    if (step % 50 == 49) {
+      // Read the longest uncompressed block, or what is left.
+      ASSERT_EQ(br.ReadBoundaryBits(), sbr.ReadBoundaryBits());
+      ASSERT_EQ(br.SkipBoundaryBits(), sbr.SkipBoundaryBits());
+      size_t length = std::min<size_t>(0xFFFF, kSize - br.Offset());
+      const uint8_t* bytes;
+      const uint8_t* stream_bytes;
+      ASSERT_TRUE(br.GetBytes(length, &bytes));
+      ASSERT_TRUE(sbr.GetBytes(length, &stream_bytes));
+      ASSERT_EQ(0, memcmp(bytes, stream_bytes, length));
+      ASSERT_TRUE(stream->Seek(0));
+    } else {
+      nbits = std::min<size_t>(nbits, kSize * 8 - br.OffsetInBits());
+      ASSERT_TRUE(br.CacheBits(nbits));
+      ASSERT_TRUE(sbr.CacheBits(nbits));
+      ASSERT_EQ(br.ReadAndDropBits(nbits), sbr.ReadAndDropBits(nbits));
+    }
+    ASSERT_EQ(br.Offset(), sbr.Offset());
+    ASSERT_EQ(br.OffsetInBits(), sbr.OffsetInBits());
+  }
+  ASSERT_EQ(kSize, sbr.Offset());
+  ASSERT_FALSE(sbr.CacheBits(1));
+  const uint8_t* bytes;
+  ASSERT_FALSE(sbr.GetBytes(1, &bytes));
+}
+
 }  // namespace puffin
@@ -4,33 +4,12 @@
 
 #include "puffin/src/bit_reader.h"
 
+#include <algorithm>
+
 #include "puffin/src/logging.h"
 
 namespace puffin {
 
-bool BufferBitReader::CacheBits(size_t nbits) {
-  if ((in_size_ - index_) * 8 + in_cache_bits_ < nbits) {
-    return false;
-  }
-  if (nbits > sizeof(in_cache_) * 8) {
-    return false;
-  }
-  while (in_cache_bits_ < nbits) {
-    in_cache_ |= in_buf_[index_++] << in_cache_bits_;
-    in_cache_bits_ += 8;
-  }
-  return true;
-}
-
-uint32_t BufferBitReader::ReadBits(size_t nbits) {
-  return in_cache_ & ((1U << nbits) - 1);
-}
-
-void BufferBitReader::DropBits(size_t nbits) {
-  in_cache_ >>= nbits;
-  in_cache_bits_ -= nbits;
-}
-
 uint8_t BufferBitReader::ReadBoundaryBits() {
   return in_cache_ & ((1 << (in_cache_bits_ & 7)) - 1);
 }
@@ -42,21 +21,13 @@ size_t BufferBitReader::SkipBoundaryBits() {
   return nbits;
 }
 
-bool BufferBitReader::GetByteReaderFn(
-    size_t length, std::function<bool(uint8_t*, size_t)>* read_fn) {
+bool BufferBitReader::GetBytes(size_t length, const uint8_t** bytes) {
   index_ -= (in_cache_bits_ + 7) / 8;
   in_cache_ = 0;
   in_cache_bits_ = 0;
   TEST_AND_RETURN_FALSE(length <= in_size_ - index_);
-  *read_fn = [this, length](uint8_t* buffer, size_t count) mutable {
-    TEST_AND_RETURN_FALSE(count <= length);
-    if (buffer != nullptr) {
-      memcpy(buffer, &in_buf_[index_], count);
-    }
-    index_ += count;
-    length -= count;
-    return true;
-  };
+  *bytes = &in_buf_[index_];
+  index_ += length;
   return true;
 }
 
@@ -68,4 +39,71 @@ uint64_t BufferBitReader::OffsetInBits() const {
   return (index_ * 8) - in_cache_bits_;
 }
 
+constexpr size_t StreamBitReader::kWindowSize;
+
+StreamBitReader::StreamBitReader(StreamInterface* stream,
+                                 uint64_t offset,
+                                 uint64_t size)
+    : stream_(stream),
+      in_offset_(offset),
+      in_size_(size),
+      window_(std::min<uint64_t>(size, kWindowSize)),
+      window_offset_(0),
+      window_size_(0),
+      index_(0),
+      in_cache_(0),
+      in_cache_bits_(0) {}
+
+uint8_t StreamBitReader::ReadBoundaryBits() {
+  return in_cache_ & ((1 << (in_cache_bits_ & 7)) - 1);
+}
+
+size_t StreamBitReader::SkipBoundaryBits() {
+  size_t nbits = in_cache_bits_ & 7;
+  in_cache_ >>= nbits;
+  in_cache_bits_ -= nbits;
+  return nbits;
+}
+
+bool StreamBitReader::GetBytes(size_t length, const uint8_t** bytes) {
+  index_ -= (in_cache_bits_ + 7) / 8;
+  in_cache_ = 0;
+  in_cache_bits_ = 0;
+  if (length > window_size_ - index_) {
+    TEST_AND_RETURN_FALSE(FillWindow());
+    TEST_AND_RETURN_FALSE(length <= window_size_ - index_);
+  }
+  *bytes = &window_[index_];
+  index_ += length;
+  return true;
+}
+
+size_t StreamBitReader::Offset() const {
+  return window_offset_ + index_ - in_cache_bits_ / 8;
+}
+
+uint64_t StreamBitReader::OffsetInBits() const {
+  return ((window_offset_ + index_) * 8) - in_cache_bits_;
+}
+
+bool StreamBitReader::FillWindow() {
+  // The bytes in |in_cache_| are kept too, because |GetBytes| goes back to
+  // them.
+  auto keep_from = index_ - (in_cache_bits_ + 7) / 8;
+  auto keep_size = window_size_ - keep_from;
+  memmove(window_.data(), window_.data() + keep_from, keep_size);
+  window_offset_ += keep_from;
+  index_ -= keep_from;
+  window_size_ = keep_size;
+
+  auto read_size = std::min<uint64_t>(window_.size() - window_size_,
+                                      in_size_ - window_offset_ - window_size_);
+  TEST_AND_RETURN_FALSE(
+      stream_->Seek(in_offset_ + window_offset_ + window_size_));
+  TEST_AND_RETURN_FALSE(
+      stream_->Read(window_.data() + window_size_, read_size));
+  window_size_ += read_size;
+  return true;
+}
+
 }  // namespace puffin
@@ -5,10 +5,14 @@
 #ifndef SRC_BIT_READER_H_
 #define SRC_BIT_READER_H_
 
+#include <endian.h>
+
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/stream.h"
 
 namespace puffin {
 
@@ -40,8 +44,14 @@ class BitReaderInterface {
   // |nbits| IN  The number of bits to drop from the cache.
   virtual void DropBits(size_t nbits) = 0;
 
-  // TODO(*): Add ReadAndDropBits(uint32_t nbits); Because it is a common
-  // pattern.
+  // Reads |nbits| from the cached input and drops them from the cache. It is
+  // equivalent to calling |ReadBits| followed by |DropBits|, which is a very
+  // common pattern. Users should call |CacheBits| with greater than or equal
+  // to |nbits| bits before calling this function.
+  //
+  // |nbits| IN  The number of bits to read and drop from the cache.
+  // Returns the read bits as an unsigned integer.
+  virtual uint32_t ReadAndDropBits(size_t nbits) = 0;
 
   // Returns an unsigned byte equal to the unread bits in the first cached
   // byte. This function should not advance the bit pointer in any way. A call
@@ -52,15 +62,14 @@ class BitReaderInterface {
   // the number of bits skipped.
   virtual size_t SkipBoundaryBits() = 0;
 
-  // Populates a function that allows reading from the byte that has the next
-  // avilable bit for reading. This function clears all the bits that have been
-  // cached previously. As a consequence the next |CacheBits| starts reading
-  // from a byte boundary. The returned functin can only read |length| bytes. It
-  // might be necessary to call |ReadBoundaryBits| and |SkipBoundaryBits| before
-  // this function.
-  virtual bool GetByteReaderFn(
-      size_t length,
-      std::function<bool(uint8_t* buffer, size_t count)>* read_fn) = 0;
+  // Returns in |bytes| a pointer to the |length| bytes starting at the byte
+  // that has the next available bit for reading and moves past them. This
+  // function clears all the bits that have been cached previously. As a
+  // consequence the next |CacheBits| starts reading from a byte boundary. The
+  // returned pointer is borrowed from the reader and is only valid until the
+  // next call into it. It might be necessary to call |ReadBoundaryBits| and
+  // |SkipBoundaryBits| before this function.
+  virtual bool GetBytes(size_t length, const uint8_t** bytes) = 0;
 
   // Returns the number of bytes read till now. This size includes the last
   // partially read byte.
@@ -70,8 +79,39 @@ class BitReaderInterface {
   virtual uint64_t OffsetInBits() const = 0;
 };
 
+// Fills |cache|, which has |cache_bits| bits, with as many whole bytes of the
+// |size| bytes of |buf| starting at |index| as fit into it, and advances
+// |index| past them. If at least eight bytes are left in |buf|, it does so with
+// one unaligned 64-bit load, otherwise it falls back to reading one byte at a
+// time. It is shared by the bit readers below.
+inline void RefillBitCache(const uint8_t* buf,
+                           uint64_t size,
+                           uint64_t* index,
+                           uint64_t* cache,
+                           size_t* cache_bits) {
+  if (size - *index >= sizeof(*cache)) {
+    // Fast path: Load eight bytes at once and only keep the whole bytes that
+    // fit in the free space of |cache|.
+    uint64_t word;
+    memcpy(&word, &buf[*index], sizeof(word));
+    word = le64toh(word);
+    size_t nbytes = (sizeof(*cache) * 8 - 1 - *cache_bits) / 8;
+    *cache |= word << *cache_bits;
+    *cache_bits += nbytes * 8;
+    // Clear the (partial) bytes that were loaded but not consumed.
+    *cache &= (1ULL << *cache_bits) - 1;
+    *index += nbytes;
+  } else {
+    // Slow path: We are close to the end of the buffer.
+    while (*cache_bits <= sizeof(*cache) * 8 - 8 && *index < size) {
+      *cache |= static_cast<uint64_t>(buf[(*index)++]) << *cache_bits;
+      *cache_bits += 8;
+    }
+  }
+}
+
 // A raw buffer implementation of |BitReaderInterface|.
-class BufferBitReader : public BitReaderInterface {
+class BufferBitReader final : public BitReaderInterface {
  public:
   // Sets the beginning of the buffer that the users wants to read.
   //
@@ -86,28 +126,146 @@ class BufferBitReader : public BitReaderInterface {
 
   ~BufferBitReader() override = default;
 
-  // Can only cache up to 32 bits.
-  bool CacheBits(size_t nbits) override;
-  uint32_t ReadBits(size_t nbits) override;
-  void DropBits(size_t nbits) override;
+  // Can only cache up to 32 bits per call, but internally it keeps up to 64
+  // bits so most calls are served without touching the input buffer. The
+  // frequently called functions are defined here so they can be inlined when
+  // the concrete type of the reader is known (see |Puffer|).
+  inline bool CacheBits(size_t nbits) override {
+    if (nbits > kMaxCacheBits) {
+      return false;
+    }
+    if (in_cache_bits_ >= nbits) {
+      return true;
+    }
+    if ((in_size_ - index_) * 8 + in_cache_bits_ < nbits) {
+      return false;
+    }
+    RefillCache();
+    return true;
+  }
+
+  inline uint32_t ReadBits(size_t nbits) override {
+    return in_cache_ & ((1ULL << nbits) - 1);
+  }
+
+  inline void DropBits(size_t nbits) override {
+    in_cache_ >>= nbits;
+    in_cache_bits_ -= nbits;
+  }
+
+  inline uint32_t ReadAndDropBits(size_t nbits) override {
+    uint32_t bits = in_cache_ & ((1ULL << nbits) - 1);
+    in_cache_ >>= nbits;
+    in_cache_bits_ -= nbits;
+    return bits;
+  }
+
   uint8_t ReadBoundaryBits() override;
   size_t SkipBoundaryBits() override;
-  bool GetByteReaderFn(
-      size_t length,
-      std::function<bool(uint8_t* buffer, size_t count)>* read_fn) override;
+  bool GetBytes(size_t length, const uint8_t** bytes) override;
   size_t Offset() const override;
   uint64_t OffsetInBits() const override;
 
  private:
+  // The maximum number of bits that can be requested from |CacheBits|.
+  static constexpr size_t kMaxCacheBits = 32;
+
+  // Fills |in_cache_| with as many whole bytes as fit into it.
+  inline void RefillCache() {
+    RefillBitCache(in_buf_, in_size_, &index_, &in_cache_, &in_cache_bits_);
+  }
+
   const uint8_t* in_buf_;  // The input buffer.
   uint64_t in_size_;       // The number of bytes in |in_buf_|.
   uint64_t index_;         // The index to the next byte to be read.
-  uint32_t in_cache_;      // The temporary buffer to put input data into.
+  uint64_t in_cache_;      // The temporary buffer to put input data into.
   size_t in_cache_bits_;   // The number of bits available in |in_cache_|.
 
   DISALLOW_COPY_AND_ASSIGN(BufferBitReader);
 };
 
+// An implementation of |BitReaderInterface| that reads a range of a
+// |StreamInterface| through a fixed-size window, so a deflate stream of any
+// size can be read with constant memory. The window is refilled from the
+// stream in large reads whenever the bytes left in it run low.
+class StreamBitReader final : public BitReaderInterface {
+ public:
+  // |stream| IN  The input stream. It is owned by the caller and must be valid
+  //              during the lifetime of the object. The reader seeks it before
+  //              every read, so it can be used for other things in between.
+  // |offset| IN  The offset in |stream| to start reading from.
+  // |size|   IN  The number of bytes to read from |stream|.
+  StreamBitReader(StreamInterface* stream, uint64_t offset, uint64_t size);
+
+  ~StreamBitReader() override = default;
+
+  // Can only cache up to 32 bits per call, like |BufferBitReader|.
+  inline bool CacheBits(size_t nbits) override {
+    if (nbits > kMaxCacheBits) {
+      return false;
+    }
+    if (in_cache_bits_ >= nbits) {
+      return true;
+    }
+    if (window_size_ - index_ < sizeof(in_cache_) &&
+        window_offset_ + window_size_ < in_size_ && !FillWindow()) {
+      return false;
+    }
+    if ((window_size_ - index_) * 8 + in_cache_bits_ < nbits) {
+      return false;
+    }
+    RefillBitCache(window_.data(), window_size_, &index_, &in_cache_,
+                   &in_cache_bits_);
+    return true;
+  }
+
+  inline uint32_t ReadBits(size_t nbits) override {
+    return in_cache_ & ((1ULL << nbits) - 1);
+  }
+
+  inline void DropBits(size_t nbits) override {
+    in_cache_ >>= nbits;
+    in_cache_bits_ -= nbits;
+  }
+
+  inline uint32_t ReadAndDropBits(size_t nbits) override {
+    uint32_t bits = in_cache_ & ((1ULL << nbits) - 1);
+    in_cache_ >>= nbits;
+    in_cache_bits_ -= nbits;
+    return bits;
+  }
+
+  uint8_t ReadBoundaryBits() override;
+  size_t SkipBoundaryBits() override;
+  bool GetBytes(size_t length, const uint8_t** bytes) override;
+  size_t Offset() const override;
+  uint64_t OffsetInBits() const override;
+
+  // The size of the window. It is larger than the largest uncompressed block,
+  // so |GetBytes| can always return a pointer into it.
+  static constexpr size_t kWindowSize = 128 * 1024;
+
+ private:
+  // The maximum number of bits that can be requested from |CacheBits|.
+  static constexpr size_t kMaxCacheBits = 32;
+
+  // Moves the bytes of |window_| that are not read yet (including the ones in
+  // |in_cache_|) to its beginning and fills the rest of it from |stream_|.
+  bool FillWindow();
+
+  StreamInterface* stream_;  // The input stream.
+  uint64_t in_offset_;       // The offset of the input in |stream_|.
+  uint64_t in_size_;         // The number of bytes of the input.
+  Buffer window_;            // The window into the input.
+  uint64_t window_offset_;   // The offset of |window_| in the input.
+  uint64_t window_size_;     // The number of input bytes in |window_|.
+  uint64_t index_;           // The index to the next byte in |window_|.
+  uint64_t in_cache_;        // The temporary buffer to put input data into.
+  size_t in_cache_bits_;     // The number of bits available in |in_cache_|.
+
+  DISALLOW_COPY_AND_ASSIGN(StreamBitReader);
+};
+
 }  // namespace puffin
 
 #endif  // SRC_BIT_READER_H_
@@ -5,8 +5,11 @@
 #ifndef SRC_BIT_WRITER_H_
 #define SRC_BIT_WRITER_H_
 
+#include <endian.h>
+
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "puffin/src/include/puffin/common.h"
 
@@ -26,19 +29,27 @@ class BitWriterInterface {
   // |bits|  IN  The bit values to write into the output.
   virtual bool WriteBits(size_t nbits, uint32_t bits) = 0;
 
-  // It first flushes the cache and then puts the |nbytes| bytes from |buffer|
+  // Same as |WriteBits|, but writes up to |kMaxLongBits| bits at once. This
+  // allows writing a Huffman code together with its extra bits (or a whole
+  // length/distance pair) with one call.
+  //
+  // |nbits| IN  The number of bits to write in the output.
+  // |bits|  IN  The bit values to write into the output.
+  virtual bool WriteLongBits(size_t nbits, uint64_t bits) = 0;
+
+  // The maximum number of bits |WriteLongBits| can write at once.
+  static constexpr size_t kMaxLongBits = 57;
+
+  // It first flushes the cache and then puts the |nbytes| bytes from |bytes|
   // into the output buffer. User should make sure there that the number of bits
   // written into the |BitWriter| before this call is a multiplication of
   // eight. Otherwise it is errornous. This can be achieved by calling
   // |WriteBoundaryBits| or |WriteBits| (if the user is tracking the number of
   // bits written).
   //
-  // |nbytes|  IN  The number of bytes to read using |read_fn| and write into
-  //               the output.
-  // |read_fn| IN  A function to read bytes from.
-  virtual bool WriteBytes(
-      size_t nbytes,
-      const std::function<bool(uint8_t* buffer, size_t count)>& read_fn) = 0;
+  // |nbytes|  IN  The number of bytes to write into the output.
+  // |bytes|   IN  The bytes to write.
+  virtual bool WriteBytes(size_t nbytes, const uint8_t* bytes) = 0;
 
   // Puts enough least-significant bits from |bits| into output until the
   // beginning of the next Byte is reached. The number of bits to write into
@@ -57,10 +68,14 @@ class BitWriterInterface {
   // Returns the number of bytes written to the ouput including the cached
   // bytes.
   virtual size_t Size() const = 0;
+
+  // Returns the number of bits written so far, including the ones still in the
+  // cache.
+  virtual size_t OffsetInBits() const = 0;
 };
 
 // A raw buffer implementation of |BitWriterInterface|.
-class BufferBitWriter : public BitWriterInterface {
+class BufferBitWriter final : public BitWriterInterface {
  public:
   // Sets the beginning of the buffer that the users wants to write into.
   //
@@ -75,14 +90,45 @@ class BufferBitWriter : public BitWriterInterface {
 
   ~BufferBitWriter() override = default;
 
-  bool WriteBits(size_t nbits, uint32_t bits) override;
-  bool WriteBytes(size_t nbytes,
-                  const std::function<bool(uint8_t* buffer, size_t count)>&
-                      read_fn) override;
+  // The bits are collected in a 64-bit holder and written out eight bytes at a
+  // time with one unaligned store, as long as there is room for that in the
+  // output buffer. These are defined here so they can be inlined when the
+  // concrete type of the writer is known (see |Huffer|).
+  inline bool WriteBits(size_t nbits, uint32_t bits) override {
+    return WriteLongBits(nbits, bits);
+  }
+
+  inline bool WriteLongBits(size_t nbits, uint64_t bits) override {
+    if (nbits > kMaxLongBits ||
+        (out_size_ - index_) * 8 - out_holder_bits_ < nbits) {
+      return false;
+    }
+    if (out_holder_bits_ + nbits >= sizeof(out_holder_) * 8) {
+      FlushHolder();
+    }
+    out_holder_ |= (bits & ((1ULL << nbits) - 1)) << out_holder_bits_;
+    out_holder_bits_ += nbits;
+    return true;
+  }
+
+  bool WriteBytes(size_t nbytes, const uint8_t* bytes) override;
   bool WriteBoundaryBits(uint8_t bits) override;
   bool Flush() override;
   size_t Size() const override;
 
+  inline size_t OffsetInBits() const override {
+    return index_ * 8 + out_holder_bits_;
+  }
+
+  // Writes the whole bytes in the cache into the output and hands the rest of
+  // the bits (less than eight) over to the caller instead of padding them. It
+  // is used for writing a deflate stream in parts, where the next part starts
+  // with these bits.
+  //
+  // |bits|  OUT  The remaining bits.
+  // |nbits| OUT  The number of remaining bits.
+  void TakeRemainingBits(uint8_t* bits, size_t* nbits);
+
  private:
   // The output buffer.
   uint8_t* out_buf_;
@@ -93,11 +139,36 @@ class BufferBitWriter : public BitWriterInterface {
   // The index to the next byte to write into.
   uint64_t index_;
 
+  // Writes all the whole bytes in |out_holder_| into the output and leaves
+  // less than eight bits in it. If at least eight bytes are left in the output
+  // buffer, it does so with one unaligned 64-bit store, otherwise it falls back
+  // to writing one byte at a time. The caller has already made sure the bits
+  // fit in the output.
+  inline void FlushHolder() {
+    size_t nbytes = out_holder_bits_ / 8;
+    if (out_size_ - index_ >= sizeof(out_holder_)) {
+      // Fast path: The bytes past the whole ones are overwritten later.
+      uint64_t word = htole64(out_holder_);
+      memcpy(&out_buf_[index_], &word, sizeof(word));
+      index_ += nbytes;
+      out_holder_ = nbytes < sizeof(out_holder_) ? out_holder_ >> (nbytes * 8)
+                                                 : 0;
+      out_holder_bits_ -= nbytes * 8;
+    } else {
+      // Slow path: We are close to the end of the buffer.
+      while (out_holder_bits_ >= 8) {
+        out_buf_[index_++] = out_holder_ & 0xFF;
+        out_holder_ >>= 8;
+        out_holder_bits_ -= 8;
+      }
+    }
+  }
+
   // A temporary buffer to keep the bits going out.
-  uint32_t out_holder_;
+  uint64_t out_holder_;
 
   // The number of bits in |out_holder_|.
-  uint8_t out_holder_bits_;
+  size_t out_holder_bits_;
 
   DISALLOW_COPY_AND_ASSIGN(BufferBitWriter);
 };
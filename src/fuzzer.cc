@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
 #include <vector>
 
 #include "base/logging.h"
@@ -9,6 +10,7 @@
 
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/huffer_internal.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
@@ -16,16 +18,23 @@
 #include "puffin/src/memory_stream.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
+#include "puffin/src/puffer_internal.h"
 
 using puffin::BitExtent;
 using puffin::Buffer;
 using puffin::BufferBitReader;
 using puffin::BufferBitWriter;
+using puffin::BufferColumnarPuffReader;
+using puffin::BufferColumnarPuffWriter;
 using puffin::BufferPuffReader;
 using puffin::BufferPuffWriter;
+using puffin::HuffDeflateState;
 using puffin::Huffer;
+using puffin::HufferInternal;
 using puffin::MemoryStream;
+using puffin::PuffDeflateState;
 using puffin::Puffer;
+using puffin::PufferInternal;
 using std::vector;
 
 namespace {
@@ -46,6 +55,98 @@ void FuzzHuff(const uint8_t* data, size_t size) {
   huffer.HuffDeflate(&puff_reader, &bit_writer);
 }
 
+// Same as |FuzzPuff| through the overloads for the buffer based reader and
+// writer, and then puffing in steps of |step| bytes.
+void FuzzPuffInternal(const uint8_t* data, size_t size) {
+  Buffer puff_buffer(size * 2);
+  Puffer puffer;
+  BufferBitReader bit_reader(data, size);
+  BufferPuffWriter puff_writer(puff_buffer.data(), puff_buffer.size());
+  vector<BitExtent> bit_extents;
+  PufferInternal::PuffDeflate(puffer, &bit_reader, &puff_writer, &bit_extents);
+
+  const size_t step = 1 + size % 128;
+  BufferBitReader step_bit_reader(data, size);
+  BufferPuffWriter step_puff_writer(puff_buffer.data(), puff_buffer.size());
+  PuffDeflateState state;
+  while (!state.Done()) {
+    if (!PufferInternal::PuffDeflateUntil(puffer, &step_bit_reader,
+                                          &step_puff_writer,
+                                          step_puff_writer.Size() + step,
+                                          &state)) {
+      return;
+    }
+  }
+}
+
+// Same as |FuzzHuff| through the overloads for the buffer based reader and
+// writer, and then huffing in parts of whole records as they become available
+// every |step| bytes.
+void FuzzHuffInternal(const uint8_t* data, size_t size) {
+  Buffer deflate_buffer(size);
+  Huffer huffer;
+  BufferPuffReader puff_reader(data, size);
+  BufferBitWriter bit_writer(deflate_buffer.data(), deflate_buffer.size());
+  HufferInternal::HuffDeflate(huffer, &puff_reader, &bit_writer);
+
+  const size_t step = 1 + size % 128;
+  BufferBitWriter part_bit_writer(deflate_buffer.data(),
+                                  deflate_buffer.size());
+  HuffDeflateState state;
+  size_t offset = 0;
+  size_t available = 0;
+  while (offset < size) {
+    available = std::min(available + step, size);
+    BufferPuffReader scanner(data + offset, available - offset,
+                             state.InBlock());
+    size_t part_size = scanner.WholeRecordsSize();
+    if (part_size == 0 && available == size) {
+      return;
+    }
+    BufferPuffReader part_puff_reader(data + offset, part_size,
+                                      state.InBlock());
+    if (!HufferInternal::HuffDeflatePart(huffer, &part_puff_reader,
+                                         &part_bit_writer, &state)) {
+      return;
+    }
+    offset += part_size;
+  }
+}
+
+void FuzzColumnarHuff(const uint8_t* data, size_t size) {
+  BufferColumnarPuffReader puff_reader(data, size);
+  Buffer deflate_buffer(size);
+  BufferBitWriter bit_writer(deflate_buffer.data(), deflate_buffer.size());
+  Huffer huffer;
+  huffer.HuffDeflate(&puff_reader, &bit_writer);
+}
+
+// Puffs |data| into the columnar layout and huffs the puff back, which has to
+// give the same deflate stream.
+void FuzzColumnarPuffHuff(const uint8_t* data, size_t size) {
+  BufferBitReader bit_reader(data, size);
+  Buffer puff_buffer;
+  BufferColumnarPuffWriter puff_writer(&puff_buffer);
+  Puffer puffer;
+  if (!puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr)) {
+    return;
+  }
+
+  BufferColumnarPuffReader puff_reader(puff_buffer.data(), puff_buffer.size());
+  Buffer deflate_buffer(bit_reader.Offset());
+  BufferBitWriter bit_writer(deflate_buffer.data(), deflate_buffer.size());
+  Huffer huffer;
+  CHECK(huffer.HuffDeflate(&puff_reader, &bit_writer));
+  // The padding bits after the end of the deflate stream are not kept in the
+  // puff, and they are huffed as zeros.
+  uint64_t deflate_bits = bit_reader.OffsetInBits();
+  CHECK(std::equal(data, data + deflate_bits / 8, deflate_buffer.begin()));
+  if (deflate_bits % 8 != 0) {
+    uint8_t mask = (1 << (deflate_bits % 8)) - 1;
+    CHECK((data[deflate_bits / 8] & mask) == deflate_buffer[deflate_bits / 8]);
+  }
+}
+
 void FuzzPuffPatch(const uint8_t* data, size_t size) {
   const size_t kBufferSize = 1000;
   Buffer src_buffer(kBufferSize);
@@ -71,6 +172,10 @@ Environment* env = new Environment();
 extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
   FuzzPuff(data, size);
   FuzzHuff(data, size);
+  FuzzPuffInternal(data, size);
+  FuzzHuffInternal(data, size);
+  FuzzColumnarHuff(data, size);
+  FuzzColumnarPuffHuff(data, size);
   FuzzPuffPatch(data, size);
   return 0;
 }
@@ -0,0 +1,172 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/huff_write_behind.h"
+
+#include <utility>
+
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/huffer_internal.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/stream.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/puff_reader.h"
+
+namespace puffin {
+
+HuffWriteBehind::HuffWriteBehind(StreamInterface* stream,
+                                 PuffFormat puff_format,
+                                 size_t num_threads)
+    : stream_(stream),
+      puff_format_(puff_format),
+      last_byte_(0),
+      max_chunks_(num_threads * 2),
+      stop_(false) {
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&HuffWriteBehind::Work, this);
+  }
+}
+
+HuffWriteBehind::~HuffWriteBehind() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool HuffWriteBehind::Write(const uint8_t* data, size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!chunks_.empty()) {
+      std::unique_ptr<Chunk> chunk(new Chunk(BitExtent(0, 0)));
+      chunk->data.assign(data, data + size);
+      chunk->done = true;
+      chunks_.push_back(std::move(chunk));
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(stream_->Write(data, size));
+  return true;
+}
+
+bool HuffWriteBehind::Huff(UniqueBufferPtr puff,
+                           uint64_t puff_size,
+                           const BitExtent& deflate,
+                           uint8_t first_bits,
+                           bool extra_byte) {
+  TEST_AND_RETURN_FALSE(puff->size() == puff_size + (extra_byte ? 1 : 0));
+  std::unique_ptr<Chunk> chunk(new Chunk(deflate));
+  chunk->puff = std::move(puff);
+  chunk->puff_size = puff_size;
+  chunk->first_bits = first_bits;
+  chunk->extra_byte = extra_byte;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiting_.push_back(chunk.get());
+    chunks_.push_back(std::move(chunk));
+  }
+  cond_.notify_all();
+
+  TEST_AND_RETURN_FALSE(WriteChunks(max_chunks_));
+  return true;
+}
+
+bool HuffWriteBehind::Flush() {
+  TEST_AND_RETURN_FALSE(WriteChunks(0));
+  return true;
+}
+
+bool HuffWriteBehind::WriteChunks(size_t max_chunks) {
+  while (true) {
+    std::unique_ptr<Chunk> chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this, max_chunks] {
+        return chunks_.size() <= max_chunks || chunks_.front()->done;
+      });
+      if (chunks_.empty() || !chunks_.front()->done) {
+        return true;
+      }
+      chunk = std::move(chunks_.front());
+      chunks_.pop_front();
+    }
+    TEST_AND_RETURN_FALSE(!chunk->failed);
+
+    auto& data = chunk->data;
+    if (chunk->deflate.length > 0) {
+      // Put the bits before the deflate into its first byte, and keep its last
+      // byte for the next deflate if they share it.
+      auto nbits = chunk->deflate.offset & 7;
+      if (nbits > 0) {
+        data[0] |= (chunk->first_bits | last_byte_) & ((1 << nbits) - 1);
+      }
+      last_byte_ = 0;
+      auto end_bit = chunk->deflate.offset + chunk->deflate.length;
+      if (!chunk->extra_byte && (end_bit & 7) != 0) {
+        last_byte_ = data.back();
+        data.pop_back();
+      }
+    }
+    TEST_AND_RETURN_FALSE(stream_->Write(data.data(), data.size()));
+  }
+}
+
+void HuffWriteBehind::Work() {
+  Huffer huffer;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return stop_ || !waiting_.empty(); });
+    if (stop_) {
+      return;
+    }
+    auto chunk = waiting_.front();
+    waiting_.pop_front();
+    lock.unlock();
+
+    auto failed = !HuffChunk(huffer, chunk);
+    chunk->puff.reset();
+
+    lock.lock();
+    chunk->done = true;
+    chunk->failed = failed;
+    cond_.notify_all();
+  }
+}
+
+bool HuffWriteBehind::HuffChunk(const Huffer& huffer, Chunk* chunk) const {
+  const auto& deflate = chunk->deflate;
+  auto start_byte = deflate.offset / 8;
+  auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+  auto& data = chunk->data;
+  data.resize(end_byte - start_byte);
+  BufferBitWriter bit_writer(data.data(), data.size());
+
+  // The bits before the deflate are put in when it is written.
+  TEST_AND_RETURN_FALSE(bit_writer.WriteBits(deflate.offset & 7, 0));
+  if (puff_format_ == PuffFormat::kColumnar) {
+    BufferColumnarPuffReader puff_reader(chunk->puff->data(),
+                                         chunk->puff_size);
+    TEST_AND_RETURN_FALSE(huffer.HuffDeflate(&puff_reader, &bit_writer));
+    TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+  } else {
+    BufferPuffReader puff_reader(chunk->puff->data(), chunk->puff_size);
+    TEST_AND_RETURN_FALSE(
+        HufferInternal::HuffDeflate(huffer, &puff_reader, &bit_writer));
+    TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+  }
+  TEST_AND_RETURN_FALSE(bit_writer.Size() == data.size());
+
+  if (chunk->extra_byte) {
+    auto end_bit = deflate.offset + deflate.length;
+    data.back() |= (*chunk->puff)[chunk->puff_size] << (end_bit & 7);
+  }
+  return true;
+}
+
+}  // namespace puffin
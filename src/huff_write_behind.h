@@ -0,0 +1,130 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_HUFF_WRITE_BEHIND_H_
+#define SRC_HUFF_WRITE_BEHIND_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/stream.h"
+
+namespace puffin {
+
+// Huffs the puffs written into a |PuffinStream| on worker threads and writes
+// the deflates into the deflate stream in the order they were given, together
+// with the bytes between them. The workers huff each deflate as if the bits of
+// its first byte that come before it were zero, and the deflates are stitched
+// together when they are written: The bits before a deflate are the ones given
+// with it, or the last bits of the deflate before it if they end in the same
+// byte. All the methods are called from the thread that writes the
+// |PuffinStream|, which is also the one that writes into the deflate stream.
+class HuffWriteBehind {
+ public:
+  // |stream|      IN  The deflate stream.
+  // |puff_format| IN  The layout of the puffs.
+  // |num_threads| IN  The number of workers.
+  // |stream| has to outlive this object.
+  HuffWriteBehind(StreamInterface* stream,
+                  PuffFormat puff_format,
+                  size_t num_threads);
+
+  // Drops the puffs that are not written yet and stops the workers.
+  ~HuffWriteBehind();
+
+  // Writes the |size| bytes of |data| after the deflates given before.
+  bool Write(const uint8_t* data, size_t size);
+
+  // Huffs |puff| into the deflate at |deflate| and writes it after everything
+  // given before. It waits for the oldest deflate to be written if too many
+  // are not written yet.
+  //
+  // |puff|       IN  The puff, followed by the byte after the puff if
+  //                  |extra_byte| is true.
+  // |puff_size|  IN  The size of the puff without the extra byte.
+  // |deflate|    IN  The location of the deflate in the deflate stream.
+  // |first_bits| IN  The bits of the first byte of the deflate that come before
+  //                  it and are not a part of another deflate.
+  // |extra_byte| IN  True if the rest of the last byte of the deflate is the
+  //                  extra byte of |puff|.
+  bool Huff(UniqueBufferPtr puff,
+            uint64_t puff_size,
+            const BitExtent& deflate,
+            uint8_t first_bits,
+            bool extra_byte);
+
+  // Waits for all the deflates to be huffed and writes them.
+  bool Flush();
+
+ private:
+  // The data to write into the deflate stream, in order.
+  struct Chunk {
+    explicit Chunk(const BitExtent& deflate)
+        : puff_size(0),
+          deflate(deflate),
+          first_bits(0),
+          extra_byte(false),
+          done(false),
+          failed(false) {}
+
+    // The puff to huff, or nullptr once it is huffed and for the bytes between
+    // deflates.
+    UniqueBufferPtr puff;
+    uint64_t puff_size;
+    // Empty for the bytes between deflates.
+    BitExtent deflate;
+    uint8_t first_bits;
+    bool extra_byte;
+    // The bytes to write. For a deflate, they are its bytes once it is huffed.
+    Buffer data;
+    bool done;
+    bool failed;
+  };
+
+  // Writes the chunks at the front of |chunks_| into the stream as long as
+  // they are done, and waits for them until at most |max_chunks| are left.
+  bool WriteChunks(size_t max_chunks);
+
+  // The loop of the workers.
+  void Work();
+
+  // Huffs the puff of |chunk| into its data with |huffer|.
+  bool HuffChunk(const Huffer& huffer, Chunk* chunk) const;
+
+  StreamInterface* stream_;
+  PuffFormat puff_format_;
+
+  // The last byte of the last deflate written, if it is shared with the next
+  // deflate. Otherwise zero.
+  uint8_t last_byte_;
+
+  // The number of chunks that can wait to be written before |Huff| waits for
+  // the first one.
+  size_t max_chunks_;
+
+  // Guards the members below.
+  std::mutex mutex_;
+  // Signaled when a puff is given, a deflate is done or the workers stop.
+  std::condition_variable cond_;
+  // The chunks that are not written yet. The chunks are not moved while they
+  // are in |chunks_|.
+  std::deque<std::unique_ptr<Chunk>> chunks_;
+  // The chunks that are waiting for a worker.
+  std::deque<Chunk*> waiting_;
+  bool stop_;
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(HuffWriteBehind);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_HUFF_WRITE_BEHIND_H_
@@ -10,10 +10,12 @@
 #include <utility>
 
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/huffer_internal.h"
 #include "puffin/src/huffman_table.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/phase_timer.h"
 #include "puffin/src/puff_data.h"
 #include "puffin/src/puff_reader.h"
 
@@ -21,14 +23,244 @@ using std::string;
 
 namespace puffin {
 
-Huffer::Huffer() : dyn_ht_(new HuffmanTable()), fix_ht_(new HuffmanTable()) {}
+namespace {
+
+// The number of literals of a run read at once through |PuffData::read_fn|.
+constexpr size_t kLiteralsChunkSize = 256;
+
+// Calls |fn| with consecutive pieces of the |pd.length| literals of |pd|. If
+// the reader lent the literals in |pd.literals|, |fn| is called once for all
+// of them. Otherwise they are read in chunks through |pd.read_fn|.
+template <typename ChunkFn>
+bool ForEachLiteralsChunk(const PuffData& pd, ChunkFn fn) {
+  if (pd.literals != nullptr) {
+    return fn(pd.literals, pd.length);
+  }
+  uint8_t literals[kLiteralsChunkSize];
+  for (size_t len = pd.length; len > 0;) {
+    auto count = std::min(len, kLiteralsChunkSize);
+    TEST_AND_RETURN_FALSE(pd.read_fn(literals, count));
+    TEST_AND_RETURN_FALSE(fn(literals, count));
+    len -= count;
+  }
+  return true;
+}
+
+// Writes the Huffman codes of |count| |literals| into |bw|. As many codes as
+// fit are combined into one |WriteLongBits| call.
+template <typename BitWriterType, typename HuffmanTableType>
+bool HuffLiterals(const uint8_t* literals,
+                  size_t count,
+                  BitWriterType* bw,
+                  HuffmanTableType* ht) {
+  uint64_t bits = 0;
+  size_t nbits = 0;
+  for (size_t idx = 0; idx < count; idx++) {
+    uint16_t literal_huffman;
+    size_t literal_nbits;
+    TEST_AND_RETURN_FALSE(
+        ht->LitLenHuffman(literals[idx], &literal_huffman, &literal_nbits));
+    if (nbits + literal_nbits > BitWriterInterface::kMaxLongBits) {
+      TEST_AND_RETURN_FALSE(bw->WriteLongBits(nbits, bits));
+      bits = 0;
+      nbits = 0;
+    }
+    bits |= static_cast<uint64_t>(literal_huffman) << nbits;
+    nbits += literal_nbits;
+  }
+  TEST_AND_RETURN_FALSE(bw->WriteLongBits(nbits, bits));
+  return true;
+}
+
+// Encodes the literals, lengths/distances and the end of block of a compressed
+// block read from |pr| with the Huffman table |ht| into |bw|. The records are
+// read in batches with |GetNextBatch|, so the reader is only called once per
+// batch instead of once per record. It is instantiated for both
+// |HuffmanTable| and |FixedHuffmanTable|. It sets |end_of_block| to false if
+// |pr| ends before the end of block. The symbols are counted into |stats| if
+// it is not null.
+template <typename PuffReaderType,
+          typename BitWriterType,
+          typename HuffmanTableType>
+bool HuffBlockSymbols(PuffReaderType* pr,
+                      BitWriterType* bw,
+                      HuffmanTableType* ht,
+                      bool* end_of_block,
+                      DeflateStats* stats) {
+  PuffDataBatch batch;
+  // The symbols are counted regardless of |stats|, which is cheaper than
+  // checking it for every symbol.
+  uint64_t total_literals = 0;
+  uint64_t total_len_dists = 0;
+  // We read literal or distrance/lengths until and end of block or end of
+  // stream is reached.
+  while (true) {  // Returns when the end of block is reached.
+    TEST_AND_RETURN_FALSE(pr->GetNextBatch(&batch));
+    if (batch.size == 0) {
+      if (stats != nullptr) {
+        stats->literals += total_literals;
+        stats->len_dists += total_len_dists;
+      }
+      *end_of_block = false;
+      return true;
+    }
+    for (size_t idx = 0; idx < batch.size; idx++) {
+      switch (batch.types[idx]) {
+        case PuffData::Type::kLiterals:
+          TEST_AND_RETURN_FALSE(HuffLiterals(
+              batch.literals[idx], batch.lengths[idx], bw, ht));
+          total_literals += batch.lengths[idx];
+          break;
+
+        case PuffData::Type::kLenDist: {
+          auto len = batch.lengths[idx];
+          auto dist = batch.distances[idx];
+          TEST_AND_RETURN_FALSE(len >= 3 && len <= 258);
+          TEST_AND_RETURN_FALSE(dist >= 1 && dist <= 32768);
+
+          // The Huffman codes and the extra bits of the length and the
+          // distance are combined and written with one call.
+          const auto& length_symbol = LengthSymbol(len);
+          uint16_t length_huffman;
+          size_t nbits;
+          TEST_AND_RETURN_FALSE(ht->LitLenHuffman(length_symbol.symbol + 257,
+                                                  &length_huffman, &nbits));
+          uint64_t bits =
+              length_huffman |
+              (static_cast<uint64_t>(length_symbol.extra_bits_value) << nbits);
+          size_t total_bits = nbits + length_symbol.extra_bits_len;
+
+          auto distance_symbol = DistanceSymbol(dist);
+          uint16_t distance_huffman;
+          TEST_AND_RETURN_FALSE(ht->DistanceHuffman(
+              distance_symbol.symbol, &distance_huffman, &nbits));
+          bits |= static_cast<uint64_t>(distance_huffman) << total_bits;
+          total_bits += nbits;
+          bits |= static_cast<uint64_t>(distance_symbol.extra_bits_value)
+                  << total_bits;
+          total_bits += distance_symbol.extra_bits_len;
+          TEST_AND_RETURN_FALSE(bw->WriteLongBits(total_bits, bits));
+          total_len_dists++;
+          break;
+        }
+
+        case PuffData::Type::kEndOfBlock: {
+          uint16_t eos_huffman;
+          size_t nbits;
+          TEST_AND_RETURN_FALSE(ht->LitLenHuffman(256, &eos_huffman, &nbits));
+          TEST_AND_RETURN_FALSE(bw->WriteBits(nbits, eos_huffman));
+          if (stats != nullptr) {
+            stats->literals += total_literals;
+            stats->len_dists += total_len_dists;
+          }
+          *end_of_block = true;
+          return true;
+        }
+
+        default:
+          LOG(ERROR) << "Invalid block data type!";
+          return false;
+      }
+    }
+  }
+}
+
+// Calls |HuffBlockSymbols| timed as |DeflateStats::kSymbolsPhase| of |stats|.
+template <typename PuffReaderType,
+          typename BitWriterType,
+          typename HuffmanTableType>
+bool HuffCompressedBlock(PuffReaderType* pr,
+                         BitWriterType* bw,
+                         HuffmanTableType* ht,
+                         bool* end_of_block,
+                         DeflateStats* stats) {
+  PhaseTimer timer(stats, DeflateStats::kSymbolsPhase);
+  return HuffBlockSymbols(pr, bw, ht, end_of_block, stats);
+}
+
+}  // namespace
+
+HuffDeflateState::HuffDeflateState()
+    : in_block_(false), fixed_block_(false), dyn_ht_(new HuffmanTable()) {}
+
+HuffDeflateState::~HuffDeflateState() {}
+
+Huffer::Huffer() : dyn_ht_(new HuffmanTable()), stats_(nullptr) {}
 
 Huffer::~Huffer() {}
 
+uint64_t Huffer::DynamicTableCacheHits() const {
+  return dyn_ht_->CacheHits();
+}
+
+uint64_t Huffer::DynamicTableCacheMisses() const {
+  return dyn_ht_->CacheMisses();
+}
+
 bool Huffer::HuffDeflate(PuffReaderInterface* pr,
                          BitWriterInterface* bw) const {
+  return HufferInternal::HuffDeflateImpl(*this, pr, bw, nullptr);
+}
+
+bool HufferInternal::HuffDeflate(const Huffer& huffer,
+                                 PuffReaderInterface* pr,
+                                 BitWriterInterface* bw) {
+  return huffer.HuffDeflate(pr, bw);
+}
+
+bool HufferInternal::HuffDeflate(const Huffer& huffer,
+                                 BufferPuffReader* pr,
+                                 BufferBitWriter* bw) {
+  return HuffDeflateImpl(huffer, pr, bw, nullptr);
+}
+
+bool HufferInternal::HuffDeflatePart(const Huffer& huffer,
+                                     BufferPuffReader* pr,
+                                     BufferBitWriter* bw,
+                                     HuffDeflateState* state) {
+  return HuffDeflateImpl(huffer, pr, bw, state);
+}
+
+template <typename PuffReaderType, typename BitWriterType>
+bool HufferInternal::HuffDeflateImpl(const Huffer& huffer,
+                                     PuffReaderType* pr,
+                                     BitWriterType* bw,
+                                     HuffDeflateState* state) {
+  if (huffer.stats_ == nullptr) {
+    return HuffDeflateBlocks(huffer, pr, bw, state);
+  }
+  auto puff_bytes_left = pr->BytesLeft();
+  auto deflate_offset = bw->OffsetInBits();
+  auto success = HuffDeflateBlocks(huffer, pr, bw, state);
+  huffer.stats_->puff_bytes += puff_bytes_left - pr->BytesLeft();
+  huffer.stats_->deflate_bits += bw->OffsetInBits() - deflate_offset;
+  return success;
+}
+
+template <typename PuffReaderType, typename BitWriterType>
+bool HufferInternal::HuffDeflateBlocks(const Huffer& huffer,
+                                       PuffReaderType* pr,
+                                       BitWriterType* bw,
+                                       HuffDeflateState* state) {
   PuffData pd;
-  HuffmanTable* cur_ht = nullptr;
+  FixedHuffmanTable fixed_ht;
+  // A puff huffed in parts keeps its own dynamic Huffman table, because the
+  // table of the block a part ends in has to outlive this call.
+  HuffmanTable* dyn_ht =
+      state != nullptr ? state->dyn_ht_.get() : huffer.dyn_ht_.get();
+  bool end_of_block;
+  if (state != nullptr && state->in_block_) {
+    // Continue the compressed block the last part ended in.
+    if (state->fixed_block_) {
+      TEST_AND_RETURN_FALSE(
+          HuffCompressedBlock(pr, bw, &fixed_ht, &end_of_block, huffer.stats_));
+    } else {
+      TEST_AND_RETURN_FALSE(
+          HuffCompressedBlock(pr, bw, dyn_ht, &end_of_block, huffer.stats_));
+    }
+    state->in_block_ = !end_of_block;
+  }
+
   // If no bytes left for PuffReader to read, bail out.
   while (pr->BytesLeft() != 0) {
     TEST_AND_RETURN_FALSE(pr->GetNext(&pd));
@@ -45,15 +277,21 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
     TEST_AND_RETURN_FALSE(bw->WriteBits(1, final_bit));
     TEST_AND_RETURN_FALSE(bw->WriteBits(2, type));
     switch (static_cast<BlockType>(type)) {
-      case BlockType::kUncompressed:
+      case BlockType::kUncompressed: {
+        PhaseTimer timer(huffer.stats_, DeflateStats::kUncompressedPhase);
         bw->WriteBoundaryBits(skipped_bits);
         TEST_AND_RETURN_FALSE(pr->GetNext(&pd));
         TEST_AND_RETURN_FALSE(pd.type != PuffData::Type::kLiteral);
 
+        size_t length = 0;
         if (pd.type == PuffData::Type::kLiterals) {
+          length = pd.length;
           TEST_AND_RETURN_FALSE(bw->WriteBits(16, pd.length));
           TEST_AND_RETURN_FALSE(bw->WriteBits(16, ~pd.length));
-          TEST_AND_RETURN_FALSE(bw->WriteBytes(pd.length, pd.read_fn));
+          TEST_AND_RETURN_FALSE(ForEachLiteralsChunk(
+              pd, [bw](const uint8_t* bytes, size_t count) {
+                return bw->WriteBytes(count, bytes);
+              }));
           // Reading end of block, but don't write anything.
           TEST_AND_RETURN_FALSE(pr->GetNext(&pd));
           TEST_AND_RETURN_FALSE(pd.type == PuffData::Type::kEndOfBlock);
@@ -64,19 +302,32 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
           LOG(ERROR) << "Uncompressed block did not end properly!";
           return false;
         }
+        if (huffer.stats_ != nullptr) {
+          huffer.stats_->blocks[type]++;
+          huffer.stats_->literals += length;
+        }
         // We have to read a new block.
         continue;
+      }
 
       case BlockType::kFixed:
-        fix_ht_->BuildFixedHuffmanTable();
-        cur_ht = fix_ht_.get();
+        if (huffer.stats_ != nullptr) {
+          huffer.stats_->blocks[type]++;
+        }
         break;
 
-      case BlockType::kDynamic:
-        cur_ht = dyn_ht_.get();
-        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+      case BlockType::kDynamic: {
+        PhaseTimer timer(huffer.stats_, DeflateStats::kBlockHeaderPhase);
+        auto cache_misses = dyn_ht->CacheMisses();
+        TEST_AND_RETURN_FALSE(dyn_ht->BuildDynamicHuffmanTable(
             &pd.block_metadata[1], pd.length - 1, bw));
+        if (huffer.stats_ != nullptr) {
+          huffer.stats_->blocks[type]++;
+          huffer.stats_->dynamic_table_builds +=
+              dyn_ht->CacheMisses() - cache_misses;
+        }
         break;
+      }
 
       default:
         LOG(ERROR) << "Invalid block compression type: "
@@ -84,104 +335,26 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
         return false;
     }
 
-    // We read literal or distrance/lengths until and end of block or end of
-    // stream is reached.
-    bool block_ended = false;
-    while (!block_ended) {
-      TEST_AND_RETURN_FALSE(pr->GetNext(&pd));
-      switch (pd.type) {
-        case PuffData::Type::kLiteral:
-        case PuffData::Type::kLiterals: {
-          auto write_literal = [&cur_ht, &bw](uint8_t literal) {
-            uint16_t literal_huffman;
-            size_t nbits;
-            TEST_AND_RETURN_FALSE(
-                cur_ht->LitLenHuffman(literal, &literal_huffman, &nbits));
-            TEST_AND_RETURN_FALSE(bw->WriteBits(nbits, literal_huffman));
-            return true;
-          };
-
-          if (pd.type == PuffData::Type::kLiteral) {
-            TEST_AND_RETURN_FALSE(write_literal(pd.byte));
-          } else {
-            auto len = pd.length;
-            while (len-- > 0) {
-              uint8_t literal;
-              pd.read_fn(&literal, 1);
-              TEST_AND_RETURN_FALSE(write_literal(literal));
-            }
-          }
-          break;
-        }
-        case PuffData::Type::kLenDist: {
-          auto len = pd.length;
-          auto dist = pd.distance;
-          TEST_AND_RETURN_FALSE(len >= 3 && len <= 258);
-
-          // Using a binary search here instead of the linear search may be (but
-          // not necessarily) faster. Needs experiment to validate.
-          size_t index = 0;
-          while (len > kLengthBases[index]) {
-            index++;
-          }
-          if (len < kLengthBases[index]) {
-            index--;
-          }
-          auto extra_bits_len = kLengthExtraBits[index];
-          uint16_t length_huffman;
-          size_t nbits;
-          TEST_AND_RETURN_FALSE(
-              cur_ht->LitLenHuffman(index + 257, &length_huffman, &nbits));
-
-          TEST_AND_RETURN_FALSE(bw->WriteBits(nbits, length_huffman));
-
-          if (extra_bits_len > 0) {
-            TEST_AND_RETURN_FALSE(
-                bw->WriteBits(extra_bits_len, len - kLengthBases[index]));
-          }
-
-          // Same as above (binary search).
-          index = 0;
-          while (dist > kDistanceBases[index]) {
-            index++;
-          }
-          if (dist < kDistanceBases[index]) {
-            index--;
-          }
-          extra_bits_len = kDistanceExtraBits[index];
-          uint16_t distance_huffman;
-          TEST_AND_RETURN_FALSE(
-              cur_ht->DistanceHuffman(index, &distance_huffman, &nbits));
-
-          TEST_AND_RETURN_FALSE(bw->WriteBits(nbits, distance_huffman));
-          if (extra_bits_len > 0) {
-            TEST_AND_RETURN_FALSE(
-                bw->WriteBits(extra_bits_len, dist - kDistanceBases[index]));
-          }
-          break;
-        }
-
-        case PuffData::Type::kEndOfBlock: {
-          uint16_t eos_huffman;
-          size_t nbits;
-          TEST_AND_RETURN_FALSE(
-              cur_ht->LitLenHuffman(256, &eos_huffman, &nbits));
-          TEST_AND_RETURN_FALSE(bw->WriteBits(nbits, eos_huffman));
-          block_ended = true;
-          break;
-        }
-        case PuffData::Type::kBlockMetadata:
-          LOG(ERROR) << "Not expecing a metadata!";
-          return false;
-
-        default:
-          LOG(ERROR) << "Invalid block data type!";
-          return false;
-      }
+    bool fixed_block = static_cast<BlockType>(type) == BlockType::kFixed;
+    if (fixed_block) {
+      TEST_AND_RETURN_FALSE(
+          HuffCompressedBlock(pr, bw, &fixed_ht, &end_of_block, huffer.stats_));
+    } else {
+      TEST_AND_RETURN_FALSE(
+          HuffCompressedBlock(pr, bw, dyn_ht, &end_of_block, huffer.stats_));
+    }
+    if (!end_of_block) {
+      // Only a part of a puff can end in the middle of a block.
+      TEST_AND_RETURN_FALSE(state != nullptr);
+      state->in_block_ = true;
+      state->fixed_block_ = fixed_block;
+      return true;
     }
   }
 
-  TEST_AND_RETURN_FALSE(bw->Flush());
+  if (state == nullptr) {
+    TEST_AND_RETURN_FALSE(bw->Flush());
+  }
   return true;
 }
 
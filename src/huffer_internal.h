@@ -0,0 +1,98 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_HUFFER_INTERNAL_H_
+#define SRC_HUFFER_INTERNAL_H_
+
+#include <memory>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+
+namespace puffin {
+
+class BufferBitWriter;
+class BufferPuffReader;
+
+// The state of a puff that is huffed in parts with
+// |HufferInternal::HuffDeflatePart|.
+class HuffDeflateState {
+ public:
+  HuffDeflateState();
+  ~HuffDeflateState();
+
+  // Returns true if the last part ended in the middle of a compressed block,
+  // after its block metadata.
+  bool InBlock() const { return in_block_; }
+
+  // Prepares the state for huffing a new puff.
+  void Reset() { in_block_ = false; }
+
+ private:
+  friend class HufferInternal;
+
+  // True if the last part ended in the middle of a compressed block, which is
+  // fixed if |fixed_block_| is true, or uses |dyn_ht_| otherwise.
+  bool in_block_;
+  bool fixed_block_;
+
+  std::unique_ptr<HuffmanTable> dyn_ht_;
+
+  DISALLOW_COPY_AND_ASSIGN(HuffDeflateState);
+};
+
+// The huffing methods of |Huffer| that take the concrete puff readers and bit
+// writers of puffin, so they are not a part of its exported API.
+class HufferInternal {
+ public:
+  // Same as |Huffer::HuffDeflate|. The overload after this one is specialized
+  // for the buffer based reader and writer. The compiler picks it whenever the
+  // concrete types are known to the caller, which allows the hot loops to be
+  // inlined.
+  static bool HuffDeflate(const Huffer& huffer,
+                          PuffReaderInterface* pr,
+                          BitWriterInterface* bw);
+  static bool HuffDeflate(const Huffer& huffer,
+                          BufferPuffReader* pr,
+                          BufferBitWriter* bw);
+
+  // Huffs the records in |pr| into |bw| the same way as |HuffDeflate|, but
+  // |pr| can start and end in the middle of a compressed block, so a puff can
+  // be huffed in parts as it arrives. |pr| must only have whole records (see
+  // |BufferPuffReader::WholeRecordsSize|) and start in a block if
+  // |state->InBlock()|. |bw| is not flushed, so the parts of a puff can be
+  // written into the same bit stream.
+  //
+  // |state| IN/OUT  A new (or |Reset()|) |HuffDeflateState| for each puff.
+  static bool HuffDeflatePart(const Huffer& huffer,
+                              BufferPuffReader* pr,
+                              BufferBitWriter* bw,
+                              HuffDeflateState* state);
+
+ private:
+  friend class Huffer;
+
+  // The actual implementation of all the huffing methods for any combination
+  // of puff reader and bit writer types. It counts the bytes read and written
+  // into the stats of |huffer| around |HuffDeflateBlocks|.
+  template <typename PuffReaderType, typename BitWriterType>
+  static bool HuffDeflateImpl(const Huffer& huffer,
+                              PuffReaderType* pr,
+                              BitWriterType* bw,
+                              HuffDeflateState* state);
+
+  // Huffs the blocks of the puff in |pr| into |bw|. It huffs the whole puff
+  // and flushes |bw| if |state| is null.
+  template <typename PuffReaderType, typename BitWriterType>
+  static bool HuffDeflateBlocks(const Huffer& huffer,
+                                PuffReaderType* pr,
+                                BitWriterType* bw,
+                                HuffDeflateState* state);
+
+  DISALLOW_COPY_AND_ASSIGN(HufferInternal);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_HUFFER_INTERNAL_H_
@@ -5,6 +5,7 @@
 #include "puffin/src/huffman_table.h"
 
 #include <algorithm>
+#include <cstring>
 #include <vector>
 
 #include "puffin/src/logging.h"
@@ -19,33 +20,192 @@ const uint8_t kPermutations[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
 // The bases of each alphabet which is added to the integer value of extra
 // bits that comes after the Huffman code in the input to create the given
 // length value. The last element is a guard.
-const uint16_t kLengthBases[30] = {
+constexpr uint16_t kLengthBases[30] = {
     3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23,  27,
     31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0xFFFF};
 
 // Number of extra bits that comes after the associating Huffman code.
-const uint8_t kLengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
-                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
-                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint8_t kLengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
 
 // Same as |kLengthBases| but for the distances instead of lengths. The last
 // element is a guard.
-const uint16_t kDistanceBases[31] = {
+constexpr uint16_t kDistanceBases[31] = {
     1,    2,    3,    4,    5,    7,     9,     13,    17,    25,   33,
     49,   65,   97,   129,  193,  257,   385,   513,   769,   1025, 1537,
     2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 0xFFFF};
 
 // Same as |kLengthExtraBits| but for distances instead of lengths.
-const uint8_t kDistanceExtraBits[30] = {0, 0, 0,  0,  1,  1,  2,  2,  3,  3,
-                                        4, 4, 5,  5,  6,  6,  7,  7,  8,  8,
-                                        9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+constexpr uint8_t kDistanceExtraBits[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
 
-// 288 is the maximum number of needed huffman codes for an alphabet. Fixed
-// huffman table needs 288 and dynamic huffman table needs maximum 286.
-// 286 = 256 (coding a byte) +
-//         1 (coding the end of block symbole) +
-//        29 (coding the lengths)
-HuffmanTable::HuffmanTable() : codeindexpairs_(288), initialized_(false) {}
+namespace {
+
+constexpr uint32_t LengthEntry(size_t index) {
+  return (static_cast<uint32_t>(kLengthBases[index])
+          << kHuffmanEntryValueShift) |
+         kHuffmanEntryLength | (index << kHuffmanEntrySymbolShift) |
+         (kLengthExtraBits[index] << kHuffmanEntryExtraBitsShift);
+}
+
+// Returns the decode table entry of a literal/length |alphabet| without the
+// number of bits of its code. 286 and 287 have codes in the fixed Huffman
+// table, but they never appear in a valid deflate stream.
+constexpr uint32_t LitLenAlphabetEntry(size_t alphabet) {
+  return alphabet < 256
+             ? (alphabet << kHuffmanEntryValueShift) | kHuffmanEntryLiteral
+             : alphabet == 256
+                   ? kHuffmanEntryEndOfBlock
+                   : alphabet <= 285 ? LengthEntry(alphabet - 257)
+                                     : kHuffmanEntryInvalid;
+}
+
+// Same as |LitLenAlphabetEntry| but for distances.
+constexpr uint32_t DistanceAlphabetEntry(size_t alphabet) {
+  return alphabet < 30
+             ? (static_cast<uint32_t>(kDistanceBases[alphabet])
+                << kHuffmanEntryValueShift) |
+                   kHuffmanEntryDistance |
+                   (alphabet << kHuffmanEntrySymbolShift) |
+                   (kDistanceExtraBits[alphabet]
+                    << kHuffmanEntryExtraBitsShift)
+             : kHuffmanEntryInvalid;
+}
+
+// Reverses the order of the lower |nbits| bits of |code|.
+constexpr uint32_t ReverseBits(uint32_t code, size_t nbits) {
+  return nbits == 0 ? 0
+                    : ((code & 1) << (nbits - 1)) |
+                          ReverseBits(code >> 1, nbits - 1);
+}
+
+// The fixed literal/length code lengths are: 8 for 0-143, 9 for 144-255, 7 for
+// 256-279 and 8 for 280-287.
+constexpr uint8_t FixedLitLenLength(size_t alphabet) {
+  return alphabet < 144 ? 8 : alphabet < 256 ? 9 : alphabet < 280 ? 7 : 8;
+}
+
+// Returns the fixed literal/length code of |alphabet| (not bit reversed).
+constexpr uint32_t FixedLitLenCode(size_t alphabet) {
+  return alphabet < 144
+             ? 0x30 + alphabet
+             : alphabet < 256 ? 0x190 + (alphabet - 144)
+                              : alphabet < 280 ? alphabet - 256
+                                               : 0xC0 + (alphabet - 280);
+}
+
+constexpr uint16_t FixedLitLenReversedCode(size_t alphabet) {
+  return ReverseBits(FixedLitLenCode(alphabet), FixedLitLenLength(alphabet));
+}
+
+constexpr uint16_t FixedDistanceReversedCode(size_t alphabet) {
+  return ReverseBits(alphabet, 5);
+}
+
+// Returns the decode table entry of the nine bit prefix |code| of the input.
+// The seven bit codes are 0x00-0x17, the eight bit codes 0x30-0xC7 and the
+// nine bit codes 0x190-0x1FF.
+constexpr uint32_t FixedLitLenCodeEntry(uint32_t code) {
+  return code < (0x18 << 2)
+             ? LitLenAlphabetEntry(256 + (code >> 2)) | 7
+             : code < (0xC0 << 1)
+                   ? LitLenAlphabetEntry((code >> 1) - 0x30) | 8
+                   : code < 0x190
+                         ? LitLenAlphabetEntry(280 + (code >> 1) - 0xC0) | 8
+                         : LitLenAlphabetEntry(144 + (code - 0x190)) | 9;
+}
+
+// The decode table is indexed by the input bits, which hold the codes bit
+// reversed.
+constexpr uint32_t FixedLitLenEntry(size_t bits) {
+  return FixedLitLenCodeEntry(ReverseBits(bits, 9));
+}
+
+constexpr uint32_t FixedDistanceEntry(size_t bits) {
+  return ReverseBits(bits, 5) < 30
+             ? DistanceAlphabetEntry(ReverseBits(bits, 5)) | 5
+             : kHuffmanEntryInvalid;
+}
+
+// Returns the symbol whose range of values, starting at |bases[symbol]|,
+// includes |value|. |bases| must end with a guard.
+constexpr size_t FindSymbol(const uint16_t* bases,
+                            size_t value,
+                            size_t symbol) {
+  return value < bases[symbol + 1] ? symbol
+                                   : FindSymbol(bases, value, symbol + 1);
+}
+
+constexpr LenDistSymbol MakeLengthSymbol(size_t length, size_t symbol) {
+  return {static_cast<uint8_t>(symbol), kLengthExtraBits[symbol],
+          static_cast<uint16_t>(length - kLengthBases[symbol])};
+}
+
+constexpr LenDistSymbol MakeDistanceSymbol(size_t distance, size_t symbol) {
+  return {static_cast<uint8_t>(symbol), kDistanceExtraBits[symbol],
+          static_cast<uint16_t>(distance - kDistanceBases[symbol])};
+}
+
+constexpr LenDistSymbol LengthSymbolOfIndex(size_t index) {
+  return MakeLengthSymbol(index + 3, FindSymbol(kLengthBases, index + 3, 0));
+}
+
+constexpr LenDistSymbol DistanceSymbolOfIndex(size_t index) {
+  return MakeDistanceSymbol(index + 1,
+                            FindSymbol(kDistanceBases, index + 1, 0));
+}
+
+constexpr LenDistSymbol HighDistanceSymbolOfIndex(size_t index) {
+  return DistanceSymbolOfIndex(index << 8);
+}
+
+// Returns the 64-bit FNV-1a hash of |length| bytes of |data|.
+uint64_t HashBytes(const uint8_t* data, size_t length) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash = (hash ^ data[idx]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+const TableArray<LenDistSymbol, 256> kLengthSymbols =
+    GenerateArray<LenDistSymbol, LengthSymbolOfIndex>(MakeIndexSequence<256>());
+
+const TableArray<LenDistSymbol, 512> kDistanceSymbols =
+    GenerateArray<LenDistSymbol, DistanceSymbolOfIndex>(
+        MakeIndexSequence<512>());
+
+const TableArray<LenDistSymbol, 128> kHighDistanceSymbols =
+    GenerateArray<LenDistSymbol, HighDistanceSymbolOfIndex>(
+        MakeIndexSequence<128>());
+
+const TableArray<uint32_t, 1 << 9> FixedHuffmanTable::kLitLenEntries =
+    GenerateArray<uint32_t, FixedLitLenEntry>(MakeIndexSequence<1 << 9>());
+
+const TableArray<uint32_t, 1 << 5> FixedHuffmanTable::kDistanceEntries =
+    GenerateArray<uint32_t, FixedDistanceEntry>(MakeIndexSequence<1 << 5>());
+
+const TableArray<uint16_t, 288> FixedHuffmanTable::kLitLenCodes =
+    GenerateArray<uint16_t, FixedLitLenReversedCode>(MakeIndexSequence<288>());
+
+const TableArray<uint8_t, 288> FixedHuffmanTable::kLitLenLens =
+    GenerateArray<uint8_t, FixedLitLenLength>(MakeIndexSequence<288>());
+
+const TableArray<uint16_t, 30> FixedHuffmanTable::kDistanceCodes =
+    GenerateArray<uint16_t, FixedDistanceReversedCode>(MakeIndexSequence<30>());
+
+constexpr size_t HuffmanTable::kMaxCachedTables;
+
+HuffmanTable::HuffmanTable()
+    : initialized_(false),
+      live_table_(-1),
+      cache_clock_(0),
+      cache_hits_(0),
+      cache_misses_(0) {}
 
 bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
   // Temporary buffers used in |InitHuffmanCodes|.
@@ -63,10 +223,13 @@ bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
     }
   }
 
-  // Check for oversubscribed code lengths. (A code with length 'L' cannot have
-  // more than 2^L items.
+  // Check for oversubscribed code lengths. (All the codes together cannot
+  // cover more than the whole code space, otherwise they would not be prefix
+  // free and the decode table could not represent them.)
+  int left = 1;
   for (size_t idx = 1; idx <= *max_bits; idx++) {
-    if (len_count_[idx] > (1 << idx)) {
+    left = (left << 1) - len_count_[idx];
+    if (left < 0) {
       LOG(ERROR) << "Oversubscribed code lengths error!";
       return false;
     }
@@ -80,7 +243,12 @@ bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
     next_code_[bits] = code;
   }
 
+  // 286 is the maximum number of needed huffman codes for an alphabet.
+  // 286 = 256 (coding a byte) +
+  //         1 (coding the end of block symbole) +
+  //        29 (coding the lengths)
   codeindexpairs_.clear();
+  codeindexpairs_.reserve(286);
   // 3. Calculate all the code values.
   for (size_t idx = 0; idx < lens.size(); idx++) {
     auto len = lens[idx];
@@ -104,27 +272,132 @@ bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
   return true;
 }
 
+uint32_t HuffmanTable::AlphabetEntry(TableType type, uint16_t alphabet) {
+  switch (type) {
+    case TableType::kCode:
+      return (alphabet << kHuffmanEntryValueShift) | kHuffmanEntryLiteral;
+
+    case TableType::kLitLen:
+      return LitLenAlphabetEntry(alphabet);
+
+    case TableType::kDistance:
+      return DistanceAlphabetEntry(alphabet);
+  }
+  return kHuffmanEntryInvalid;
+}
+
 bool HuffmanTable::BuildHuffmanCodes(const Buffer& lens,
-                                     std::vector<uint16_t>* hcodes,
+                                     TableType type,
+                                     size_t max_root_bits,
+                                     std::vector<uint32_t>* hcodes,
+                                     size_t* root_bits,
                                      size_t* max_bits) {
   TEST_AND_RETURN_FALSE(InitHuffmanCodes(lens, max_bits));
-  // Sort descending based on the bit-length of the code.
-  std::sort(codeindexpairs_.begin(), codeindexpairs_.end(),
-            [&lens](const CodeIndexPair& a, const CodeIndexPair& b) {
-              return lens[a.index] > lens[b.index];
-            });
+  TEST_AND_RETURN_FALSE(max_root_bits <= kLitLenRootBits);
+  *root_bits = std::min(*max_bits, max_root_bits);
+  uint32_t root_mask = (1U << *root_bits) - 1;
+
+  // Find the number of bits indexing the subtable of each root entry, which is
+  // the number of remaining bits of the longest code having the root entry as
+  // its prefix. Zero means the root entry does not need a subtable.
+  uint8_t sub_bits[1 << kLitLenRootBits];
+  size_t table_size = 1 << *root_bits;
+  bool has_subtables = *max_bits > *root_bits;
+  if (has_subtables) {
+    memset(sub_bits, 0, table_size);
+    for (const auto& cip : codeindexpairs_) {
+      auto len = lens[cip.index];
+      if (len > *root_bits) {
+        auto& bits = sub_bits[cip.code & root_mask];
+        bits = std::max(bits, static_cast<uint8_t>(len - *root_bits));
+      }
+    }
+    for (size_t idx = 0; idx <= root_mask; idx++) {
+      table_size += sub_bits[idx] ? (1 << sub_bits[idx]) : 0;
+    }
+  }
 
   // Only zero out the part of hcodes which is valuable.
-  memset(hcodes->data(), 0, (1 << *max_bits) * sizeof(uint16_t));
+  if (hcodes->size() < table_size) {
+    hcodes->resize(table_size);
+  }
+  memset(hcodes->data(), 0, table_size * sizeof(uint32_t));
+
+  // Place the subtables right after the root and point to them.
+  uint32_t sub_offsets[1 << kLitLenRootBits];
+  if (has_subtables) {
+    uint32_t offset = 1 << *root_bits;
+    for (size_t idx = 0; idx <= root_mask; idx++) {
+      if (sub_bits[idx] != 0) {
+        sub_offsets[idx] = offset;
+        (*hcodes)[idx] = (offset << kHuffmanEntryValueShift) |
+                         kHuffmanEntrySubtable | sub_bits[idx];
+        offset += 1 << sub_bits[idx];
+      }
+    }
+  }
+
   for (const auto& cip : codeindexpairs_) {
-    // The MSB bit of the code in hcodes is set if it is a valid code and its
-    // code exists in the input Huffman table.
-    (*hcodes)[cip.code] = cip.index | 0x8000;
-    auto fill_bits = *max_bits - lens[cip.index];
-    for (auto idx = 1; idx < (1 << fill_bits); idx++) {
-      auto location = (idx << lens[cip.index]) | cip.code;
-      if (!((*hcodes)[location] & 0x8000)) {
-        (*hcodes)[location] = cip.index | 0x8000;
+    // Entries without a code in the input Huffman table stay zero (invalid).
+    // Codes are stored bit reversed, so all the entries whose low bits match
+    // the code decode into it.
+    auto len = lens[cip.index];
+    uint32_t entry = AlphabetEntry(type, cip.index) | len;
+    uint32_t* table;
+    size_t code;
+    size_t fill_bits;
+    if (len <= *root_bits) {
+      table = hcodes->data();
+      code = cip.code;
+      fill_bits = *root_bits - len;
+    } else {
+      auto prefix = cip.code & root_mask;
+      table = hcodes->data() + sub_offsets[prefix];
+      code = cip.code >> *root_bits;
+      len -= *root_bits;
+      fill_bits = sub_bits[prefix] - len;
+    }
+    for (size_t idx = 0; idx < (1U << fill_bits); idx++) {
+      table[(idx << len) | code] = entry;
+    }
+  }
+
+  if (type == TableType::kLitLen) {
+    // Combine the root entries of short literal codes with the literals whose
+    // codes follow them in the remaining bits of the root index. Going
+    // backwards, because the following literals are looked up at smaller
+    // indices which still have to hold single literals.
+    auto literal_bits = [](uint32_t entry) -> size_t {
+      return (entry & kHuffmanEntryKindMask) == kHuffmanEntryLiteral
+                 ? entry & kHuffmanEntryBitsMask
+                 : kMaxHuffmanBits + 1;
+    };
+    for (size_t idx = root_mask + 1; idx-- > 0;) {
+      auto entry = (*hcodes)[idx];
+      auto nbits = literal_bits(entry);
+      if (nbits > *root_bits) {
+        continue;
+      }
+      auto second = (*hcodes)[idx >> nbits];
+      auto second_nbits = literal_bits(second);
+      if (nbits + second_nbits > *root_bits) {
+        continue;
+      }
+      uint32_t literals = (entry >> kHuffmanEntryValueShift) |
+                          ((second >> kHuffmanEntryValueShift) << 8);
+      nbits += second_nbits;
+      auto third = (*hcodes)[idx >> nbits];
+      auto third_nbits = literal_bits(third);
+      if (nbits + third_nbits <= *root_bits) {
+        nbits += third_nbits;
+        (*hcodes)[idx] = (literals << kHuffmanEntryValueShift) |
+                         kHuffmanEntryLiteral3 |
+                         ((third >> kHuffmanEntryValueShift)
+                          << kHuffmanEntryThirdLiteralShift) |
+                         nbits;
+      } else {
+        (*hcodes)[idx] = (literals << kHuffmanEntryValueShift) |
+                         kHuffmanEntryLiteral2 | nbits;
       }
     }
   }
@@ -153,56 +426,6 @@ bool HuffmanTable::BuildHuffmanReverseCodes(const Buffer& lens,
   return true;
 }
 
-bool HuffmanTable::BuildFixedHuffmanTable() {
-  if (!initialized_) {
-    // For all the vectors used in this class, we set the size in the
-    // constructor and we do not change the size later. This is for optimization
-    // purposes. The total size of data in this class is approximately
-    // 2KB. Because it is a constructor return values cannot be checked.
-    lit_len_lens_.resize(288);
-    lit_len_rcodes_.resize(288);
-    lit_len_hcodes_.resize(1 << 9);
-
-    distance_lens_.resize(30);
-    distance_rcodes_.resize(30);
-    distance_hcodes_.resize(1 << 5);
-
-    size_t i = 0;
-    while (i < 144) {
-      lit_len_lens_[i++] = 8;
-    }
-    while (i < 256) {
-      lit_len_lens_[i++] = 9;
-    }
-    while (i < 280) {
-      lit_len_lens_[i++] = 7;
-    }
-    while (i < 288) {
-      lit_len_lens_[i++] = 8;
-    }
-
-    i = 0;
-    while (i < 30) {
-      distance_lens_[i++] = 5;
-    }
-
-    TEST_AND_RETURN_FALSE(
-        BuildHuffmanCodes(lit_len_lens_, &lit_len_hcodes_, &lit_len_max_bits_));
-
-    TEST_AND_RETURN_FALSE(BuildHuffmanCodes(distance_lens_, &distance_hcodes_,
-                                            &distance_max_bits_));
-
-    TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-        lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_));
-
-    TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-        distance_lens_, &distance_rcodes_, &distance_max_bits_));
-
-    initialized_ = true;
-  }
-  return true;
-}
-
 bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
                                             uint8_t* buffer,
                                             size_t* length) {
@@ -210,13 +433,10 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
   if (!initialized_) {
     // Only resizing the arrays needed.
     code_lens_.resize(19);
-    code_hcodes_.resize(1 << 7);
+    code_hcodes_.resize(1 << kCodeRootBits);
 
     lit_len_lens_.resize(286);
-    lit_len_hcodes_.resize(1 << 15);
-
     distance_lens_.resize(30);
-    distance_hcodes_.resize(1 << 15);
 
     // 286: Maximum number of literal/lengths symbols.
     // 30: Maximum number of distance symbols.
@@ -238,17 +458,14 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
   TEST_AND_RETURN_FALSE(*length >= 3);
   size_t index = 0;
   TEST_AND_RETURN_FALSE(br->CacheBits(14));
-  buffer[index++] = br->ReadBits(5);  // HLIST
-  auto num_lit_len = br->ReadBits(5) + 257;
-  br->DropBits(5);
+  buffer[index] = br->ReadAndDropBits(5);  // HLIST
+  size_t num_lit_len = buffer[index++] + 257;
 
-  buffer[index++] = br->ReadBits(5);  // HDIST
-  auto num_distance = br->ReadBits(5) + 1;
-  br->DropBits(5);
+  buffer[index] = br->ReadAndDropBits(5);  // HDIST
+  size_t num_distance = buffer[index++] + 1;
 
-  buffer[index++] = br->ReadBits(4);  // HCLEN
-  auto num_codes = br->ReadBits(4) + 4;
-  br->DropBits(4);
+  buffer[index] = br->ReadAndDropBits(4);  // HCLEN
+  size_t num_codes = buffer[index++] + 4;
 
   TEST_AND_RETURN_FALSE(
       CheckHuffmanArrayLengths(num_lit_len, num_distance, num_codes));
@@ -259,14 +476,14 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
   // Two codes per byte
   for (; idx < num_codes; idx++) {
     TEST_AND_RETURN_FALSE(br->CacheBits(3));
-    code_lens_[kPermutations[idx]] = br->ReadBits(3);
+    uint8_t len = br->ReadAndDropBits(3);
+    code_lens_[kPermutations[idx]] = len;
     if (checked) {
-      buffer[index++] |= br->ReadBits(3);
+      buffer[index++] |= len;
     } else {
-      buffer[index] = br->ReadBits(3) << 4;
+      buffer[index] = len << 4;
     }
     checked = !checked;
-    br->DropBits(3);
   }
   // Pad the last byte if odd number of codes.
   if (checked) {
@@ -276,8 +493,9 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
     code_lens_[kPermutations[idx]] = 0;
   }
 
-  TEST_AND_RETURN_FALSE(
-      BuildHuffmanCodes(code_lens_, &code_hcodes_, &code_max_bits_));
+  TEST_AND_RETURN_FALSE(BuildHuffmanCodes(code_lens_, TableType::kCode,
+                                          kCodeRootBits, &code_hcodes_,
+                                          &code_root_bits_, &code_max_bits_));
 
   // Build literals/lengths and distance Huffman code length arrays.
   auto bytes_available = (*length - index);
@@ -296,14 +514,21 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
   distance_lens_.insert(distance_lens_.begin(), tmp_lens_.begin() + num_lit_len,
                         tmp_lens_.end());
 
-  TEST_AND_RETURN_FALSE(
-      BuildHuffmanCodes(lit_len_lens_, &lit_len_hcodes_, &lit_len_max_bits_));
+  *length = index;
+  if (LoadCachedTable(buffer, index, true)) {
+    return true;
+  }
+
+  TEST_AND_RETURN_FALSE(BuildHuffmanCodes(
+      lit_len_lens_, TableType::kLitLen, kLitLenRootBits, &lit_len_hcodes_,
+      &lit_len_root_bits_, &lit_len_max_bits_));
 
   // Build distance Huffman codes.
-  TEST_AND_RETURN_FALSE(BuildHuffmanCodes(distance_lens_, &distance_hcodes_,
-                                          &distance_max_bits_));
+  TEST_AND_RETURN_FALSE(BuildHuffmanCodes(
+      distance_lens_, TableType::kDistance, kDistanceRootBits,
+      &distance_hcodes_, &distance_root_bits_, &distance_max_bits_));
 
-  *length = index;
+  StoreCachedTable(buffer, index, true);
   return true;
 }
 
@@ -331,30 +556,31 @@ bool HuffmanTable::BuildHuffmanCodeLengths(BitReaderInterface* br,
       TEST_AND_RETURN_FALSE(code < 19);
       size_t copy_num = 0;
       uint8_t copy_val;
+      uint32_t extra;
       switch (code) {
         case 16:
           TEST_AND_RETURN_FALSE(idx != 0);
           TEST_AND_RETURN_FALSE(br->CacheBits(2));
-          copy_num = 3 + br->ReadBits(2);
-          buffer[index++] = 16 + br->ReadBits(2);  // 3 - 6 times
+          extra = br->ReadAndDropBits(2);
+          copy_num = 3 + extra;
+          buffer[index++] = 16 + extra;  // 3 - 6 times
           copy_val = (*lens)[idx - 1];
-          br->DropBits(2);
           break;
 
         case 17:
           TEST_AND_RETURN_FALSE(br->CacheBits(3));
-          copy_num = 3 + br->ReadBits(3);
-          buffer[index++] = 20 + br->ReadBits(3);  // 3 - 10 times
+          extra = br->ReadAndDropBits(3);
+          copy_num = 3 + extra;
+          buffer[index++] = 20 + extra;  // 3 - 10 times
           copy_val = 0;
-          br->DropBits(3);
           break;
 
         case 18:
           TEST_AND_RETURN_FALSE(br->CacheBits(7));
-          copy_num = 11 + br->ReadBits(7);
-          buffer[index++] = 28 + br->ReadBits(7);  // 11 - 138 times
+          extra = br->ReadAndDropBits(7);
+          copy_num = 11 + extra;
+          buffer[index++] = 28 + extra;  // 11 - 138 times
           copy_val = 0;
-          br->DropBits(7);
           break;
 
         default:
@@ -445,6 +671,11 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
   distance_lens_.insert(distance_lens_.begin(), tmp_lens_.begin() + num_lit_len,
                         tmp_lens_.end());
 
+  TEST_AND_RETURN_FALSE(length == index);
+  if (LoadCachedTable(buffer, length, false)) {
+    return true;
+  }
+
   // Build literal/lengths Huffman reverse codes.
   TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
       lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_));
@@ -453,11 +684,95 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
   TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
       distance_lens_, &distance_rcodes_, &distance_max_bits_));
 
-  TEST_AND_RETURN_FALSE(length == index);
-
+  StoreCachedTable(buffer, length, false);
   return true;
 }
 
+bool HuffmanTable::LoadCachedTable(const uint8_t* metadata,
+                                   size_t length,
+                                   bool decode) {
+  auto hash = HashBytes(metadata, length);
+  for (size_t idx = 0; idx < cache_.size(); idx++) {
+    auto& entry = cache_[idx];
+    if (entry.hash != hash || entry.decode != decode ||
+        entry.metadata.size() != length ||
+        memcmp(entry.metadata.data(), metadata, length) != 0) {
+      continue;
+    }
+    // Swap the tables of the entry in, unless they are already in use.
+    if (static_cast<int>(idx) != live_table_) {
+      ReleaseLiveTable();
+      SwapCachedTable(&entry);
+      live_table_ = idx;
+      if (decode) {
+        lit_len_root_bits_ = entry.lit_len_root_bits;
+        distance_root_bits_ = entry.distance_root_bits;
+      }
+      lit_len_max_bits_ = entry.lit_len_max_bits;
+      distance_max_bits_ = entry.distance_max_bits;
+    }
+    entry.last_use = ++cache_clock_;
+    cache_hits_++;
+    return true;
+  }
+  cache_misses_++;
+
+  // The tables are built into the buffers of the entry that was in use.
+  ReleaseLiveTable();
+  if (!decode) {
+    lit_len_rcodes_.resize(286);
+    distance_rcodes_.resize(30);
+  }
+  return false;
+}
+
+void HuffmanTable::StoreCachedTable(const uint8_t* metadata,
+                                    size_t length,
+                                    bool decode) {
+  size_t idx;
+  if (cache_.size() < kMaxCachedTables) {
+    idx = cache_.size();
+    cache_.emplace_back();
+  } else {
+    idx = std::min_element(cache_.begin(), cache_.end(),
+                           [](const CachedTable& a, const CachedTable& b) {
+                             return a.last_use < b.last_use;
+                           }) -
+          cache_.begin();
+  }
+  // The tables just built stay in use, and the entry gets them when they are
+  // released. Until then its own buffers are only reused for building.
+  auto& entry = cache_[idx];
+  entry.hash = HashBytes(metadata, length);
+  entry.metadata.assign(metadata, metadata + length);
+  entry.decode = decode;
+  entry.last_use = ++cache_clock_;
+  if (decode) {
+    entry.lit_len_root_bits = lit_len_root_bits_;
+    entry.distance_root_bits = distance_root_bits_;
+  }
+  entry.lit_len_max_bits = lit_len_max_bits_;
+  entry.distance_max_bits = distance_max_bits_;
+  live_table_ = idx;
+}
+
+void HuffmanTable::SwapCachedTable(CachedTable* entry) {
+  if (entry->decode) {
+    lit_len_hcodes_.swap(entry->lit_len_hcodes);
+    distance_hcodes_.swap(entry->distance_hcodes);
+  } else {
+    lit_len_rcodes_.swap(entry->lit_len_rcodes);
+    distance_rcodes_.swap(entry->distance_rcodes);
+  }
+}
+
+void HuffmanTable::ReleaseLiveTable() {
+  if (live_table_ >= 0) {
+    SwapCachedTable(&cache_[live_table_]);
+    live_table_ = -1;
+  }
+}
+
 bool HuffmanTable::BuildHuffmanCodeLengths(const uint8_t* buffer,
                                            size_t* length,
                                            BitWriterInterface* bw,
@@ -14,12 +14,67 @@
 #include "puffin/src/bit_writer.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/table_array.h"
 
 namespace puffin {
 
 // Maximum Huffman code length based on RFC1951.
 constexpr size_t kMaxHuffmanBits = 15;
 
+// The number of bits indexing the root of the literal/length and distance
+// decode tables. Codes longer than these are decoded through a second level
+// subtable that the root entry points to. This keeps the tables small (a few
+// KB) and cheap to build while most codes are still decoded in one lookup.
+constexpr size_t kLitLenRootBits = 10;
+constexpr size_t kDistanceRootBits = 8;
+
+// The code length codes are at most seven bits long, so their decode table
+// never needs subtables.
+constexpr size_t kCodeRootBits = 7;
+
+// Layout of the 32-bit entries of the Huffman decode tables. One lookup gives
+// everything needed to consume a symbol and its extra bits:
+//
+// +--------------------+-----+---------+-----+----+
+// |       VALUE        |KIND | SYMBOL  |EXTRA|BITS|
+// +--------------------+-----+---------+-----+----+
+// VALUE  -> Depends on KIND: The literal (or the code length code), the base
+//           of the length or distance, or the offset of the subtable. For
+//           multi-literal entries, the first literal is in the low byte and
+//           the second literal in the high byte.
+// KIND   -> One of |kHuffmanEntry{Invalid,Literal,...}| below.
+// SYMBOL -> The index of the length (alphabet - 257) or distance alphabet.
+// EXTRA  -> The number of extra bits following the code of a length or
+//           distance.
+// BITS   -> The number of bits in the code, or the number of bits indexing
+//           the subtable if KIND is |kHuffmanEntrySubtable|. For multi-literal
+//           entries, the total number of bits of all their codes.
+//
+// The third literal of a |kHuffmanEntryLiteral3| entry takes the place of the
+// EXTRA and SYMBOL fields.
+constexpr uint32_t kHuffmanEntryBitsMask = 0x000F;
+constexpr size_t kHuffmanEntryExtraBitsShift = 4;
+constexpr uint32_t kHuffmanEntryExtraBitsMask = 0x000F;
+constexpr size_t kHuffmanEntrySymbolShift = 8;
+constexpr uint32_t kHuffmanEntrySymbolMask = 0x001F;
+constexpr size_t kHuffmanEntryThirdLiteralShift = 4;
+constexpr size_t kHuffmanEntryKindShift = 13;
+constexpr uint32_t kHuffmanEntryKindMask = 0xE000;
+constexpr size_t kHuffmanEntryValueShift = 16;
+
+// Values of the KIND field of the decode table entries. Up to three literals
+// whose codes together fit in the root of the literal/length table are decoded
+// with one lookup. For those, |KIND >> kHuffmanEntryKindShift| is the number of
+// literals in the entry.
+constexpr uint32_t kHuffmanEntryInvalid = 0x0000;
+constexpr uint32_t kHuffmanEntryLiteral = 0x2000;
+constexpr uint32_t kHuffmanEntryLiteral2 = 0x4000;
+constexpr uint32_t kHuffmanEntryLiteral3 = 0x6000;
+constexpr uint32_t kHuffmanEntryLength = 0x8000;
+constexpr uint32_t kHuffmanEntryDistance = 0xA000;
+constexpr uint32_t kHuffmanEntryEndOfBlock = 0xC000;
+constexpr uint32_t kHuffmanEntrySubtable = 0xE000;
+
 // Permutations of input Huffman code lengths (used only to read
 // |dynamic_code_lens_|).
 extern const uint8_t kPermutations[];
@@ -39,6 +94,41 @@ extern const uint16_t kDistanceBases[];
 // Same as |kLengthExtraBits| except for distances instead of lengths.
 extern const uint8_t kDistanceExtraBits[];
 
+// The length or distance symbol (alphabet - 257 for lengths) of a length or
+// distance value, and the extra bits that follow its Huffman code.
+struct LenDistSymbol {
+  uint8_t symbol;
+  uint8_t extra_bits_len;
+  uint16_t extra_bits_value;
+};
+
+// The symbols of all the lengths (3-258), indexed by |length - 3|.
+extern const TableArray<LenDistSymbol, 256> kLengthSymbols;
+
+// The symbols of the distances 1-512, indexed by |distance - 1|.
+extern const TableArray<LenDistSymbol, 512> kDistanceSymbols;
+
+// The symbols of the distances 513-32768, indexed by |(distance - 1) >> 8|.
+// The ranges of all these symbols are aligned to 256, so all the distances of
+// an entry have the same symbol. The |extra_bits_value| fields are only valid
+// for the first distance of each entry; see |DistanceSymbol|.
+extern const TableArray<LenDistSymbol, 128> kHighDistanceSymbols;
+
+// Returns the symbol and extra bits of a |length| (3-258).
+inline const LenDistSymbol& LengthSymbol(size_t length) {
+  return kLengthSymbols.data[length - 3];
+}
+
+// Returns the symbol and extra bits of a |distance| (1-32768).
+inline LenDistSymbol DistanceSymbol(size_t distance) {
+  if (distance <= 512) {
+    return kDistanceSymbols.data[distance - 1];
+  }
+  auto symbol = kHighDistanceSymbols.data[(distance - 1) >> 8];
+  symbol.extra_bits_value = distance - kDistanceBases[symbol.symbol];
+  return symbol;
+}
+
 class HuffmanTable {
  public:
   HuffmanTable();
@@ -78,11 +168,8 @@ class HuffmanTable {
   // |nbits|    OUT  The number of bits in the Huffman code of alphabet.
   // Returns true if there is an alphabet associated with |bits|.
   inline bool CodeAlphabet(uint32_t bits, uint16_t* alphabet, size_t* nbits) {
-    auto hc = code_hcodes_[bits];
-    TEST_AND_RETURN_FALSE(hc & 0x8000);
-    *alphabet = hc & 0x7FFF;
-    *nbits = code_lens_[*alphabet];
-    return true;
+    return EntryAlphabet(LookUp(code_hcodes_, code_root_bits_, bits), alphabet,
+                         nbits);
   }
 
   // Returns the alphabet associated with the set of input bits for the
@@ -93,11 +180,7 @@ class HuffmanTable {
   // |nbits|    OUT  The number of bits in the Huffman code of the |alphabet|.
   // Returns true if there is an alphabet associated with |bits|.
   inline bool LitLenAlphabet(uint32_t bits, uint16_t* alphabet, size_t* nbits) {
-    auto hc = lit_len_hcodes_[bits];
-    TEST_AND_RETURN_FALSE(hc & 0x8000);
-    *alphabet = hc & 0x7FFF;
-    *nbits = lit_len_lens_[*alphabet];
-    return true;
+    return EntryAlphabet(FirstSymbolEntry(LitLenEntry(bits)), alphabet, nbits);
   }
 
   // Returns the alphabet associated with the set of input bits for the
@@ -110,11 +193,31 @@ class HuffmanTable {
   inline bool DistanceAlphabet(uint32_t bits,
                                uint16_t* alphabet,
                                size_t* nbits) {
-    auto hc = distance_hcodes_[bits];
-    TEST_AND_RETURN_FALSE(hc & 0x8000);
-    *alphabet = hc & 0x7FFF;
-    *nbits = distance_lens_[*alphabet];
-    return true;
+    return EntryAlphabet(DistanceEntry(bits), alphabet, nbits);
+  }
+
+  // Returns the decode table entry of the literal/length code at the beginning
+  // of the input |bits|. The entry has the layout described above and has not
+  // been checked for validity.
+  inline uint32_t LitLenEntry(uint32_t bits) const {
+    return LookUp(lit_len_hcodes_, lit_len_root_bits_, bits);
+  }
+
+  // Returns a |kHuffmanEntryLiteral| entry for only the first literal of a
+  // multi-literal literal/length |entry|. Other entries are returned as is.
+  inline uint32_t FirstSymbolEntry(uint32_t entry) const {
+    auto kind = entry & kHuffmanEntryKindMask;
+    if (kind != kHuffmanEntryLiteral2 && kind != kHuffmanEntryLiteral3) {
+      return entry;
+    }
+    uint32_t literal = (entry >> kHuffmanEntryValueShift) & 0xFF;
+    return (literal << kHuffmanEntryValueShift) | kHuffmanEntryLiteral |
+           lit_len_lens_[literal];
+  }
+
+  // Same as |LitLenEntry| but for distance codes.
+  inline uint32_t DistanceEntry(uint32_t bits) const {
+    return LookUp(distance_hcodes_, distance_root_bits_, bits);
   }
 
   // Returns the Huffman code of a give alphabet for Huffman table codes.
@@ -166,11 +269,6 @@ class HuffmanTable {
     return true;
   }
 
-  // This populates the object with fixed huffman table parameters.
-  // TODO(ahassani): Revamp the use of this function to be initiliazed once in
-  // the lifetime of the program and only one instance needed.
-  bool BuildFixedHuffmanTable();
-
   // This functions first reads the Huffman code length arrays from the input
   // deflate stream, then builds both literal/length and distance Huffman
   // code arrays. It also writes the Huffman table into the puffed stream.
@@ -197,19 +295,41 @@ class HuffmanTable {
                                 size_t length,
                                 BitWriterInterface* bw);
 
+  // Returns the number of dynamic Huffman tables that were found in the cache
+  // of recently built tables.
+  uint64_t CacheHits() const { return cache_hits_; }
+
+  // Returns the number of dynamic Huffman tables that were not found in the
+  // cache and had to be built.
+  uint64_t CacheMisses() const { return cache_misses_; }
+
  protected:
+  // The kind of alphabet a decode table is built for. It determines the
+  // content of the table entries.
+  enum class TableType { kCode, kLitLen, kDistance };
+
   // Initializes the Huffman codes from an array of lengths.
   //
   // |lens|     IN   The input array of code lengths.
   // |max_bits| OUT  The maximum number of bits used for the Huffman codes.
   bool InitHuffmanCodes(const Buffer& lens, size_t* max_bits);
 
-  // Creates the Huffman code to alphabet array.
-  // |lens|     IN   The input array of code lengths.
-  // |hcodes|   OUT  The Huffman to alphabet array.
-  // |max_bits| OUT  The maximum number of bits used for the Huffman codes.
+  // Creates the two-level Huffman code to alphabet decode table. The root of
+  // the table is indexed by the first |root_bits| bits of the input. Codes
+  // longer than that are put into subtables placed after the root, one for
+  // each root entry that is the prefix of at least one long code.
+  //
+  // |lens|          IN   The input array of code lengths.
+  // |type|          IN   The type of the alphabet coded by |lens|.
+  // |max_root_bits| IN   The maximum number of bits indexing the root.
+  // |hcodes|        OUT  The Huffman to alphabet decode table.
+  // |root_bits|     OUT  The number of bits indexing the root of |hcodes|.
+  // |max_bits|      OUT  The maximum number of bits used for the Huffman codes.
   bool BuildHuffmanCodes(const Buffer& lens,
-                         std::vector<uint16_t>* hcodes,
+                         TableType type,
+                         size_t max_root_bits,
+                         std::vector<uint32_t>* hcodes,
+                         size_t* root_bits,
                          size_t* max_bits);
 
   // Creates the alphabet to Huffman code array.
@@ -256,6 +376,97 @@ class HuffmanTable {
                                Buffer* lens);
 
  private:
+  // Looks up the entry of the input |bits| in the two-level decode table
+  // |hcodes| whose root is indexed by |root_bits| bits.
+  static inline uint32_t LookUp(const std::vector<uint32_t>& hcodes,
+                                size_t root_bits,
+                                uint32_t bits) {
+    auto entry = hcodes[bits & ((1U << root_bits) - 1)];
+    if ((entry & kHuffmanEntryKindMask) == kHuffmanEntrySubtable) {
+      auto sub_mask = (1U << (entry & kHuffmanEntryBitsMask)) - 1;
+      entry = hcodes[(entry >> kHuffmanEntryValueShift) +
+                     ((bits >> root_bits) & sub_mask)];
+    }
+    return entry;
+  }
+
+  // Converts a decode table |entry| back into its alphabet.
+  static inline bool EntryAlphabet(uint32_t entry,
+                                   uint16_t* alphabet,
+                                   size_t* nbits) {
+    auto symbol = (entry >> kHuffmanEntrySymbolShift) & kHuffmanEntrySymbolMask;
+    switch (entry & kHuffmanEntryKindMask) {
+      case kHuffmanEntryLiteral:
+        *alphabet = entry >> kHuffmanEntryValueShift;
+        break;
+      case kHuffmanEntryLength:
+        *alphabet = 257 + symbol;
+        break;
+      case kHuffmanEntryDistance:
+        *alphabet = symbol;
+        break;
+      case kHuffmanEntryEndOfBlock:
+        *alphabet = 256;
+        break;
+      default:
+        LOG(ERROR) << "No alphabet for the Huffman code.";
+        return false;
+    }
+    *nbits = entry & kHuffmanEntryBitsMask;
+    return true;
+  }
+
+  // Returns the decode table entry for |alphabet| in a table of type |type|,
+  // without the number of bits of its code.
+  static uint32_t AlphabetEntry(TableType type, uint16_t alphabet);
+
+  // The maximum number of dynamic Huffman tables kept in |cache_|.
+  static constexpr size_t kMaxCachedTables = 8;
+
+  // A built dynamic Huffman table. Compressors often use the same dynamic
+  // Huffman table for many blocks, so the literal/length and distance tables
+  // are kept keyed by the puffed Huffman table (the block metadata without the
+  // block header), which fully determines them.
+  struct CachedTable {
+    uint64_t hash;      // The hash of |metadata|.
+    Buffer metadata;    // The puffed Huffman table.
+    bool decode;        // Whether it holds decode or encode tables.
+    uint64_t last_use;  // For evicting the least recently used entry.
+
+    // Decode tables.
+    std::vector<uint32_t> lit_len_hcodes;
+    size_t lit_len_root_bits;
+    std::vector<uint32_t> distance_hcodes;
+    size_t distance_root_bits;
+
+    // Encode tables.
+    std::vector<uint16_t> lit_len_rcodes;
+    std::vector<uint16_t> distance_rcodes;
+
+    size_t lit_len_max_bits;
+    size_t distance_max_bits;
+  };
+
+  // Looks up the tables built for the puffed Huffman table |metadata| and
+  // swaps them into this object if they are in |cache_|. |decode| tells
+  // whether the decode or encode tables are needed. The code lengths must
+  // already be set. Returns true on a cache hit. On a miss, the buffers of the
+  // tables are ready for building new ones.
+  bool LoadCachedTable(const uint8_t* metadata, size_t length, bool decode);
+
+  // Makes the currently built tables for the puffed Huffman table |metadata|
+  // the ones of an entry of |cache_|, evicting the least recently used entry
+  // if it is full. The tables are not copied: they stay in use and the entry
+  // only gets them back when another table is needed.
+  void StoreCachedTable(const uint8_t* metadata, size_t length, bool decode);
+
+  // Swaps the decode or encode tables of this object, depending on the kind of
+  // |entry|, with the ones of |entry|.
+  void SwapCachedTable(CachedTable* entry);
+
+  // Gives the tables in use back to their entry of |cache_|, if any.
+  void ReleaseLiveTable();
+
   // A utility struct used to create Huffman codes.
   struct CodeIndexPair {
     uint16_t code;   // The Huffman code
@@ -267,12 +478,14 @@ class HuffmanTable {
 
   // Used in building Huffman codes for literals/lengths and distances.
   std::vector<uint8_t> lit_len_lens_;
-  std::vector<uint16_t> lit_len_hcodes_;
+  std::vector<uint32_t> lit_len_hcodes_;
   std::vector<uint16_t> lit_len_rcodes_;
+  size_t lit_len_root_bits_;
   size_t lit_len_max_bits_;
   std::vector<uint8_t> distance_lens_;
-  std::vector<uint16_t> distance_hcodes_;
+  std::vector<uint32_t> distance_hcodes_;
   std::vector<uint16_t> distance_rcodes_;
+  size_t distance_root_bits_;
   size_t distance_max_bits_;
 
   // The reason for keeping a temporary buffer here is to avoid reallocing each
@@ -282,15 +495,87 @@ class HuffmanTable {
   // Used in building Huffman codes for reading and decoding literal/length and
   // distance Huffman code length arrays.
   std::vector<uint8_t> code_lens_;
-  std::vector<uint16_t> code_hcodes_;
+  std::vector<uint32_t> code_hcodes_;
   std::vector<uint16_t> code_rcodes_;
+  size_t code_root_bits_;
   size_t code_max_bits_;
 
   bool initialized_;
 
+  // Recently built dynamic Huffman tables.
+  std::vector<CachedTable> cache_;
+  // The index of the entry of |cache_| whose tables are in use by this object,
+  // or -1. That entry holds the buffers of the tables used before instead.
+  int live_table_;
+  uint64_t cache_clock_;
+  uint64_t cache_hits_;
+  uint64_t cache_misses_;
+
   DISALLOW_COPY_AND_ASSIGN(HuffmanTable);
 };
 
+// The fixed Huffman codes (RFC1951 3.2.6). Their decode and encode tables are
+// generated at compile time (see huffman_table.cc) and shared read-only by all
+// users and threads. It has the subset of the |HuffmanTable| interface used
+// for decoding and encoding the symbols of a block, so the same code can work
+// with either of them. The constant maximum code lengths allow the compiler to
+// specialize that code for the fixed blocks.
+class FixedHuffmanTable {
+ public:
+  FixedHuffmanTable() = default;
+
+  static constexpr size_t LitLenMaxBits() { return 9; }
+
+  static constexpr size_t DistanceMaxBits() { return 5; }
+
+  static inline bool EndOfBlockBitLength(size_t* nbits) {
+    *nbits = 7;
+    return true;
+  }
+
+  // The root of the fixed literal/length table is indexed by all nine bits, so
+  // there are no subtables. The shortest literal code is eight bits long, so
+  // there are no multi-literal entries either.
+  static inline uint32_t LitLenEntry(uint32_t bits) {
+    return kLitLenEntries.data[bits & ((1U << LitLenMaxBits()) - 1)];
+  }
+
+  static inline uint32_t FirstSymbolEntry(uint32_t entry) { return entry; }
+
+  static inline uint32_t DistanceEntry(uint32_t bits) {
+    return kDistanceEntries.data[bits & ((1U << DistanceMaxBits()) - 1)];
+  }
+
+  static inline bool LitLenHuffman(uint16_t alphabet,
+                                   uint16_t* huffman,
+                                   size_t* nbits) {
+    TEST_AND_RETURN_FALSE(alphabet < 288);
+    *huffman = kLitLenCodes.data[alphabet];
+    *nbits = kLitLenLens.data[alphabet];
+    return true;
+  }
+
+  static inline bool DistanceHuffman(uint16_t alphabet,
+                                     uint16_t* huffman,
+                                     size_t* nbits) {
+    TEST_AND_RETURN_FALSE(alphabet < 30);
+    *huffman = kDistanceCodes.data[alphabet];
+    *nbits = DistanceMaxBits();
+    return true;
+  }
+
+ private:
+  // Decode tables with the same entries as the ones in |HuffmanTable|.
+  static const TableArray<uint32_t, 1 << 9> kLitLenEntries;
+  static const TableArray<uint32_t, 1 << 5> kDistanceEntries;
+
+  // The bit reversed codes of the alphabets and their lengths. All distance
+  // codes are five bits long.
+  static const TableArray<uint16_t, 288> kLitLenCodes;
+  static const TableArray<uint8_t, 288> kLitLenLens;
+  static const TableArray<uint16_t, 30> kDistanceCodes;
+};
+
 // The type of a block in a deflate stream.
 enum class BlockType : uint8_t {
   kUncompressed = 0x00,
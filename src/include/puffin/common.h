@@ -34,6 +34,18 @@ using Buffer = std::vector<uint8_t>;
 using UniqueBufferPtr = std::unique_ptr<Buffer>;
 using SharedBufferPtr = std::shared_ptr<Buffer>;
 
+// The layouts of a puff buffer. The value of each layout is the version stored
+// in the header of the puffin patches that use it.
+enum class PuffFormat {
+  // Literals, lengths/distances and block metadata are interleaved in the
+  // order they appear in the deflate stream.
+  kInterleaved = 1,
+
+  // Literals, lengths, distances and block metadata are kept in separate
+  // sections of each puff. See |BufferColumnarPuffWriter|.
+  kColumnar = 2,
+};
+
 // This class is similar to the protobuf generated for |ProtoByteExtent|. We
 // defined an extra class so the users of puffin do not have to include
 // puffin.pb.h and deal with its use.
@@ -9,6 +9,7 @@
 #include <memory>
 
 #include "puffin/common.h"
+#include "puffin/stats.h"
 
 namespace puffin {
 
@@ -25,9 +26,25 @@ class PUFFIN_EXPORT Huffer {
   // |PuffDeflate|.
   bool HuffDeflate(PuffReaderInterface* pr, BitWriterInterface* bw) const;
 
+  // Returns the number of dynamic Huffman tables that were reused from the
+  // cache of recently built tables (hits) or had to be built (misses).
+  uint64_t DynamicTableCacheHits() const;
+  uint64_t DynamicTableCacheMisses() const;
+
+  // Attaches |stats|, which from now on counts all the huffing done by this
+  // object, or detaches the current stats if |stats| is null. |stats| is owned
+  // by the caller and must stay valid while attached.
+  void SetStats(DeflateStats* stats) { stats_ = stats; }
+
  private:
+  // Implements the huffing for the concrete puff readers and bit writers used
+  // inside puffin.
+  friend class HufferInternal;
+
   std::unique_ptr<HuffmanTable> dyn_ht_;
-  std::unique_ptr<HuffmanTable> fix_ht_;
+
+  // The stats to count the work into, or null.
+  DeflateStats* stats_;
 
   DISALLOW_COPY_AND_ASSIGN(Huffer);
 };
@@ -27,13 +27,16 @@ namespace puffin {
 //                     responsibility of unlinking the file after the call to
 //                     |PuffDiff| finishes.
 // |puffin_patch| OUT  The patch that later can be used in |PuffPatch|.
+// |puff_format|  IN   The layout of the puffs that are diffed. It is recorded
+//                     in the patch, so |PuffPatch| uses the same layout.
 bool PuffDiff(UniqueStreamPtr src,
               UniqueStreamPtr dst,
               const std::vector<BitExtent>& src_deflates,
               const std::vector<BitExtent>& dst_deflates,
               const std::vector<bsdiff::CompressorType>& compressors,
               const std::string& tmp_filepath,
-              Buffer* patch);
+              Buffer* patch,
+              PuffFormat puff_format = PuffFormat::kInterleaved);
 
 // Similar to the function above, except that it accepts raw buffer rather than
 // stream.
@@ -43,7 +46,8 @@ bool PuffDiff(const Buffer& src,
               const std::vector<BitExtent>& dst_deflates,
               const std::vector<bsdiff::CompressorType>& compressors,
               const std::string& tmp_filepath,
-              Buffer* patch);
+              Buffer* patch,
+              PuffFormat puff_format = PuffFormat::kInterleaved);
 
 // The default puffdiff function that uses both bz2 and brotli to compress the
 // patch data.
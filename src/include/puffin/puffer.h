@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "puffin/common.h"
+#include "puffin/stats.h"
 #include "puffin/stream.h"
 
 namespace puffin {
@@ -28,9 +29,25 @@ class PUFFIN_EXPORT Puffer {
                    PuffWriterInterface* pw,
                    std::vector<BitExtent>* deflates) const;
 
+  // Returns the number of dynamic Huffman tables that were reused from the
+  // cache of recently built tables (hits) or had to be built (misses).
+  uint64_t DynamicTableCacheHits() const;
+  uint64_t DynamicTableCacheMisses() const;
+
+  // Attaches |stats|, which from now on counts all the puffing done by this
+  // object, or detaches the current stats if |stats| is null. |stats| is owned
+  // by the caller and must stay valid while attached.
+  void SetStats(DeflateStats* stats) { stats_ = stats; }
+
  private:
+  // Implements the puffing for the concrete bit readers and puff writers used
+  // inside puffin.
+  friend class PufferInternal;
+
   std::unique_ptr<HuffmanTable> dyn_ht_;
-  std::unique_ptr<HuffmanTable> fix_ht_;
+
+  // The stats to count the work into, or null.
+  DeflateStats* stats_;
 
   DISALLOW_COPY_AND_ASSIGN(Puffer);
 };
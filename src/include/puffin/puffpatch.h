@@ -18,19 +18,24 @@ extern const size_t kMagicLength;
 // apply the patch. The input streams are of type |shared_ptr| because
 // |PuffPatch| needs to wrap these streams into another ones and we don't want
 // to loose the ownership of the input streams. Optionally one can cache the
-// puff buffers individually if non-zero value is passed |max_cache_size|.
+// puff buffers individually if non-zero value is passed |max_cache_size|, and
+// puff the source deflates ahead of the reads and huff the destination puffs on
+// |num_threads| other threads each.
 //
 // |src|           IN  Source deflate stream.
 // |dst|           IN  Destination deflate stream.
 // |patch|         IN  The input patch.
 // |patch_length|  IN  The length of the patch.
 // |max_cache_size|IN  The maximum amount of memory to cache puff buffers.
+// |num_threads|   IN  The number of threads that puff ahead into the cache and
+//                     the number of threads that huff.
 PUFFIN_EXPORT
 bool PuffPatch(UniqueStreamPtr src,
                UniqueStreamPtr dst,
                const uint8_t* patch,
                size_t patch_length,
-               size_t max_cache_size = 0);
+               size_t max_cache_size = 0,
+               size_t num_threads = 0);
 
 }  // namespace puffin
 
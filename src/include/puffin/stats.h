@@ -0,0 +1,66 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_STATS_H_
+#define SRC_INCLUDE_PUFFIN_STATS_H_
+
+#include <cstdint>
+#include <string>
+
+#include "puffin/common.h"
+
+namespace puffin {
+
+// Counts what |Puffer::PuffDeflate| and |Huffer::HuffDeflate| spend their work
+// on. The counters are only updated while the stats are attached to a
+// |Puffer| or |Huffer| with |SetStats|, and puffing or huffing without stats
+// does not time anything. The counters add up over all the deflate streams
+// puffed or huffed until |Reset|.
+struct PUFFIN_EXPORT DeflateStats {
+  // The phases the time is split into.
+  enum Phase {
+    // Reading or writing the block headers, including the dynamic Huffman
+    // tables.
+    kBlockHeaderPhase = 0,
+    // Decoding or encoding the symbols of the compressed blocks.
+    kSymbolsPhase,
+    // Copying the data of the uncompressed blocks.
+    kUncompressedPhase,
+    kNumPhases,
+  };
+
+  DeflateStats();
+
+  // Sets all the counters to zero.
+  void Reset();
+
+  // Returns the counters in a human readable form, one per line.
+  std::string ToString() const;
+
+  // The number of blocks of each type, indexed by the BTYPE of the block
+  // header: uncompressed (0), fixed (1) and dynamic (2) Huffman codes.
+  uint64_t blocks[3];
+
+  // The number of literals, including the bytes of the uncompressed blocks,
+  // and of length/distance pairs.
+  uint64_t literals;
+  uint64_t len_dists;
+
+  // The number of dynamic Huffman tables that had to be built because they
+  // were not in the cache of recently built tables.
+  uint64_t dynamic_table_builds;
+
+  // The number of bits of deflate and bytes of puff read or written. The
+  // deflate is counted in bits because the deflate streams puffed or huffed in
+  // parts do not end on byte boundaries.
+  uint64_t deflate_bits;
+  uint64_t puff_bytes;
+
+  // The time spent in each |Phase| in nanoseconds.
+  uint64_t phase_nanoseconds[kNumPhases];
+};
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_STATS_H_
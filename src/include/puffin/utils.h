@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "puffin/common.h"
+#include "puffin/stats.h"
 #include "puffin/stream.h"
 
 namespace puffin {
@@ -64,11 +65,37 @@ bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
 
 // Finds the location of puffs in the deflate stream |src| based on the location
 // of |deflates| and populates the |puffs|. We assume |deflates| are sorted by
-// their offset value. |out_puff_size| will be the size of the puff stream.
+// their offset value. |out_puff_size| will be the size of the puff stream. The
+// puffs are laid out in |puff_format|.
 bool FindPuffLocations(const UniqueStreamPtr& src,
                        const std::vector<BitExtent>& deflates,
                        std::vector<ByteExtent>* puffs,
-                       uint64_t* out_puff_size);
+                       uint64_t* out_puff_size,
+                       PuffFormat puff_format = PuffFormat::kInterleaved);
+
+// Puffs the whole deflate stream |src|, with deflates at |deflates|, into
+// |puff_buffer| and populates |puffs| with the location of the puffs in it. The
+// result is the same as reading a |PuffinStream| created with the output of
+// |FindPuffLocations|, but each deflate is decoded only once. |deflates| must
+// be sorted by their offset value. The puffs are laid out in |puff_format|.
+bool PuffDeflateStream(const UniqueStreamPtr& src,
+                       const std::vector<BitExtent>& deflates,
+                       std::vector<ByteExtent>* puffs,
+                       Buffer* puff_buffer,
+                       PuffFormat puff_format = PuffFormat::kInterleaved);
+
+// Does the same as the function above, but writes the puff stream into |dst|
+// as it is puffed instead of keeping it in memory, so puffing a deflate stream
+// of any size takes a small fixed amount of memory. |out_puff_size| will be
+// the size of the puff stream. If |stats| is not null, the work of puffing is
+// counted into it.
+bool PuffDeflateStream(const UniqueStreamPtr& src,
+                       const std::vector<BitExtent>& deflates,
+                       const UniqueStreamPtr& dst,
+                       std::vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size,
+                       PuffFormat puff_format = PuffFormat::kInterleaved,
+                       DeflateStats* stats = nullptr);
 
 // Removes any BitExtents from both |extents1| and |extents2| if the data it
 // points to is found in both |extents1| and |extents2|. The order of the
@@ -28,11 +28,13 @@
 using puffin::BitExtent;
 using puffin::Buffer;
 using puffin::ByteExtent;
+using puffin::DeflateStats;
 using puffin::ExtentStream;
 using puffin::FileStream;
 using puffin::Huffer;
 using puffin::MemoryStream;
 using puffin::Puffer;
+using puffin::PuffFormat;
 using puffin::PuffinStream;
 using puffin::UniqueStreamPtr;
 using std::string;
@@ -191,7 +193,16 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
               "Logs all the given parameters including internally "        \
               "generated ones");                                           \
   DEFINE_uint64(cache_size, kDefaultPuffCacheSize,                         \
-                "Maximum size to cache the puff stream. Used in puffpatch");
+                "Maximum size to cache the puff stream. Used in puffpatch"); \
+  DEFINE_uint64(threads, 0,                                                \
+                "Number of threads that puff the source ahead into the "   \
+                "cache, and that huff the target. Used in puffpatch");     \
+  DEFINE_int32(puff_format, 1,                                             \
+               "Layout of the puffs: 1 (interleaved) or 2 (columnar). "    \
+               "Used in puff, huff, puffhuff and puffdiff");                \
+  DEFINE_bool(stats, false,                                                \
+              "Logs what puffing and huffing spent their work on. Used "   \
+              "in puff, huff and puffhuff");
 
 #ifndef USE_BRILLO
 SETUP_FLAGS;
@@ -210,6 +221,10 @@ bool Main(int argc, char** argv) {
   TEST_AND_RETURN_FALSE(!FLAGS_operation.empty());
   TEST_AND_RETURN_FALSE(!FLAGS_src_file.empty());
   TEST_AND_RETURN_FALSE(!FLAGS_dst_file.empty());
+  TEST_AND_RETURN_FALSE(
+      FLAGS_puff_format == static_cast<int>(PuffFormat::kInterleaved) ||
+      FLAGS_puff_format == static_cast<int>(PuffFormat::kColumnar));
+  auto puff_format = static_cast<PuffFormat>(FLAGS_puff_format);
 
   auto src_deflates_byte = StringToExtents<ByteExtent>(FLAGS_src_deflates_byte);
   auto dst_deflates_byte = StringToExtents<ByteExtent>(FLAGS_dst_deflates_byte);
@@ -220,6 +235,12 @@ bool Main(int argc, char** argv) {
   auto src_extents = StringToExtents<ByteExtent>(FLAGS_src_extents);
   auto dst_extents = StringToExtents<ByteExtent>(FLAGS_dst_extents);
 
+  // Only collected with --stats.
+  DeflateStats puff_stats;
+  DeflateStats huff_stats;
+  auto* puff_stats_ptr = FLAGS_stats ? &puff_stats : nullptr;
+  auto* huff_stats_ptr = FLAGS_stats ? &huff_stats : nullptr;
+
   auto src_stream = FileStream::Open(FLAGS_src_file, true, false);
   TEST_AND_RETURN_FALSE(src_stream);
   if (!src_extents.empty()) {
@@ -235,36 +256,26 @@ bool Main(int argc, char** argv) {
     if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
       LOG(WARNING) << "You should pass source deflates, is this intentional?";
     }
+    TEST_AND_RETURN_FALSE(dst_puffs.empty());
     if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit));
+      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(
+          src_stream, src_deflates_byte, &src_deflates_bit));
     }
-    TEST_AND_RETURN_FALSE(dst_puffs.empty());
-    uint64_t dst_puff_size;
-    TEST_AND_RETURN_FALSE(FindPuffLocations(src_stream, src_deflates_bit,
-                                            &dst_puffs, &dst_puff_size));
 
     auto dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
     TEST_AND_RETURN_FALSE(dst_stream);
-    auto puffer = std::make_shared<Puffer>();
-    auto reader =
-        PuffinStream::CreateForPuff(std::move(src_stream), puffer,
-                                    dst_puff_size, src_deflates_bit, dst_puffs);
 
     Buffer puff_buffer;
     auto writer = FLAGS_operation == "puffhuff"
                       ? MemoryStream::CreateForWrite(&puff_buffer)
                       : std::move(dst_stream);
 
-    Buffer buffer(1024 * 1024);
-    uint64_t bytes_wrote = 0;
-    while (bytes_wrote < dst_puff_size) {
-      auto write_size = std::min(static_cast<uint64_t>(buffer.size()),
-                                 dst_puff_size - bytes_wrote);
-      TEST_AND_RETURN_FALSE(reader->Read(buffer.data(), write_size));
-      TEST_AND_RETURN_FALSE(writer->Write(buffer.data(), write_size));
-      bytes_wrote += write_size;
-    }
+    // The puffs are written into |writer| as they are puffed, so the puff
+    // stream never has to be in memory as a whole.
+    uint64_t dst_puff_size;
+    TEST_AND_RETURN_FALSE(PuffDeflateStream(src_stream, src_deflates_bit,
+                                            writer, &dst_puffs, &dst_puff_size,
+                                            puff_format, puff_stats_ptr));
 
     // puffhuff operation puffs a stream and huffs it back to the target stream
     // to make sure we can get to the original stream.
@@ -275,10 +286,12 @@ bool Main(int argc, char** argv) {
 
       auto read_puff_stream = MemoryStream::CreateForRead(puff_buffer);
       auto huffer = std::make_shared<Huffer>();
+      huffer->SetStats(huff_stats_ptr);
       auto huff_writer = PuffinStream::CreateForHuff(
           std::move(dst_stream), huffer, dst_puff_size, dst_deflates_bit,
-          src_puffs, /*ignore_deflate_size=*/true);
+          src_puffs, /*ignore_deflate_size=*/true, puff_format);
 
+      Buffer buffer(1024 * 1024);
       uint64_t bytes_read = 0;
       while (bytes_read < dst_puff_size) {
         auto read_size = std::min(static_cast<uint64_t>(buffer.size()),
@@ -300,10 +313,10 @@ bool Main(int argc, char** argv) {
     TEST_AND_RETURN_FALSE(dst_file);
 
     auto huffer = std::make_shared<Huffer>();
-    auto dst_stream = PuffinStream::CreateForHuff(std::move(dst_file), huffer,
-                                                  src_stream_size,
-                                                  dst_deflates_bit, src_puffs,
-                                                  /*ignore_deflate_size=*/true);
+    huffer->SetStats(huff_stats_ptr);
+    auto dst_stream = PuffinStream::CreateForHuff(
+        std::move(dst_file), huffer, src_stream_size, dst_deflates_bit,
+        src_puffs, /*ignore_deflate_size=*/true, puff_format);
 
     Buffer buffer(1024 * 1024);
     uint64_t bytes_read = 0;
@@ -351,7 +364,7 @@ bool Main(int argc, char** argv) {
         std::move(src_stream), std::move(dst_stream), src_deflates_bit,
         dst_deflates_bit,
         {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
-        "/tmp/patch.tmp", &puffdiff_delta));
+        "/tmp/patch.tmp", &puffdiff_delta, puff_format));
     if (FLAGS_verbose) {
       LOG(INFO) << "patch_size: " << puffdiff_delta.size();
     }
@@ -379,7 +392,7 @@ bool Main(int argc, char** argv) {
     // operations.
     TEST_AND_RETURN_FALSE(puffin::PuffPatch(
         std::move(src_stream), std::move(dst_stream), puffdiff_delta.data(),
-        puffdiff_delta.size(), FLAGS_cache_size));
+        puffdiff_delta.size(), FLAGS_cache_size, FLAGS_threads));
   }
 
   if (FLAGS_verbose) {
@@ -396,6 +409,14 @@ bool Main(int argc, char** argv) {
     LOG(INFO) << "src_extents: " << puffin::ExtentsToString(src_extents);
     LOG(INFO) << "dst_extents: " << puffin::ExtentsToString(dst_extents);
   }
+  if (FLAGS_stats) {
+    if (FLAGS_operation == "puff" || FLAGS_operation == "puffhuff") {
+      LOG(INFO) << "puff stats:\n" << puff_stats.ToString();
+    }
+    if (FLAGS_operation == "huff" || FLAGS_operation == "puffhuff") {
+      LOG(INFO) << "huff stats:\n" << huff_stats.ToString();
+    }
+  }
   return true;
 }
 
@@ -157,6 +157,30 @@ TEST(PatchingTest, Patching1ToNoDeflateTest) {
                kSubblockDeflateExtentsSample1, {}, kPatch1ToNoDeflate);
 }
 
+TEST(PatchingTest, PatchingColumnar1To2Test) {
+  Buffer patch;
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  ASSERT_TRUE(PuffDiff(kDeflatesSample1, kDeflatesSample2,
+                       kSubblockDeflateExtentsSample1,
+                       kSubblockDeflateExtentsSample2,
+                       {bsdiff::CompressorType::kBZ2}, patch_path, &patch,
+                       PuffFormat::kColumnar));
+  // The header of the patch starts right after the magic and the header size
+  // and its first field is the version.
+  ASSERT_GT(patch.size(), 10);
+  EXPECT_EQ(patch[8], 0x08);
+  EXPECT_EQ(patch[9], 0x02);
+
+  auto src_stream = MemoryStream::CreateForRead(kDeflatesSample1);
+  Buffer dst_buf_out(kDeflatesSample2.size());
+  auto dst_stream = MemoryStream::CreateForWrite(&dst_buf_out);
+  ASSERT_TRUE(PuffPatch(std::move(src_stream), std::move(dst_stream),
+                        patch.data(), patch.size()));
+  EXPECT_EQ(dst_buf_out, kDeflatesSample2);
+}
+
 // TODO(ahassani): add tests for:
 //   TestPatchingEmptyTo2
 //   TestPatchingNoDeflateTo2
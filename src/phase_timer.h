@@ -0,0 +1,45 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PHASE_TIMER_H_
+#define SRC_PHASE_TIMER_H_
+
+#include <chrono>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/stats.h"
+
+namespace puffin {
+
+// Adds the time from its construction to its destruction to |phase| of
+// |stats|. It does nothing if |stats| is null.
+class PhaseTimer {
+ public:
+  PhaseTimer(DeflateStats* stats, DeflateStats::Phase phase)
+      : stats_(stats), phase_(phase) {
+    if (stats_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~PhaseTimer() {
+    if (stats_ != nullptr) {
+      stats_->phase_nanoseconds[phase_] +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_)
+              .count();
+    }
+  }
+
+ private:
+  DeflateStats* stats_;
+  DeflateStats::Phase phase_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(PhaseTimer);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_PHASE_TIMER_H_
@@ -34,11 +34,22 @@ struct PuffData {
     kEndOfBlock,
   } type;
 
-  // A function that once set, can read raw bytes from whatever its parameters
-  // are set. This function reads |count| bytes from |buffer| and advances its
-  // read offset forward. The next call to this function will start reading
-  // after the last read byte. It returns false if it cannot read or the |count|
-  // is larger than what is availabe in the buffer.
+  // A borrowed view of the |length| literals. It points into memory owned by
+  // whoever produced this |PuffData| (e.g. the input buffer of a reader) and
+  // is only valid until that producer is used again. No copy of the literals
+  // is made until a consumer needs one. If it is |nullptr|, the consumer
+  // falls back to |read_fn|.
+  // Used by:
+  // PuffData::Type::kLiterals
+  const uint8_t* literals = nullptr;
+
+  // Optional streaming fallback for producers that cannot provide |literals|
+  // in one contiguous piece. Once set, it reads raw bytes from whatever its
+  // parameters are set. This function reads |count| bytes into |buffer| and
+  // advances its read offset forward. The next call to this function will
+  // start reading after the last read byte. It returns false if it cannot read
+  // or the |count| is larger than what is availabe in the buffer. It is only
+  // used if |literals| is |nullptr|.
   // Used by:
   // PuffData::Type::kLiterals
   std::function<bool(uint8_t* buffer, size_t count)> read_fn;
@@ -70,10 +81,45 @@ struct PuffData {
   uint8_t block_metadata[1 + 3 + 286 + 30 + 19];
 };
 
+// The records of a compressed block decoded at once by
+// |PuffReaderInterface::GetNextBatch|, laid out as a structure of arrays so
+// the consumer can go through them in a tight loop. Only literals, length/
+// distance pairs and the end of block are batched. Record |i| is described by
+// |types[i]| and, depending on the type:
+// PuffData::Type::kLiterals: |lengths[i]| bytes borrowed at |literals[i]|.
+// PuffData::Type::kLenDist: |lengths[i]| and |distances[i]|.
+struct PuffDataBatch {
+  // The maximum number of records in a batch.
+  static constexpr size_t kMaxSize = 256;
+
+  // The number of valid records in the arrays.
+  size_t size;
+
+  PuffData::Type types[kMaxSize];
+  uint32_t lengths[kMaxSize];
+  uint16_t distances[kMaxSize];
+  const uint8_t* literals[kMaxSize];
+};
+
 // The headers for differentiating literals from length/distance pairs.
 constexpr uint8_t kLiteralsHeader = 0x00;
 constexpr uint8_t kLenDistHeader = 0x80;
 
+// The maximum number of literals in one literals record of a puff. Longer runs
+// of literals are split into multiple records.
+constexpr size_t kLiteralsMaxLength = (1 << 16) + 127;  // 65663
+
+// The most bytes of a puff that have to be available at once to read whole
+// records: a literals record with |kLiteralsMaxLength| literals and its header.
+// The block metadata, literals and end of block of an uncompressed block,
+// which are read together, and the block metadata of a dynamic block are
+// smaller.
+constexpr size_t kMaxWholeRecordsSize = kLiteralsMaxLength + 3;
+
+// The number of bytes at the beginning of a puff in the columnar layout that
+// keep the sizes of its block metadata, headers and distances sections.
+constexpr size_t kColumnarSectionSizesLength = 3 * 4;
+
 }  // namespace puffin
 
 #endif  // SRC_PUFF_DATA_H_
@@ -2,8 +2,12 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
+#include <vector>
+
 #include "gtest/gtest.h"
 
+#include "puffin/src/memory_stream.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
 #include "puffin/src/unittest_common.h"
@@ -50,9 +54,7 @@ void TestLiteralLength(size_t length) {
     ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
     ASSERT_EQ(pd.length, length);
     for (size_t i = 0; i < pd.length; i++) {
-      uint8_t byte;
-      pd.read_fn(&byte, 1);
-      EXPECT_EQ(byte, 10);
+      EXPECT_EQ(pd.literals[i], 10);
     }
   }
 }
@@ -184,24 +186,19 @@ TEST(PuffIOTest, InputOutputTest) {
     ASSERT_TRUE(epw.Flush());
   }
 
-  uint8_t tmp3[3];
   {
     PuffData pd;
     ASSERT_TRUE(pr.GetNext(&pd));
     ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
     ASSERT_EQ(pd.length, 3);
-    ASSERT_TRUE(pd.read_fn(tmp3, 3));
-    ASSERT_FALSE(pd.read_fn(tmp3, 1));
-    ASSERT_EQ(0, memcmp(tmp3, tmp, 3));
+    ASSERT_EQ(0, memcmp(pd.literals, tmp, 3));
   }
   {
     PuffData pd;
     ASSERT_TRUE(pr.GetNext(&pd));
     ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
     ASSERT_EQ(pd.length, 1);
-    ASSERT_TRUE(pd.read_fn(tmp3, 1));
-    ASSERT_EQ(tmp3[0], 10);
-    ASSERT_FALSE(pd.read_fn(tmp3, 2));
+    ASSERT_EQ(pd.literals[0], 10);
   }
   {
     PuffData pd;
@@ -350,9 +347,7 @@ TEST(PuffIOTest, MaxLiteralsTest) {
   ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
   ASSERT_EQ(pd.length, 1 << 16);
   for (size_t i = 0; i < pd.length; i++) {
-    uint8_t byte;
-    pd.read_fn(&byte, 1);
-    ASSERT_EQ(byte, 10);
+    ASSERT_EQ(pd.literals[i], 10);
   }
 
   BufferPuffWriter pw2(buf.data(), buf.size());
@@ -383,17 +378,467 @@ TEST(PuffIOTest, MaxLiteralsTest) {
   ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
   ASSERT_EQ(pd.length, (1 << 16) + 127);
   for (size_t i = 0; i < pd.length; i++) {
-    uint8_t byte;
-    pd.read_fn(&byte, 1);
-    ASSERT_EQ(byte, 12);
+    ASSERT_EQ(pd.literals[i], 12);
   }
 
   ASSERT_TRUE(pr2.GetNext(&pd));
   ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
   ASSERT_EQ(pd.length, 1);
-  uint8_t byte;
-  pd.read_fn(&byte, 1);
-  ASSERT_EQ(byte, 13);
+  ASSERT_EQ(pd.literals[0], 13);
+}
+
+// Testing that a series of literals inserted in chunks is split at the maximum
+// literals length exactly as if the literals were inserted one by one.
+TEST(PuffIOTest, MaxLiteralsChunksTest) {
+  const size_t kTotalLength = (1 << 16) + 127 + 1000;
+  Buffer buf(kTotalLength + 20);
+  PuffData pd;
+
+  BufferPuffWriter pw(buf.data(), buf.size());
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.length = 1;
+  ASSERT_TRUE(pw.Insert(pd));
+
+  pd.type = PuffData::Type::kLiterals;
+  uint8_t next_byte = 0;
+  pd.read_fn = [&next_byte](uint8_t* buffer, size_t count) {
+    while (count--) {
+      *buffer++ = next_byte++;
+    }
+    return true;
+  };
+  for (size_t inserted = 0; inserted < kTotalLength; inserted += pd.length) {
+    pd.length = std::min(kTotalLength - inserted, static_cast<size_t>(500));
+    ASSERT_TRUE(pw.Insert(pd));
+  }
+  ASSERT_TRUE(pw.Flush());
+
+  BufferPuffReader pr(buf.data(), pw.Size());
+  ASSERT_TRUE(pr.GetNext(&pd));
+  ASSERT_EQ(pd.type, PuffData::Type::kBlockMetadata);
+
+  uint8_t expected_byte = 0;
+  for (auto length : {(1 << 16) + 127, 1000}) {
+    ASSERT_TRUE(pr.GetNext(&pd));
+    ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
+    ASSERT_EQ(pd.length, length);
+    for (size_t i = 0; i < pd.length; i++) {
+      ASSERT_EQ(pd.literals[i], expected_byte++);
+    }
+  }
+  ASSERT_EQ(pr.BytesLeft(), 0);
+}
+
+// Testing that literals lent through |PuffData::literals| are split the same
+// way as literals read through |PuffData::read_fn| and that the reader lends
+// the literals from its own buffer without copying them.
+TEST(PuffIOTest, LiteralsViewTest) {
+  const size_t kTotalLength = (1 << 16) + 127 + 1000;
+  Buffer literals(kTotalLength);
+  for (size_t i = 0; i < literals.size(); i++) {
+    literals[i] = static_cast<uint8_t>(i * 7);
+  }
+  Buffer buf(kTotalLength + 20);
+  PuffData pd;
+
+  BufferPuffWriter pw(buf.data(), buf.size());
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.length = 1;
+  ASSERT_TRUE(pw.Insert(pd));
+
+  // Start with a run shorter than 127 so the writer has to switch to the
+  // large literals header in the middle of the next insert.
+  pd.type = PuffData::Type::kLiterals;
+  for (size_t inserted = 0; inserted < kTotalLength; inserted += pd.length) {
+    pd.literals = &literals[inserted];
+    pd.length = std::min(kTotalLength - inserted,
+                         inserted == 0 ? 100 : static_cast<size_t>(3000));
+    ASSERT_TRUE(pw.Insert(pd));
+  }
+  ASSERT_TRUE(pw.Flush());
+
+  BufferPuffWriter epw(nullptr, 0);
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.length = 1;
+  ASSERT_TRUE(epw.Insert(pd));
+  pd.type = PuffData::Type::kLiterals;
+  pd.literals = literals.data();
+  pd.length = kTotalLength;
+  ASSERT_TRUE(epw.Insert(pd));
+  ASSERT_TRUE(epw.Flush());
+  ASSERT_EQ(epw.Size(), pw.Size());
+
+  BufferPuffReader pr(buf.data(), pw.Size());
+  ASSERT_TRUE(pr.GetNext(&pd));
+  ASSERT_EQ(pd.type, PuffData::Type::kBlockMetadata);
+
+  size_t offset = 0;
+  for (auto length : {(1 << 16) + 127, 1000}) {
+    ASSERT_TRUE(pr.GetNext(&pd));
+    ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
+    ASSERT_EQ(pd.length, length);
+    ASSERT_GE(pd.literals, buf.data());
+    ASSERT_LE(pd.literals + pd.length, buf.data() + pw.Size());
+    ASSERT_EQ(0, memcmp(pd.literals, &literals[offset], pd.length));
+    offset += pd.length;
+  }
+  ASSERT_EQ(pr.BytesLeft(), 0);
+}
+
+// Testing that |GetNextBatch| returns the same records as |GetNext| and ends
+// the batch at the end of block.
+TEST(PuffIOTest, GetNextBatchTest) {
+  const size_t kNumRecords = 3 * PuffDataBatch::kMaxSize + 10;
+  Buffer literals(300, 7);
+  Buffer buf(kNumRecords * 310);
+  BufferPuffWriter pw(buf.data(), buf.size());
+  PuffData pd;
+  for (size_t block = 0; block < 2; block++) {
+    pd.type = PuffData::Type::kBlockMetadata;
+    pd.block_metadata[0] = 0x40;
+    pd.length = 1;
+    ASSERT_TRUE(pw.Insert(pd));
+    for (size_t idx = 0; idx < kNumRecords; idx++) {
+      if (idx % 2 == 0) {
+        pd.type = PuffData::Type::kLiterals;
+        pd.literals = literals.data();
+        pd.length = 1 + (idx * 13) % literals.size();
+      } else {
+        pd.type = PuffData::Type::kLenDist;
+        pd.length = 3 + (idx * 7) % 256;
+        pd.distance = 1 + (idx * 131) % 32768;
+      }
+      ASSERT_TRUE(pw.Insert(pd));
+    }
+    pd.type = PuffData::Type::kEndOfBlock;
+    ASSERT_TRUE(pw.Insert(pd));
+  }
+  ASSERT_TRUE(pw.Flush());
+
+  BufferPuffReader pr(buf.data(), pw.Size());
+  BufferPuffReader batch_pr(buf.data(), pw.Size());
+  PuffDataBatch batch;
+  for (size_t block = 0; block < 2; block++) {
+    ASSERT_TRUE(pr.GetNext(&pd));
+    ASSERT_EQ(pd.type, PuffData::Type::kBlockMetadata);
+    ASSERT_FALSE(batch_pr.GetNextBatch(&batch));
+    ASSERT_TRUE(batch_pr.GetNext(&pd));
+    ASSERT_EQ(pd.type, PuffData::Type::kBlockMetadata);
+    size_t num_batches = 0;
+    do {
+      ASSERT_TRUE(batch_pr.GetNextBatch(&batch));
+      ASSERT_GT(batch.size, 0);
+      num_batches++;
+      for (size_t idx = 0; idx < batch.size; idx++) {
+        ASSERT_TRUE(pr.GetNext(&pd));
+        ASSERT_EQ(batch.types[idx], pd.type);
+        if (pd.type == PuffData::Type::kLiterals) {
+          ASSERT_EQ(batch.lengths[idx], pd.length);
+          ASSERT_EQ(batch.literals[idx], pd.literals);
+        } else if (pd.type == PuffData::Type::kLenDist) {
+          ASSERT_EQ(batch.lengths[idx], pd.length);
+          ASSERT_EQ(batch.distances[idx], pd.distance);
+        } else {
+          ASSERT_EQ(pd.type, PuffData::Type::kEndOfBlock);
+          ASSERT_EQ(idx, batch.size - 1);
+        }
+      }
+    } while (batch.types[batch.size - 1] != PuffData::Type::kEndOfBlock);
+    ASSERT_EQ(num_batches, 4);
+  }
+  ASSERT_EQ(pr.BytesLeft(), 0);
+  ASSERT_EQ(batch_pr.BytesLeft(), 0);
+}
+
+namespace {
+// Inserts two blocks of literals (including a run longer than the maximum
+// literals length), length/distance pairs and ends of block into |pw|.
+void InsertColumnarTestRecords(const Buffer& literals,
+                               PuffWriterInterface* pw) {
+  PuffData pd;
+  for (size_t block = 0; block < 2; block++) {
+    pd.type = PuffData::Type::kBlockMetadata;
+    pd.length = 2 + block;
+    pd.block_metadata[0] = 0x40;
+    pd.block_metadata[1] = static_cast<uint8_t>(block);
+    pd.block_metadata[2] = 0x12;
+    ASSERT_TRUE(pw->Insert(pd));
+    size_t offset = 0;
+    for (size_t length : {1, 127, 128, 70000, 5}) {
+      pd.type = PuffData::Type::kLiterals;
+      pd.literals = &literals[offset];
+      pd.length = length;
+      ASSERT_TRUE(pw->Insert(pd));
+      offset += length;
+      pd.type = PuffData::Type::kLenDist;
+      pd.length = 3 + (length % 256);
+      pd.distance = 1 + (length * 31) % 32768;
+      ASSERT_TRUE(pw->Insert(pd));
+    }
+    pd.type = PuffData::Type::kLiteral;
+    pd.byte = 0xAB;
+    ASSERT_TRUE(pw->Insert(pd));
+    pd.type = PuffData::Type::kEndOfBlock;
+    ASSERT_TRUE(pw->Insert(pd));
+  }
+  ASSERT_TRUE(pw->Flush());
+}
+}  // namespace
+
+// Testing that |WholeRecordsSize| finds the end of the last whole record in any
+// prefix of a puff, and that the records of an uncompressed block are only
+// whole together.
+TEST(PuffIOTest, WholeRecordsSizeTest) {
+  Buffer literals(70300, 3);
+  Buffer buf(2 * literals.size() + 1000);
+  BufferPuffWriter pw(buf.data(), buf.size());
+  InsertColumnarTestRecords(literals, &pw);
+  size_t compressed_size = pw.Size();
+  PuffData pd;
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.block_metadata[0] = 0x80;
+  pd.length = 1;
+  ASSERT_TRUE(pw.Insert(pd));
+  pd.type = PuffData::Type::kLiterals;
+  pd.literals = literals.data();
+  pd.length = 300;
+  ASSERT_TRUE(pw.Insert(pd));
+  pd.type = PuffData::Type::kEndOfBlock;
+  ASSERT_TRUE(pw.Insert(pd));
+  ASSERT_TRUE(pw.Flush());
+  size_t puff_size = pw.Size();
+
+  // The ends of the whole records.
+  std::vector<size_t> ends = {0};
+  BufferPuffReader pr(buf.data(), compressed_size);
+  while (pr.BytesLeft() != 0) {
+    ASSERT_TRUE(pr.GetNext(&pd));
+    ends.push_back(compressed_size - pr.BytesLeft());
+  }
+  ends.push_back(puff_size);
+
+  auto end = ends.begin();
+  for (size_t size = 0; size <= puff_size; size++) {
+    if (end + 1 != ends.end() && *(end + 1) <= size) {
+      end++;
+    }
+    BufferPuffReader prefix_pr(buf.data(), size);
+    ASSERT_EQ(*end, prefix_pr.WholeRecordsSize());
+  }
+
+  // Starting after the block metadata.
+  BufferPuffReader metadata_pr(buf.data(), puff_size);
+  ASSERT_TRUE(metadata_pr.GetNext(&pd));
+  ASSERT_EQ(pd.type, PuffData::Type::kBlockMetadata);
+  size_t offset = puff_size - metadata_pr.BytesLeft();
+  BufferPuffReader in_block_pr(&buf[offset], ends[2] - offset + 1,
+                               /*in_block=*/true);
+  ASSERT_EQ(ends[2] - offset, in_block_pr.WholeRecordsSize());
+
+  // A batch ends at the end of the buffer too.
+  BufferPuffReader part_pr(&buf[offset], ends[2] - offset, /*in_block=*/true);
+  PuffDataBatch batch;
+  ASSERT_TRUE(part_pr.GetNextBatch(&batch));
+  ASSERT_EQ(batch.size, 1);
+  ASSERT_EQ(batch.types[0], PuffData::Type::kLiterals);
+  ASSERT_EQ(part_pr.BytesLeft(), 0);
+  ASSERT_TRUE(part_pr.GetNextBatch(&batch));
+  ASSERT_EQ(batch.size, 0);
+}
+
+// Testing that the columnar layout holds the same records as the interleaved
+// one.
+TEST(PuffIOTest, ColumnarLayoutTest) {
+  Buffer literals(70300);
+  for (size_t i = 0; i < literals.size(); i++) {
+    literals[i] = static_cast<uint8_t>(i * 13);
+  }
+
+  Buffer buf(literals.size() * 2 + 1000);
+  BufferPuffWriter pw(buf.data(), buf.size());
+  InsertColumnarTestRecords(literals, &pw);
+  Buffer columnar_buf(literals.size() * 2 + 1000);
+  BufferColumnarPuffWriter cpw(columnar_buf.data(), columnar_buf.size());
+  InsertColumnarTestRecords(literals, &cpw);
+  BufferColumnarPuffWriter epw(nullptr, 0);
+  InsertColumnarTestRecords(literals, &epw);
+  ASSERT_EQ(cpw.Size(), epw.Size());
+  // Same records, but laid out differently.
+  ASSERT_EQ(cpw.Size(), pw.Size() + kColumnarSectionSizesLength);
+  columnar_buf.resize(cpw.Size());
+  ASSERT_NE(0, memcmp(columnar_buf.data(), buf.data(), pw.Size()));
+
+  BufferPuffReader pr(buf.data(), pw.Size());
+  BufferColumnarPuffReader cpr(columnar_buf.data(), columnar_buf.size());
+  PuffData pd, cpd;
+  while (pr.BytesLeft() != 0) {
+    ASSERT_NE(cpr.BytesLeft(), 0);
+    ASSERT_TRUE(pr.GetNext(&pd));
+    ASSERT_TRUE(cpr.GetNext(&cpd));
+    ASSERT_EQ(pd.type, cpd.type);
+    switch (pd.type) {
+      case PuffData::Type::kBlockMetadata:
+        ASSERT_EQ(pd.length, cpd.length);
+        ASSERT_EQ(0, memcmp(pd.block_metadata, cpd.block_metadata, pd.length));
+        break;
+      case PuffData::Type::kLiterals:
+        ASSERT_EQ(pd.length, cpd.length);
+        ASSERT_EQ(0, memcmp(pd.literals, cpd.literals, pd.length));
+        break;
+      case PuffData::Type::kLenDist:
+        ASSERT_EQ(pd.length, cpd.length);
+        ASSERT_EQ(pd.distance, cpd.distance);
+        break;
+      default:
+        ASSERT_EQ(pd.type, PuffData::Type::kEndOfBlock);
+    }
+  }
+  ASSERT_EQ(cpr.BytesLeft(), 0);
+  ASSERT_FALSE(cpr.GetNext(&cpd));
+
+  // Invalid section sizes.
+  columnar_buf[0] = 0xFF;
+  BufferColumnarPuffReader invalid_cpr(columnar_buf.data(),
+                                       columnar_buf.size());
+  ASSERT_NE(invalid_cpr.BytesLeft(), 0);
+  ASSERT_FALSE(invalid_cpr.GetNext(&cpd));
+}
+
+// Testing that the growable puff writers append the same puff as the fixed
+// size ones.
+TEST(PuffIOTest, GrowablePuffWriterTest) {
+  Buffer literals(70300);
+  for (size_t i = 0; i < literals.size(); i++) {
+    literals[i] = static_cast<uint8_t>(i * 7);
+  }
+  const Buffer prefix = {1, 2, 3};
+
+  Buffer buf(literals.size() * 2 + 1000);
+  BufferPuffWriter pw(buf.data(), buf.size());
+  InsertColumnarTestRecords(literals, &pw);
+  buf.resize(pw.Size());
+  Buffer growable_buf(prefix);
+  BufferPuffWriter gpw(&growable_buf);
+  InsertColumnarTestRecords(literals, &gpw);
+  ASSERT_EQ(gpw.Size(), buf.size());
+  ASSERT_EQ(Buffer(growable_buf.begin(), growable_buf.begin() + 3), prefix);
+  ASSERT_EQ(Buffer(growable_buf.begin() + 3, growable_buf.end()), buf);
+
+  Buffer columnar_buf(literals.size() * 2 + 1000);
+  BufferColumnarPuffWriter cpw(columnar_buf.data(), columnar_buf.size());
+  InsertColumnarTestRecords(literals, &cpw);
+  columnar_buf.resize(cpw.Size());
+  growable_buf = prefix;
+  BufferColumnarPuffWriter gcpw(&growable_buf);
+  InsertColumnarTestRecords(literals, &gcpw);
+  ASSERT_EQ(Buffer(growable_buf.begin() + 3, growable_buf.end()),
+            columnar_buf);
+}
+
+// Testing that the puff writer that writes into a stream writes the same puff
+// as the fixed size one, even with runs of literals that do not fit into its
+// buffer at once.
+TEST(PuffIOTest, StreamPuffWriterTest) {
+  Buffer literals(70300);
+  for (size_t i = 0; i < literals.size(); i++) {
+    literals[i] = static_cast<uint8_t>(i * 7);
+  }
+  Buffer buf(literals.size() * 2 + 1000);
+  BufferPuffWriter pw(buf.data(), buf.size());
+  InsertColumnarTestRecords(literals, &pw);
+  buf.resize(pw.Size());
+
+  const Buffer prefix = {1, 2, 3};
+  Buffer out;
+  auto stream = MemoryStream::CreateForWrite(&out);
+  ASSERT_TRUE(stream->Write(prefix.data(), prefix.size()));
+  Buffer sink(kMaxWholeRecordsSize);
+  BufferPuffWriter spw(stream, &sink);
+  InsertColumnarTestRecords(literals, &spw);
+  ASSERT_EQ(spw.Size(), buf.size());
+  ASSERT_EQ(Buffer(out.begin(), out.begin() + 3), prefix);
+  ASSERT_EQ(Buffer(out.begin() + 3, out.end()), buf);
+
+  // A buffer that cannot take a whole run of literals.
+  Buffer small_sink(100);
+  BufferPuffWriter small_spw(stream, &small_sink);
+  PuffData pd;
+  pd.type = PuffData::Type::kLiterals;
+  pd.literals = literals.data();
+  pd.length = 200;
+  ASSERT_FALSE(small_spw.Insert(pd));
+}
+
+// Testing that a stream puff writer moves only the bytes in its buffer when the
+// header of a long run of literals crosses the end of the buffer.
+TEST(PuffIOTest, StreamPuffWriterGrowAtHeaderTest) {
+  Buffer literals(200);
+  for (size_t i = 0; i < literals.size(); i++) {
+    literals[i] = static_cast<uint8_t>(i * 3);
+  }
+  const size_t kSinkSize = 1000;
+  auto insert_records = [&literals](PuffWriterInterface* pw) {
+    // Leave one byte of the buffer for the three bytes of the literals header.
+    PuffData pd;
+    pd.type = PuffData::Type::kLenDist;
+    pd.length = 3;
+    pd.distance = 1;
+    for (size_t i = 0; i < (kSinkSize - 1) / 3; i++) {
+      ASSERT_TRUE(pw->Insert(pd));
+    }
+    pd.type = PuffData::Type::kLiterals;
+    pd.literals = literals.data();
+    pd.length = literals.size();
+    ASSERT_TRUE(pw->Insert(pd));
+    pd.type = PuffData::Type::kEndOfBlock;
+    ASSERT_TRUE(pw->Insert(pd));
+    ASSERT_TRUE(pw->Flush());
+  };
+
+  Buffer buf;
+  BufferPuffWriter pw(&buf);
+  insert_records(&pw);
+
+  Buffer out;
+  auto stream = MemoryStream::CreateForWrite(&out);
+  Buffer sink(kSinkSize);
+  BufferPuffWriter spw(stream, &sink);
+  insert_records(&spw);
+  ASSERT_EQ(spw.Size(), buf.size());
+  ASSERT_EQ(out, buf);
+}
+
+// Testing that a run of literals is written the same no matter how it is split
+// into inserts.
+TEST(PuffIOTest, LiteralsRunPiecesTest) {
+  Buffer literals(70000);
+  for (size_t i = 0; i < literals.size(); i++) {
+    literals[i] = static_cast<uint8_t>(i * 3);
+  }
+  for (size_t run : {1, 127, 128, 300, 65663, 65664, 70000}) {
+    Buffer expected;
+    const size_t pieces[] = {run, 1, 100, 200};
+    for (size_t piece : pieces) {
+      Buffer buf(run + 100);
+      BufferPuffWriter pw(buf.data(), buf.size());
+      PuffData pd;
+      pd.type = PuffData::Type::kLiterals;
+      for (size_t offset = 0; offset < run; offset += piece) {
+        pd.literals = &literals[offset];
+        pd.length = std::min(piece, run - offset);
+        ASSERT_TRUE(pw.Insert(pd));
+      }
+      pd.type = PuffData::Type::kEndOfBlock;
+      ASSERT_TRUE(pw.Insert(pd));
+      ASSERT_TRUE(pw.Flush());
+      buf.resize(pw.Size());
+      if (piece == run) {
+        expected = buf;
+      } else {
+        ASSERT_EQ(buf, expected);
+      }
+    }
+  }
 }
 
 }  // namespace puffin
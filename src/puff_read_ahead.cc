@@ -0,0 +1,210 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/puff_read_ahead.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stream.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/puff_writer.h"
+#include "puffin/src/puffer_internal.h"
+
+using std::vector;
+
+namespace puffin {
+
+SharedStream::SharedStream(UniqueStreamPtr stream)
+    : stream_(std::move(stream)), offset_(0) {}
+
+bool SharedStream::GetSize(uint64_t* size) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stream_->GetSize(size);
+}
+
+bool SharedStream::GetOffset(uint64_t* offset) const {
+  *offset = offset_;
+  return true;
+}
+
+bool SharedStream::Seek(uint64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+  offset_ = offset;
+  return true;
+}
+
+bool SharedStream::Read(void* buffer, size_t length) {
+  TEST_AND_RETURN_FALSE(ReadAt(offset_, buffer, length));
+  offset_ += length;
+  return true;
+}
+
+bool SharedStream::Write(const void* buffer, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(stream_->Seek(offset_));
+  TEST_AND_RETURN_FALSE(stream_->Write(buffer, length));
+  offset_ += length;
+  return true;
+}
+
+bool SharedStream::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stream_->Close();
+}
+
+bool SharedStream::ReadAt(uint64_t offset, void* buffer, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+  TEST_AND_RETURN_FALSE(stream_->Read(buffer, length));
+  return true;
+}
+
+PuffReadAhead::PuffReadAhead(SharedStream* stream,
+                             const vector<BitExtent>& deflates,
+                             const vector<ByteExtent>& puffs,
+                             PuffFormat puff_format,
+                             size_t num_threads)
+    : stream_(stream),
+      deflates_(deflates),
+      puffs_(puffs),
+      puff_format_(puff_format),
+      size_(0),
+      stop_(false) {
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&PuffReadAhead::Work, this);
+  }
+}
+
+PuffReadAhead::~PuffReadAhead() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void PuffReadAhead::Schedule(const vector<int>& puff_ids) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto puff_id : waiting_) {
+      size_ -= puffs_[puff_id].length;
+    }
+    waiting_.assign(puff_ids.begin(), puff_ids.end());
+    for (auto puff_id : waiting_) {
+      size_ += puffs_[puff_id].length;
+    }
+  }
+  cond_.notify_all();
+}
+
+bool PuffReadAhead::Contains(int puff_id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::find(waiting_.begin(), waiting_.end(), puff_id) !=
+             waiting_.end() ||
+         in_progress_.count(puff_id) > 0 || done_.count(puff_id) > 0;
+}
+
+uint64_t PuffReadAhead::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+bool PuffReadAhead::Take(int puff_id, SharedBufferPtr* puff) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto waiting = std::find(waiting_.begin(), waiting_.end(), puff_id);
+  if (waiting != waiting_.end()) {
+    waiting_.erase(waiting);
+    size_ -= puffs_[puff_id].length;
+    return false;
+  }
+  cond_.wait(lock,
+             [this, puff_id] { return in_progress_.count(puff_id) == 0; });
+  auto done = done_.find(puff_id);
+  if (done == done_.end()) {
+    return false;
+  }
+  *puff = std::move(done->second);
+  done_.erase(done);
+  size_ -= puffs_[puff_id].length;
+  return *puff != nullptr;
+}
+
+void PuffReadAhead::TakeDone(vector<std::pair<int, SharedBufferPtr>>* puffs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& done : done_) {
+    size_ -= puffs_[done.first].length;
+    if (done.second) {
+      puffs->emplace_back(done.first, std::move(done.second));
+    }
+  }
+  done_.clear();
+}
+
+void PuffReadAhead::Work() {
+  Puffer puffer;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return stop_ || !waiting_.empty(); });
+    if (stop_) {
+      return;
+    }
+    auto puff_id = waiting_.front();
+    waiting_.pop_front();
+    in_progress_.insert(puff_id);
+    lock.unlock();
+
+    SharedBufferPtr puff(new Buffer(puffs_[puff_id].length));
+    if (!PuffDeflate(puffer, puff_id, puff.get())) {
+      // The reader puffs it again and reports the error.
+      puff.reset();
+    }
+
+    lock.lock();
+    in_progress_.erase(puff_id);
+    done_[puff_id] = std::move(puff);
+    cond_.notify_all();
+  }
+}
+
+bool PuffReadAhead::PuffDeflate(const Puffer& puffer,
+                                int puff_id,
+                                Buffer* puff) const {
+  const auto& deflate = deflates_[puff_id];
+  auto start_byte = deflate.offset / 8;
+  auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+  Buffer deflate_buffer(end_byte - start_byte);
+  TEST_AND_RETURN_FALSE(stream_->ReadAt(start_byte, deflate_buffer.data(),
+                                        deflate_buffer.size()));
+  BufferBitReader bit_reader(deflate_buffer.data(), deflate_buffer.size());
+
+  // Drop the first unused bits.
+  size_t extra_bits_len = deflate.offset & 7;
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
+  bit_reader.DropBits(extra_bits_len);
+
+  if (puff_format_ == PuffFormat::kColumnar) {
+    BufferColumnarPuffWriter puff_writer(puff->data(), puff->size());
+    TEST_AND_RETURN_FALSE(
+        puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr));
+    TEST_AND_RETURN_FALSE(puff_writer.Size() == puff->size());
+  } else {
+    BufferPuffWriter puff_writer(puff->data(), puff->size());
+    TEST_AND_RETURN_FALSE(PufferInternal::PuffDeflate(puffer, &bit_reader,
+                                                      &puff_writer, nullptr));
+    TEST_AND_RETURN_FALSE(puff_writer.Size() == puff->size());
+  }
+  TEST_AND_RETURN_FALSE(bit_reader.Offset() == deflate_buffer.size());
+  return true;
+}
+
+}  // namespace puffin
@@ -0,0 +1,124 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PUFF_READ_AHEAD_H_
+#define SRC_PUFF_READ_AHEAD_H_
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stream.h"
+
+namespace puffin {
+
+// A stream that is read both by the thread that reads a |PuffinStream| and by
+// the workers of its |PuffReadAhead|. The methods of |StreamInterface| are
+// only used by the thread that reads the |PuffinStream| and have their own
+// offset. |ReadAt| can be called from any thread.
+class SharedStream : public StreamInterface {
+ public:
+  explicit SharedStream(UniqueStreamPtr stream);
+  ~SharedStream() override = default;
+
+  bool GetSize(uint64_t* size) const override;
+  bool GetOffset(uint64_t* offset) const override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t length) override;
+  bool Write(const void* buffer, size_t length) override;
+  bool Close() override;
+
+  // Reads |length| bytes at |offset| of the stream into |buffer|.
+  bool ReadAt(uint64_t offset, void* buffer, size_t length);
+
+ private:
+  UniqueStreamPtr stream_;
+
+  // Guards |stream_|.
+  mutable std::mutex mutex_;
+
+  // The offset of the reads with |Read|.
+  uint64_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedStream);
+};
+
+// Puffs the deflates of a |PuffinStream| on worker threads ahead of the reads
+// that need them. The puffs to puff next are given with |Schedule|, and the
+// workers puff them in that order, each with its own |Puffer|. The puffs are
+// kept until they are taken with |Take| or |TakeDone|. All the methods are
+// called from the thread that reads the |PuffinStream|.
+class PuffReadAhead {
+ public:
+  // |stream|      IN  The deflate stream.
+  // |deflates|    IN  The location of deflates in |stream|.
+  // |puffs|       IN  The location of puffs into the puff stream.
+  // |puff_format| IN  The layout of the puffs.
+  // |num_threads| IN  The number of workers.
+  // |stream|, |deflates| and |puffs| have to outlive this object.
+  PuffReadAhead(SharedStream* stream,
+                const std::vector<BitExtent>& deflates,
+                const std::vector<ByteExtent>& puffs,
+                PuffFormat puff_format,
+                size_t num_threads);
+
+  // Waits for the puffs being puffed and stops the workers.
+  ~PuffReadAhead();
+
+  // Replaces the puffs waiting to be puffed with the |puff_id|th puffs.
+  void Schedule(const std::vector<int>& puff_ids);
+
+  // Returns true if the |puff_id|th puff is waiting, being puffed or puffed and
+  // not taken yet.
+  bool Contains(int puff_id) const;
+
+  // Returns the total size of the puffs that are waiting, being puffed or
+  // puffed and not taken yet.
+  uint64_t Size() const;
+
+  // Takes the |puff_id|th puff into |puff| if it is puffed, and waits for it if
+  // it is being puffed. It returns false if the puff is not puffed, and drops
+  // it if it is still waiting.
+  bool Take(int puff_id, SharedBufferPtr* puff);
+
+  // Takes the puffs that are puffed and their indices.
+  void TakeDone(std::vector<std::pair<int, SharedBufferPtr>>* puffs);
+
+ private:
+  // The loop of the workers.
+  void Work();
+
+  // Puffs the |puff_id|th deflate into |puff|.
+  bool PuffDeflate(const Puffer& puffer, int puff_id, Buffer* puff) const;
+
+  SharedStream* stream_;
+  const std::vector<BitExtent>& deflates_;
+  const std::vector<ByteExtent>& puffs_;
+  PuffFormat puff_format_;
+
+  // Guards the members below.
+  mutable std::mutex mutex_;
+  // Signaled when puffs are scheduled, a puff is done or the workers stop.
+  std::condition_variable cond_;
+  std::deque<int> waiting_;
+  std::set<int> in_progress_;
+  // The puffs that are done. It is nullptr if puffing failed.
+  std::map<int, SharedBufferPtr> done_;
+  uint64_t size_;
+  bool stop_;
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffReadAhead);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_PUFF_READ_AHEAD_H_
@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "puffin/src/logging.h"
+#include "puffin/src/table_array.h"
 
 namespace puffin {
 
@@ -18,8 +19,36 @@ namespace {
 inline uint16_t ReadByteArrayToUint16(const uint8_t* buffer) {
   return (*buffer << 8) | *(buffer + 1);
 }
+
+// Reads a 32-bit value from the buffer in big-endian mode.
+inline uint32_t ReadByteArrayToUint32(const uint8_t* buffer) {
+  return (static_cast<uint32_t>(ReadByteArrayToUint16(buffer)) << 16) |
+         ReadByteArrayToUint16(buffer + 2);
+}
+
+// The layout of the entries of |kHeaderEntries|. Each entry classifies the
+// first byte of a literals or length/distance record: whether it is a
+// length/distance, whether the length continues in the following byte(s) and
+// the length itself (or the base that is added to the following byte(s)).
+constexpr uint16_t kHeaderEntryLenDist = 0x8000;
+constexpr uint16_t kHeaderEntryLong = 0x4000;
+constexpr uint16_t kHeaderEntryLengthMask = 0x3FFF;
+
+constexpr uint16_t HeaderEntry(size_t header) {
+  return (header & 0x80)
+             ? kHeaderEntryLenDist | ((header & 0x7F) == 0x7F
+                                          ? kHeaderEntryLong | 130
+                                          : (header & 0x7F) + 3)
+             : ((header & 0x7F) == 0x7F ? kHeaderEntryLong | 128
+                                        : (header & 0x7F) + 1);
+}
+
+constexpr TableArray<uint16_t, 256> kHeaderEntries =
+    GenerateArray<uint16_t, HeaderEntry>(MakeIndexSequence<256>());
 }  // namespace
 
+constexpr size_t PuffDataBatch::kMaxSize;
+
 bool BufferPuffReader::GetNext(PuffData* data) {
   PuffData& pd = *data;
   size_t length = 0;
@@ -82,13 +111,8 @@ bool BufferPuffReader::GetNext(PuffData* data) {
       TEST_AND_RETURN_FALSE(index_ + length <= puff_size_);
       pd.type = PuffData::Type::kLiterals;
       pd.length = length;
-      pd.read_fn = [this, length](uint8_t* buffer, size_t count) mutable {
-        TEST_AND_RETURN_FALSE(count <= length);
-        memcpy(buffer, &puff_buf_in_[index_], count);
-        index_ += count;
-        length -= count;
-        return true;
-      };
+      pd.literals = &puff_buf_in_[index_];
+      index_ += length;
       return true;
     }
   } else {  // Block metadata
@@ -109,8 +133,248 @@ bool BufferPuffReader::GetNext(PuffData* data) {
   return true;
 }
 
+bool BufferPuffReader::GetNextBatch(PuffDataBatch* batch) {
+  TEST_AND_RETURN_FALSE(state_ == State::kReadingLenDist);
+  size_t count = 0;
+  // A part of a puff can end in the middle of a block.
+  while (count < PuffDataBatch::kMaxSize && index_ < puff_size_) {
+    auto entry = kHeaderEntries.data[puff_buf_in_[index_++]];
+    size_t length = entry & kHeaderEntryLengthMask;
+    if (entry & kHeaderEntryLenDist) {
+      if (entry & kHeaderEntryLong) {
+        // Boundary check
+        TEST_AND_RETURN_FALSE(index_ < puff_size_);
+        length += puff_buf_in_[index_++];
+        // End of block is written like a length of 259 without a distance.
+        if (length == 259) {
+          batch->types[count++] = PuffData::Type::kEndOfBlock;
+          state_ = State::kReadingBlockMetadata;
+          break;
+        }
+        TEST_AND_RETURN_FALSE(length <= 258);
+      }
+      // Boundary check
+      TEST_AND_RETURN_FALSE(index_ + 1 < puff_size_);
+      auto distance = ReadByteArrayToUint16(&puff_buf_in_[index_]);
+      TEST_AND_RETURN_FALSE(distance < (1 << 15));
+      index_ += 2;
+      batch->types[count] = PuffData::Type::kLenDist;
+      batch->lengths[count] = length;
+      batch->distances[count] = distance + 1;
+    } else {
+      if (entry & kHeaderEntryLong) {
+        // Boundary check
+        TEST_AND_RETURN_FALSE(index_ + 1 < puff_size_);
+        length += ReadByteArrayToUint16(&puff_buf_in_[index_]);
+        index_ += 2;
+      }
+      // Boundary check
+      TEST_AND_RETURN_FALSE(length <= puff_size_ - index_);
+      batch->types[count] = PuffData::Type::kLiterals;
+      batch->lengths[count] = length;
+      batch->literals[count] = &puff_buf_in_[index_];
+      index_ += length;
+    }
+    count++;
+  }
+  batch->size = count;
+  return true;
+}
+
 size_t BufferPuffReader::BytesLeft() const {
   return puff_size_ - index_;
 }
 
+size_t BufferPuffReader::WholeRecordsSize() const {
+  bool in_block = state_ == State::kReadingLenDist;
+  // True while in an uncompressed block.
+  bool uncompressed = false;
+  size_t index = index_;
+  size_t whole_index = index_;
+  while (index < puff_size_) {
+    size_t left = puff_size_ - index;
+    if (!in_block) {
+      // Block metadata: Two bytes of length, then the metadata itself starting
+      // with the block header.
+      if (left < 3) {
+        break;
+      }
+      size_t length = ReadByteArrayToUint16(&puff_buf_in_[index]) + 1;
+      uncompressed = (puff_buf_in_[index + 2] & 0x60) == 0;
+      index += 2 + length;
+      in_block = true;
+    } else {
+      auto entry = kHeaderEntries.data[puff_buf_in_[index]];
+      size_t length = entry & kHeaderEntryLengthMask;
+      if (entry & kHeaderEntryLenDist) {
+        if (entry & kHeaderEntryLong) {
+          if (left < 2) {
+            break;
+          }
+          length += puff_buf_in_[index + 1];
+          index += 2;
+          if (length == 259) {
+            // End of block.
+            in_block = false;
+            uncompressed = false;
+            whole_index = index;
+            continue;
+          }
+        } else {
+          index++;
+        }
+        index += 2;  // Distance.
+      } else {
+        if (entry & kHeaderEntryLong) {
+          if (left < 3) {
+            break;
+          }
+          length += ReadByteArrayToUint16(&puff_buf_in_[index + 1]);
+          index += 3;
+        } else {
+          index++;
+        }
+        index += length;
+      }
+    }
+    if (index > puff_size_) {
+      break;
+    }
+    if (!uncompressed) {
+      whole_index = index;
+    }
+  }
+  return whole_index - index_;
+}
+
+BufferColumnarPuffReader::BufferColumnarPuffReader(const uint8_t* puff_buf,
+                                                   size_t puff_size)
+    : puff_size_(puff_size),
+      valid_(true),
+      metadata_{puff_buf, 0, 0},
+      headers_{puff_buf, 0, 0},
+      distances_{puff_buf, 0, 0},
+      literals_{puff_buf, 0, 0},
+      state_(State::kReadingBlockMetadata) {
+  // An empty puff has no sections at all.
+  if (puff_size_ == 0) {
+    return;
+  }
+  if (puff_size_ < kColumnarSectionSizesLength) {
+    valid_ = false;
+    return;
+  }
+  size_t offset = kColumnarSectionSizesLength;
+  const uint8_t* section_size = puff_buf;
+  for (auto* section : {&metadata_, &headers_, &distances_}) {
+    section->size = ReadByteArrayToUint32(section_size);
+    section_size += sizeof(uint32_t);
+    if (section->size > puff_size_ - offset) {
+      valid_ = false;
+      return;
+    }
+    section->data = &puff_buf[offset];
+    offset += section->size;
+  }
+  literals_.data = &puff_buf[offset];
+  literals_.size = puff_size_ - offset;
+}
+
+bool BufferColumnarPuffReader::ReadRecord(PuffData::Type* type,
+                                          size_t* length,
+                                          size_t* distance,
+                                          const uint8_t** literals) {
+  // Boundary check
+  TEST_AND_RETURN_FALSE(headers_.index < headers_.size);
+  auto entry = kHeaderEntries.data[headers_.data[headers_.index++]];
+  *length = entry & kHeaderEntryLengthMask;
+  if (entry & kHeaderEntryLenDist) {
+    if (entry & kHeaderEntryLong) {
+      // Boundary check
+      TEST_AND_RETURN_FALSE(headers_.index < headers_.size);
+      *length += headers_.data[headers_.index++];
+      // End of block is written like a length of 259 without a distance.
+      if (*length == 259) {
+        *type = PuffData::Type::kEndOfBlock;
+        state_ = State::kReadingBlockMetadata;
+        DVLOG(2) << "Read end of block";
+        return true;
+      }
+      TEST_AND_RETURN_FALSE(*length <= 258);
+    }
+    // Boundary check
+    TEST_AND_RETURN_FALSE(distances_.index + 1 < distances_.size);
+    auto dist = ReadByteArrayToUint16(&distances_.data[distances_.index]);
+    TEST_AND_RETURN_FALSE(dist < (1 << 15));
+    distances_.index += 2;
+    *type = PuffData::Type::kLenDist;
+    *distance = dist + 1;
+    DVLOG(2) << "Read length: " << *length << " distance: " << *distance;
+  } else {
+    if (entry & kHeaderEntryLong) {
+      // Boundary check
+      TEST_AND_RETURN_FALSE(headers_.index + 1 < headers_.size);
+      *length += ReadByteArrayToUint16(&headers_.data[headers_.index]);
+      headers_.index += 2;
+    }
+    // Boundary check
+    TEST_AND_RETURN_FALSE(*length <= literals_.size - literals_.index);
+    *type = PuffData::Type::kLiterals;
+    *literals = &literals_.data[literals_.index];
+    literals_.index += *length;
+    DVLOG(2) << "Read literals length: " << *length;
+  }
+  return true;
+}
+
+bool BufferColumnarPuffReader::GetNext(PuffData* data) {
+  TEST_AND_RETURN_FALSE(valid_);
+  PuffData& pd = *data;
+  if (state_ == State::kReadingLenDist) {
+    return ReadRecord(&pd.type, &pd.length, &pd.distance, &pd.literals);
+  }
+  pd.type = PuffData::Type::kBlockMetadata;
+  // Boundary check
+  TEST_AND_RETURN_FALSE(metadata_.index + 2 < metadata_.size);
+  size_t length = ReadByteArrayToUint16(&metadata_.data[metadata_.index]) + 1;
+  metadata_.index += 2;
+  DVLOG(2) << "Read block metadata length: " << length;
+  // Boundary check
+  TEST_AND_RETURN_FALSE(length <= metadata_.size - metadata_.index);
+  TEST_AND_RETURN_FALSE(length <= sizeof(pd.block_metadata));
+  memcpy(pd.block_metadata, &metadata_.data[metadata_.index], length);
+  metadata_.index += length;
+  pd.length = length;
+  state_ = State::kReadingLenDist;
+  return true;
+}
+
+bool BufferColumnarPuffReader::GetNextBatch(PuffDataBatch* batch) {
+  TEST_AND_RETURN_FALSE(valid_);
+  TEST_AND_RETURN_FALSE(state_ == State::kReadingLenDist);
+  size_t count = 0;
+  while (count < PuffDataBatch::kMaxSize) {
+    size_t length;
+    size_t distance = 0;
+    TEST_AND_RETURN_FALSE(ReadRecord(&batch->types[count], &length, &distance,
+                                     &batch->literals[count]));
+    if (batch->types[count++] == PuffData::Type::kEndOfBlock) {
+      break;
+    }
+    batch->lengths[count - 1] = length;
+    batch->distances[count - 1] = distance;
+  }
+  batch->size = count;
+  return true;
+}
+
+size_t BufferColumnarPuffReader::BytesLeft() const {
+  if (!valid_) {
+    return puff_size_;
+  }
+  return (metadata_.size - metadata_.index) + (headers_.size - headers_.index) +
+         (distances_.size - distances_.index) +
+         (literals_.size - literals_.index);
+}
+
 }  // namespace puffin
@@ -27,28 +27,51 @@ class PuffReaderInterface {
   // |data|  OUT  The next data available in the puffed buffer.
   virtual bool GetNext(PuffData* data) = 0;
 
+  // Retrieves the next records of the current compressed block in one call.
+  // It decodes up to |PuffDataBatch::kMaxSize| records and stops early right
+  // after the end of block (or, for |BufferPuffReader|, at the end of the puff
+  // buffer). It must only be called after the block metadata of a compressed
+  // block has been read with |GetNext| and until its end of block is
+  // returned.
+  //
+  // |batch|  OUT  The next records available in the puffed buffer.
+  virtual bool GetNextBatch(PuffDataBatch* batch) = 0;
+
   // Returns the number of bytes left in the puff buffer.
   virtual size_t BytesLeft() const = 0;
 };
 
-class BufferPuffReader : public PuffReaderInterface {
+class BufferPuffReader final : public PuffReaderInterface {
  public:
   // Sets the parameters of puff buffer.
   //
   // |puff_buf|  IN  The input puffed stream. It is owned by the caller and must
   //                 be valid during the lifetime of the object.
   // |puff_size| IN  The size of the puffed stream.
-  BufferPuffReader(const uint8_t* puff_buf, size_t puff_size)
+  // |in_block|  IN  True if the puffed stream is a part of a puff that starts
+  //                 after the block metadata of a compressed block.
+  BufferPuffReader(const uint8_t* puff_buf,
+                   size_t puff_size,
+                   bool in_block = false)
       : puff_buf_in_(puff_buf),
         puff_size_(puff_size),
         index_(0),
-        state_(State::kReadingBlockMetadata) {}
+        state_(in_block ? State::kReadingLenDist
+                        : State::kReadingBlockMetadata) {}
 
   ~BufferPuffReader() override = default;
 
   bool GetNext(PuffData* pd) override;
+  bool GetNextBatch(PuffDataBatch* batch) override;
   size_t BytesLeft() const override;
 
+  // Returns the number of bytes from the current offset that hold whole
+  // records, for reading a puff that arrives in parts. The records of an
+  // uncompressed block are only counted once its end of block is there,
+  // because they are read together. It does not check that the records are
+  // valid.
+  size_t WholeRecordsSize() const;
+
  private:
   // The pointer to the puffed stream. This should not be deallocated.
   const uint8_t* puff_buf_in_;
@@ -68,6 +91,61 @@ class BufferPuffReader : public PuffReaderInterface {
   DISALLOW_COPY_AND_ASSIGN(BufferPuffReader);
 };
 
+// Reads a puff buffer in the columnar layout (|PuffFormat::kColumnar|) written
+// by |BufferColumnarPuffWriter|. It returns the same records as
+// |BufferPuffReader| does for the same data in the interleaved layout.
+class BufferColumnarPuffReader final : public PuffReaderInterface {
+ public:
+  // Sets the parameters of puff buffer. If the section sizes at the beginning
+  // of the buffer are not valid, all calls to |GetNext| and |GetNextBatch|
+  // fail.
+  //
+  // |puff_buf|  IN  The input puffed stream. It is owned by the caller and must
+  //                 be valid during the lifetime of the object.
+  // |puff_size| IN  The size of the puffed stream.
+  BufferColumnarPuffReader(const uint8_t* puff_buf, size_t puff_size);
+
+  ~BufferColumnarPuffReader() override = default;
+
+  bool GetNext(PuffData* pd) override;
+  bool GetNextBatch(PuffDataBatch* batch) override;
+  size_t BytesLeft() const override;
+
+ private:
+  // A section of the puff buffer and the offset of its next unread byte.
+  struct Section {
+    const uint8_t* data;
+    size_t size;
+    size_t index;
+  };
+
+  // Reads the next literals, length/distance or end of block record of a
+  // compressed block.
+  bool ReadRecord(PuffData::Type* type,
+                  size_t* length,
+                  size_t* distance,
+                  const uint8_t** literals);
+
+  // The size of the puffed buffer.
+  size_t puff_size_;
+
+  // False if the section sizes are not valid.
+  bool valid_;
+
+  Section metadata_;
+  Section headers_;
+  Section distances_;
+  Section literals_;
+
+  // State when reading from the puffed buffer.
+  enum class State {
+    kReadingLenDist = 0,
+    kReadingBlockMetadata,
+  } state_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferColumnarPuffReader);
+};
+
 }  // namespace puffin
 
 #endif  // SRC_PUFF_READER_H_
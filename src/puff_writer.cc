@@ -21,9 +21,72 @@ inline void WriteUint16ToByteArray(uint16_t value, uint8_t* buffer) {
   *(buffer + 1) = value & 0x00FF;
 }
 
-constexpr size_t kLiteralsMaxLength = (1 << 16) + 127;  // 65663
+// Appends a value to the buffer in big-endian mode.
+inline void AppendUint16(uint16_t value, Buffer* buffer) {
+  buffer->push_back(value >> 8);
+  buffer->push_back(value & 0x00FF);
+}
+
+// Writes a 32-bit value to the buffer in big-endian mode.
+inline void WriteUint32ToByteArray(uint32_t value, uint8_t* buffer) {
+  WriteUint16ToByteArray(value >> 16, buffer);
+  WriteUint16ToByteArray(value & 0xFFFF, buffer + 2);
+}
+// The initial room for the puff in a growable puff buffer.
+constexpr size_t kInitialGrowablePuffSize = 1024;
 }  // namespace
 
+BufferPuffWriter::BufferPuffWriter(Buffer* puff_buffer)
+    : puff_buffer_(puff_buffer),
+      puff_buffer_offset_(puff_buffer->size()),
+      stream_(nullptr),
+      stream_size_(0),
+      index_(0),
+      len_index_(0),
+      cur_literals_length_(0),
+      state_(State::kWritingNonLiteral) {
+  puff_buffer_->resize(puff_buffer_offset_ + kInitialGrowablePuffSize);
+  puff_buf_out_ = puff_buffer_->data() + puff_buffer_offset_;
+  puff_size_ = puff_buffer_->size() - puff_buffer_offset_;
+}
+
+BufferPuffWriter::BufferPuffWriter(const UniqueStreamPtr& stream,
+                                   Buffer* buffer)
+    : puff_buf_out_(buffer->data()),
+      puff_size_(buffer->size()),
+      puff_buffer_(nullptr),
+      puff_buffer_offset_(0),
+      stream_(stream.get()),
+      stream_size_(0),
+      index_(0),
+      len_index_(0),
+      cur_literals_length_(0),
+      state_(State::kWritingNonLiteral) {}
+
+bool BufferPuffWriter::Grow(size_t size) {
+  if (stream_ != nullptr) {
+    // Everything before the run of literals that is being written is final.
+    // The run is never longer than a record. Its header is only written when
+    // the run is flushed, so |index_| can already be past the buffer.
+    TEST_AND_RETURN_FALSE(stream_->Write(puff_buf_out_, len_index_));
+    memmove(puff_buf_out_, puff_buf_out_ + len_index_,
+            std::min(index_, puff_size_) - len_index_);
+    stream_size_ += len_index_;
+    index_ -= len_index_;
+    size -= len_index_;
+    len_index_ = 0;
+    return size <= puff_size_;
+  }
+  if (puff_buffer_ == nullptr) {
+    return false;
+  }
+  // Double the size to keep appending amortized constant time.
+  puff_buffer_->resize(puff_buffer_offset_ + std::max(size, puff_size_ * 2));
+  puff_buf_out_ = puff_buffer_->data() + puff_buffer_offset_;
+  puff_size_ = puff_buffer_->size() - puff_buffer_offset_;
+  return true;
+}
+
 bool BufferPuffWriter::Insert(const PuffData& pd) {
   switch (pd.type) {
     case PuffData::Type::kLiterals:
@@ -34,16 +97,33 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
     case PuffData::Type::kLiteral: {
       DVLOG(2) << "Write literals length: " << pd.length;
       size_t length = pd.type == PuffData::Type::kLiteral ? 1 : pd.length;
-      if (state_ == State::kWritingNonLiteral) {
-        len_index_ = index_;
-        index_++;
-        state_ = State::kWritingSmallLiteral;
-      }
-      if (state_ == State::kWritingSmallLiteral) {
-        if ((cur_literals_length_ + length) > 127) {
+      while (length > 0) {
+        // Technically with the current structure of the puff stream, we cannot
+        // have total length of more than 65663 bytes for a series of literals.
+        // So we have to cap it at 65663 and continue afterwards.
+        size_t count =
+            std::min(length, kLiteralsMaxLength - cur_literals_length_);
+        if (state_ == State::kWritingNonLiteral) {
+          // Pick the size of the header from the first literals of the run, so
+          // a run that is already known to be large does not have to be moved
+          // after its literals are written. |Puffer| always inserts more than
+          // 127 literals at once at the start of such runs.
+          len_index_ = index_;
+          if (count > 127) {
+            index_ += 3;
+            state_ = State::kWritingLargeLiteral;
+          } else {
+            index_++;
+            state_ = State::kWritingSmallLiteral;
+          }
+        } else if (state_ == State::kWritingSmallLiteral &&
+                   (cur_literals_length_ + count) > 127) {
+          // A small run that grows piece by piece. At most 127 literals are
+          // moved here.
           if (puff_buf_out_ != nullptr) {
             // Boundary check
-            TEST_AND_RETURN_FALSE(index_ + 2 <= puff_size_);
+            TEST_AND_RETURN_FALSE(index_ + 2 <= puff_size_ ||
+                                  Grow(index_ + 2));
 
             // Shift two bytes forward to open space for length value.
             memmove(&puff_buf_out_[len_index_ + 3],
@@ -52,28 +132,31 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
           index_ += 2;
           state_ = State::kWritingLargeLiteral;
         }
-      }
 
-      if (puff_buf_out_ != nullptr) {
-        // Boundary check
-        TEST_AND_RETURN_FALSE(index_ + length <= puff_size_);
-        if (pd.type == PuffData::Type::kLiteral) {
-          puff_buf_out_[index_] = pd.byte;
-        } else {
-          TEST_AND_RETURN_FALSE(pd.read_fn(&puff_buf_out_[index_], length));
+        if (puff_buf_out_ != nullptr) {
+          // Boundary check
+          TEST_AND_RETURN_FALSE(index_ + count <= puff_size_ ||
+                                Grow(index_ + count));
+          if (pd.type == PuffData::Type::kLiteral) {
+            puff_buf_out_[index_] = pd.byte;
+          } else if (pd.literals != nullptr) {
+            memcpy(&puff_buf_out_[index_], &pd.literals[pd.length - length],
+                   count);
+          } else {
+            TEST_AND_RETURN_FALSE(pd.read_fn(&puff_buf_out_[index_], count));
+          }
+        } else if (pd.type == PuffData::Type::kLiterals &&
+                   pd.literals == nullptr) {
+          TEST_AND_RETURN_FALSE(pd.read_fn(nullptr, count));
         }
-      } else if (pd.type == PuffData::Type::kLiterals) {
-        TEST_AND_RETURN_FALSE(pd.read_fn(nullptr, length));
-      }
 
-      index_ += length;
-      cur_literals_length_ += length;
+        index_ += count;
+        cur_literals_length_ += count;
+        length -= count;
 
-      // Technically with the current structure of the puff stream, we cannot
-      // have total length of more than 65663 bytes for a series of literals. So
-      // we have to cap it at 65663 and continue afterwards.
-      if (cur_literals_length_ == kLiteralsMaxLength) {
-        TEST_AND_RETURN_FALSE(FlushLiterals());
+        if (cur_literals_length_ == kLiteralsMaxLength) {
+          TEST_AND_RETURN_FALSE(FlushLiterals());
+        }
       }
       break;
     }
@@ -85,7 +168,8 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
       if (pd.length < 130) {
         if (puff_buf_out_ != nullptr) {
           // Boundary check
-          TEST_AND_RETURN_FALSE(index_ + 3 <= puff_size_);
+          TEST_AND_RETURN_FALSE(index_ + 3 <= puff_size_ ||
+                                Grow(index_ + 3));
 
           puff_buf_out_[index_++] =
               kLenDistHeader | static_cast<uint8_t>(pd.length - 3);
@@ -95,7 +179,8 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
       } else {
         if (puff_buf_out_ != nullptr) {
           // Boundary check
-          TEST_AND_RETURN_FALSE(index_ + 4 <= puff_size_);
+          TEST_AND_RETURN_FALSE(index_ + 4 <= puff_size_ ||
+                                Grow(index_ + 4));
 
           puff_buf_out_[index_++] = kLenDistHeader | 127;
           puff_buf_out_[index_++] = static_cast<uint8_t>(pd.length - 3 - 127);
@@ -120,7 +205,8 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
                             pd.length > 0);
       if (puff_buf_out_ != nullptr) {
         // Boundary check
-        TEST_AND_RETURN_FALSE(index_ + pd.length + 2 <= puff_size_);
+        TEST_AND_RETURN_FALSE(index_ + pd.length + 2 <= puff_size_ ||
+                              Grow(index_ + pd.length + 2));
 
         WriteUint16ToByteArray(pd.length - 1, &puff_buf_out_[index_]);
       }
@@ -139,7 +225,8 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
       TEST_AND_RETURN_FALSE(FlushLiterals());
       if (puff_buf_out_ != nullptr) {
         // Boundary check
-        TEST_AND_RETURN_FALSE(index_ + 2 <= puff_size_);
+        TEST_AND_RETURN_FALSE(index_ + 2 <= puff_size_ ||
+                              Grow(index_ + 2));
 
         puff_buf_out_[index_++] = kLenDistHeader | 127;
         puff_buf_out_[index_++] = static_cast<uint8_t>(259 - 3 - 127);
@@ -202,11 +289,163 @@ bool BufferPuffWriter::FlushLiterals() {
 
 bool BufferPuffWriter::Flush() {
   TEST_AND_RETURN_FALSE(FlushLiterals());
+  if (puff_buffer_ != nullptr) {
+    puff_buffer_->resize(puff_buffer_offset_ + index_);
+  }
+  if (stream_ != nullptr) {
+    TEST_AND_RETURN_FALSE(stream_->Write(puff_buf_out_, index_));
+    stream_size_ += index_;
+    index_ = 0;
+    len_index_ = 0;
+  }
   return true;
 }
 
 size_t BufferPuffWriter::Size() {
-  return index_;
+  return stream_size_ + index_;
+}
+
+BufferColumnarPuffWriter::BufferColumnarPuffWriter(Buffer* puff_buffer)
+    : puff_buffer_(puff_buffer),
+      puff_buffer_offset_(puff_buffer->size()),
+      literals_size_(0),
+      cur_literals_length_(0) {
+  // The sections are only written in |Flush|, but |puff_buf_out_| must not be
+  // |nullptr| to keep the literals.
+  puff_buffer_->resize(puff_buffer_offset_ + 1);
+  puff_buf_out_ = puff_buffer_->data() + puff_buffer_offset_;
+  puff_size_ = puff_buffer_->size() - puff_buffer_offset_;
+}
+
+bool BufferColumnarPuffWriter::Insert(const PuffData& pd) {
+  switch (pd.type) {
+    case PuffData::Type::kLiteral:
+    case PuffData::Type::kLiterals: {
+      DVLOG(2) << "Write literals length: " << pd.length;
+      size_t length = pd.type == PuffData::Type::kLiteral ? 1 : pd.length;
+      while (length > 0) {
+        // Runs of literals are split at 65663 the same way as in
+        // |BufferPuffWriter|.
+        size_t count =
+            std::min(length, kLiteralsMaxLength - cur_literals_length_);
+        if (puff_buf_out_ != nullptr) {
+          if (pd.type == PuffData::Type::kLiteral) {
+            literals_.push_back(pd.byte);
+          } else if (pd.literals != nullptr) {
+            const uint8_t* literals = &pd.literals[pd.length - length];
+            literals_.insert(literals_.end(), literals, literals + count);
+          } else {
+            literals_.resize(literals_size_ + count);
+            TEST_AND_RETURN_FALSE(
+                pd.read_fn(&literals_[literals_size_], count));
+          }
+        } else if (pd.type == PuffData::Type::kLiterals &&
+                   pd.literals == nullptr) {
+          TEST_AND_RETURN_FALSE(pd.read_fn(nullptr, count));
+        }
+        literals_size_ += count;
+        cur_literals_length_ += count;
+        length -= count;
+
+        if (cur_literals_length_ == kLiteralsMaxLength) {
+          TEST_AND_RETURN_FALSE(FlushLiterals());
+        }
+      }
+      break;
+    }
+    case PuffData::Type::kLenDist:
+      DVLOG(2) << "Write length: " << pd.length << " distance: " << pd.distance;
+      TEST_AND_RETURN_FALSE(FlushLiterals());
+      TEST_AND_RETURN_FALSE(pd.length <= 258 && pd.length >= 3);
+      TEST_AND_RETURN_FALSE(pd.distance <= 32768 && pd.distance >= 1);
+      if (pd.length < 130) {
+        headers_.push_back(kLenDistHeader |
+                           static_cast<uint8_t>(pd.length - 3));
+      } else {
+        headers_.push_back(kLenDistHeader | 127);
+        headers_.push_back(static_cast<uint8_t>(pd.length - 3 - 127));
+      }
+      // Write the distance in the range [1..32768] zero-based.
+      AppendUint16(pd.distance - 1, &distances_);
+      break;
+
+    case PuffData::Type::kBlockMetadata:
+      DVLOG(2) << "Write block metadata length: " << pd.length;
+      TEST_AND_RETURN_FALSE(FlushLiterals());
+      TEST_AND_RETURN_FALSE(pd.length <= sizeof(pd.block_metadata) &&
+                            pd.length > 0);
+      AppendUint16(pd.length - 1, &metadata_);
+      metadata_.insert(metadata_.end(), pd.block_metadata,
+                       pd.block_metadata + pd.length);
+      break;
+
+    case PuffData::Type::kEndOfBlock:
+      DVLOG(2) << "Write end of block";
+      TEST_AND_RETURN_FALSE(FlushLiterals());
+      headers_.push_back(kLenDistHeader | 127);
+      headers_.push_back(static_cast<uint8_t>(259 - 3 - 127));
+      break;
+
+    default:
+      LOG(ERROR) << "Invalid PuffData::Type";
+      return false;
+  }
+  return true;
+}
+
+bool BufferColumnarPuffWriter::FlushLiterals() {
+  if (cur_literals_length_ == 0) {
+    return true;
+  }
+  if (cur_literals_length_ <= 127) {
+    headers_.push_back(kLiteralsHeader |
+                       static_cast<uint8_t>(cur_literals_length_ - 1));
+    DVLOG(2) << "Write small literals length: " << cur_literals_length_;
+  } else {
+    headers_.push_back(kLiteralsHeader | 127);
+    AppendUint16(static_cast<uint16_t>(cur_literals_length_ - 127 - 1),
+                 &headers_);
+    DVLOG(2) << "Write large literals length: " << cur_literals_length_;
+  }
+  cur_literals_length_ = 0;
+  return true;
+}
+
+bool BufferColumnarPuffWriter::Flush() {
+  TEST_AND_RETURN_FALSE(FlushLiterals());
+  if (puff_buffer_ != nullptr) {
+    puff_buffer_->resize(puff_buffer_offset_ + Size());
+    puff_buf_out_ = puff_buffer_->data() + puff_buffer_offset_;
+    puff_size_ = Size();
+  }
+  if (puff_buf_out_ == nullptr || Size() == 0) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(Size() <= puff_size_);
+  for (const auto* section : {&metadata_, &headers_, &distances_}) {
+    TEST_AND_RETURN_FALSE(section->size() <= UINT32_MAX);
+  }
+  uint8_t* out = puff_buf_out_;
+  WriteUint32ToByteArray(metadata_.size(), out);
+  WriteUint32ToByteArray(headers_.size(), out + 4);
+  WriteUint32ToByteArray(distances_.size(), out + 8);
+  out += kColumnarSectionSizesLength;
+  for (const auto* section : {&metadata_, &headers_, &distances_, &literals_}) {
+    if (!section->empty()) {
+      memcpy(out, section->data(), section->size());
+      out += section->size();
+    }
+  }
+  return true;
+}
+
+size_t BufferColumnarPuffWriter::Size() {
+  // The header of the current run of literals is not written yet.
+  size_t pending_header_size =
+      cur_literals_length_ == 0 ? 0 : (cur_literals_length_ <= 127 ? 1 : 3);
+  size_t size = metadata_.size() + headers_.size() + pending_header_size +
+                distances_.size() + literals_size_;
+  return size == 0 ? 0 : kColumnarSectionSizesLength + size;
 }
 
 }  // namespace puffin
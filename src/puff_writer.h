@@ -9,6 +9,7 @@
 #include <cstdint>
 
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/puff_data.h"
 
 namespace puffin {
@@ -36,7 +37,31 @@ class PuffWriterInterface {
   virtual size_t Size() = 0;
 };
 
-class BufferPuffWriter : public PuffWriterInterface {
+// The number of bytes each kind of record takes in a puff written by
+// |BufferPuffWriter|. They allow computing the size of a puff without
+// creating the records.
+constexpr size_t kPuffEndOfBlockSize = 2;
+
+// A block metadata of |length| bytes.
+constexpr size_t PuffBlockMetadataSize(size_t length) {
+  return 2 + length;
+}
+
+// A length/distance pair with length |length|.
+constexpr size_t PuffLenDistSize(size_t length) {
+  return length < 130 ? 3 : 4;
+}
+
+// A run of |length| literals, including the headers of all the records it is
+// split into.
+constexpr uint64_t PuffLiteralsSize(uint64_t length) {
+  return length + (length / kLiteralsMaxLength) * 3 +
+         (length % kLiteralsMaxLength == 0
+              ? 0
+              : (length % kLiteralsMaxLength <= 127 ? 1 : 3));
+}
+
+class BufferPuffWriter final : public PuffWriterInterface {
  public:
   // Sets the parameters of puff buffer.
   //
@@ -46,11 +71,36 @@ class BufferPuffWriter : public PuffWriterInterface {
   BufferPuffWriter(uint8_t* puff_buf, size_t puff_size)
       : puff_buf_out_(puff_buf),
         puff_size_(puff_size),
+        puff_buffer_(nullptr),
+        puff_buffer_offset_(0),
+        stream_(nullptr),
+        stream_size_(0),
         index_(0),
         len_index_(0),
         cur_literals_length_(0),
         state_(State::kWritingNonLiteral) {}
 
+  // Appends the puff to the end of |puff_buffer|, which grows as needed. After
+  // |Flush|, |puff_buffer| ends exactly where the puff ends.
+  //
+  // |puff_buffer| IN/OUT  The buffer to append the puff to. It is owned by the
+  //                       caller and must be valid during the lifetime of the
+  //                       object.
+  explicit BufferPuffWriter(Buffer* puff_buffer);
+
+  // Writes the puff into |stream|. The puff is put together in |buffer| and
+  // written out whenever it is full, except for the run of literals that is
+  // still being written, so the puff of a deflate of any size only takes
+  // |buffer|. After |Flush|, the whole puff is in |stream|.
+  //
+  // |stream| IN  The stream to write the puff into, at its current offset. It
+  //              is owned by the caller and must be valid during the lifetime
+  //              of the object.
+  // |buffer| IN  The buffer to put the puff together in. It is owned by the
+  //              caller and must be valid during the lifetime of the object.
+  //              It must have at least |kMaxWholeRecordsSize| bytes.
+  BufferPuffWriter(const UniqueStreamPtr& stream, Buffer* buffer);
+
   ~BufferPuffWriter() override = default;
 
   bool Insert(const PuffData& pd) override;
@@ -61,12 +111,29 @@ class BufferPuffWriter : public PuffWriterInterface {
   // Flushes the literals into the output and resets the state.
   bool FlushLiterals();
 
+  // Grows |puff_buffer_| so the puff can have at least |size| bytes, or, when
+  // writing into |stream_|, writes out the bytes of the puff that are final to
+  // make room for |size| - |index_| more bytes. Returns false if the writer
+  // has a fixed size buffer or there is no room.
+  bool Grow(size_t size);
+
   // The pointer to the puffed stream. This should not be deallocated.
   uint8_t* puff_buf_out_;
 
   // The size of the puffed buffer.
   size_t puff_size_;
 
+  // The growable buffer that |puff_buf_out_| points into, and the offset of the
+  // puff in it, or |nullptr| if the puff buffer has a fixed size.
+  Buffer* puff_buffer_;
+  size_t puff_buffer_offset_;
+
+  // The stream the puff is written into, or |nullptr|, and the number of bytes
+  // of the puff already written into it. The puff buffer then only has the
+  // rest of the puff.
+  StreamInterface* stream_;
+  uint64_t stream_size_;
+
   // The offset to the next data in the buffer.
   size_t index_;
 
@@ -87,6 +154,82 @@ class BufferPuffWriter : public PuffWriterInterface {
   DISALLOW_COPY_AND_ASSIGN(BufferPuffWriter);
 };
 
+// Writes a puff buffer in the columnar layout (|PuffFormat::kColumnar|). It
+// holds the same records as |BufferPuffWriter|, encoded the same way, but each
+// kind of field is kept in its own section of the puff:
+//
+// +---------------+----------------+---------+-----------+----------+
+// | Section sizes | Block metadata | Headers | Distances | Literals |
+// +---------------+----------------+---------+-----------+----------+
+//
+// - Section sizes: The sizes of the next three sections as 4-byte big-endian
+//   values. The literals section takes the rest of the puff.
+// - Block metadata: The size (minus one) and content of each block metadata.
+// - Headers: The header of each literals, length/distance and end of block
+//   record, which includes the number of literals or the length.
+// - Distances: The distance (minus one) of each length/distance pair.
+// - Literals: All the literals.
+//
+// Keeping the fields apart means that a change in the content of a deflate
+// does not shift every following length and distance, and each section is
+// more regular and compresses better on its own. As the sections are only
+// known in full at the end, they are cached until |Flush| writes them into the
+// puff buffer.
+class BufferColumnarPuffWriter final : public PuffWriterInterface {
+ public:
+  // Sets the parameters of puff buffer.
+  //
+  // |puff_buf|  IN  The output puff buffer. It is owned by the caller and must
+  //                 be valid during the lifetime of the object. If it is
+  //                 |nullptr|, only the size of the puff is computed.
+  // |puff_size| IN  The size of |puff_buf|.
+  BufferColumnarPuffWriter(uint8_t* puff_buf, size_t puff_size)
+      : puff_buf_out_(puff_buf),
+        puff_size_(puff_size),
+        puff_buffer_(nullptr),
+        puff_buffer_offset_(0),
+        literals_size_(0),
+        cur_literals_length_(0) {}
+
+  // Appends the puff to the end of |puff_buffer| like the growable
+  // |BufferPuffWriter|.
+  explicit BufferColumnarPuffWriter(Buffer* puff_buffer);
+
+  ~BufferColumnarPuffWriter() override = default;
+
+  bool Insert(const PuffData& pd) override;
+  bool Flush() override;
+  size_t Size() override;
+
+ private:
+  // Writes the header of the current run of literals and resets it.
+  bool FlushLiterals();
+
+  // The pointer to the puffed stream. This should not be deallocated.
+  uint8_t* puff_buf_out_;
+
+  // The size of the puffed buffer.
+  size_t puff_size_;
+
+  // The growable buffer the puff is appended to and the offset of the puff in
+  // it, or |nullptr| if the puff buffer has a fixed size.
+  Buffer* puff_buffer_;
+  size_t puff_buffer_offset_;
+
+  // The cached sections. |literals_| is not filled if only the size of the
+  // puff is computed, but |literals_size_| is always kept.
+  Buffer metadata_;
+  Buffer headers_;
+  Buffer distances_;
+  Buffer literals_;
+  size_t literals_size_;
+
+  // The number of literals in the current run.
+  size_t cur_literals_length_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferColumnarPuffWriter);
+};
+
 }  // namespace puffin
 
 #endif  // SRC_PUFF_WRITER_H_
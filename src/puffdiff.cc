@@ -16,13 +16,11 @@
 
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
-#include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/puffpatch.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/logging.h"
 #include "puffin/src/memory_stream.h"
 #include "puffin/src/puffin.pb.h"
-#include "puffin/src/puffin_stream.h"
 
 using std::string;
 using std::vector;
@@ -56,9 +54,10 @@ bool CreatePatch(const Buffer& bsdiff_patch,
                  const vector<ByteExtent>& dst_puffs,
                  uint64_t src_puff_size,
                  uint64_t dst_puff_size,
+                 PuffFormat puff_format,
                  Buffer* patch) {
   metadata::PatchHeader header;
-  header.set_version(1);
+  header.set_version(static_cast<int32_t>(puff_format));
 
   CopyVectorToRpf(src_deflates, header.mutable_src()->mutable_deflates(), 1);
   CopyVectorToRpf(dst_deflates, header.mutable_dst()->mutable_deflates(), 1);
@@ -102,31 +101,17 @@ bool PuffDiff(UniqueStreamPtr src,
               const vector<BitExtent>& dst_deflates,
               const std::vector<bsdiff::CompressorType>& compressors,
               const string& tmp_filepath,
-              Buffer* patch) {
-  auto puffer = std::make_shared<Puffer>();
-  auto puff_deflate_stream =
-      [&puffer](UniqueStreamPtr stream, const vector<BitExtent>& deflates,
-                Buffer* puff_buffer, vector<ByteExtent>* puffs) {
-        uint64_t puff_size;
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        TEST_AND_RETURN_FALSE(
-            FindPuffLocations(stream, deflates, puffs, &puff_size));
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        auto src_puffin_stream = PuffinStream::CreateForPuff(
-            std::move(stream), puffer, puff_size, deflates, *puffs);
-        puff_buffer->resize(puff_size);
-        TEST_AND_RETURN_FALSE(
-            src_puffin_stream->Read(puff_buffer->data(), puff_buffer->size()));
-        return true;
-      };
-
+              Buffer* patch,
+              PuffFormat puff_format) {
+  // Puffing also finds the location of the puffs, so each deflate is only
+  // decoded once.
   Buffer src_puff_buffer;
   Buffer dst_puff_buffer;
   vector<ByteExtent> src_puffs, dst_puffs;
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(src), src_deflates,
-                                            &src_puff_buffer, &src_puffs));
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(dst), dst_deflates,
-                                            &dst_puff_buffer, &dst_puffs));
+  TEST_AND_RETURN_FALSE(PuffDeflateStream(src, src_deflates, &src_puffs,
+                                          &src_puff_buffer, puff_format));
+  TEST_AND_RETURN_FALSE(PuffDeflateStream(dst, dst_deflates, &dst_puffs,
+                                          &dst_puff_buffer, puff_format));
 
   auto bsdiff_patch_writer = bsdiff::CreateBSDF2PatchWriter(
       tmp_filepath, compressors, kBrotliCompressionQuality);
@@ -147,7 +132,7 @@ bool PuffDiff(UniqueStreamPtr src,
 
   TEST_AND_RETURN_FALSE(CreatePatch(
       bsdiff_patch_buf, src_deflates, dst_deflates, src_puffs, dst_puffs,
-      src_puff_buffer.size(), dst_puff_buffer.size(), patch));
+      src_puff_buffer.size(), dst_puff_buffer.size(), puff_format, patch));
   return true;
 }
 
@@ -157,10 +142,11 @@ bool PuffDiff(const Buffer& src,
               const std::vector<BitExtent>& dst_deflates,
               const std::vector<bsdiff::CompressorType>& compressors,
               const std::string& tmp_filepath,
-              Buffer* patch) {
+              Buffer* patch,
+              PuffFormat puff_format) {
   return PuffDiff(MemoryStream::CreateForRead(src),
                   MemoryStream::CreateForRead(dst), src_deflates, dst_deflates,
-                  compressors, tmp_filepath, patch);
+                  compressors, tmp_filepath, patch, puff_format);
 }
 
 bool PuffDiff(const Buffer& src,
@@ -5,6 +5,8 @@
 #include "puffin/src/include/puffin/puffer.h"
 
 #include <algorithm>
+#include <cstring>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
@@ -15,7 +17,9 @@
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/phase_timer.h"
 #include "puffin/src/puff_data.h"
+#include "puffin/src/puffer_internal.h"
 #include "puffin/src/puff_writer.h"
 
 using std::string;
@@ -23,15 +27,356 @@ using std::vector;
 
 namespace puffin {
 
-Puffer::Puffer() : dyn_ht_(new HuffmanTable()), fix_ht_(new HuffmanTable()) {}
+namespace {
+// The maximum number of decoded literals collected before inserting them into
+// the puff writer.
+constexpr size_t kMaxLiteralsRun = 512;
+// A run of literals is only inserted before it ends once it has more literals
+// than fit in a small literals header, so the puff writer knows the size of
+// the header from the first insert of the run.
+static_assert(kMaxLiteralsRun - 3 > 127,
+              "Runs of literals must be inserted in large pieces");
+
+// Decodes the literals, lengths/distances and the end of block of a compressed
+// block with the Huffman table |ht| and inserts them into |pw|. It is
+// instantiated for both |HuffmanTable| and |FixedHuffmanTable|. It stops early
+// after a length/distance once |pw| has at least |puff_size| bytes, and sets
+// |end_of_block| to whether the end of block was reached. The number of
+// symbols is added to |stats| when it returns, if |stats| is not null.
+template <typename BitReaderType,
+          typename PuffWriterType,
+          typename HuffmanTableType>
+bool PuffBlockSymbols(BitReaderType* br,
+                      PuffWriterType* pw,
+                      HuffmanTableType* ht,
+                      size_t puff_size,
+                      bool* end_of_block,
+                      DeflateStats* stats) {
+  PuffData pd;
+  uint8_t literals[kMaxLiteralsRun];
+  PuffData literal_pd;
+  literal_pd.type = PuffData::Type::kLiteral;
+  PuffData literals_pd;
+  literals_pd.type = PuffData::Type::kLiterals;
+  literals_pd.literals = literals;
+
+  // Literals decoded in a row are collected in |literals| and inserted into
+  // the puff writer all at once.
+  size_t num_literals = 0;
+  // The symbols are counted regardless of |stats|, which is cheaper than
+  // checking it for every symbol.
+  uint64_t total_literals = 0;
+  uint64_t total_len_dists = 0;
+  auto flush_literals = [&literal_pd, &literals_pd, &literals, &num_literals,
+                         &total_literals, &pw]() {
+    total_literals += num_literals;
+    if (num_literals == 1) {
+      // Cheaper for the writer than copying one byte from |literals|.
+      literal_pd.byte = literals[0];
+      TEST_AND_RETURN_FALSE(pw->Insert(literal_pd));
+    } else if (num_literals != 0) {
+      literals_pd.length = num_literals;
+      TEST_AND_RETURN_FALSE(pw->Insert(literals_pd));
+    }
+    num_literals = 0;
+    return true;
+  };
+
+  while (true) {  // Returns when the end of block is reached.
+    auto max_bits = ht->LitLenMaxBits();
+    if (!br->CacheBits(max_bits)) {
+      // It could be the end of buffer and the bit length of the end_of_block
+      // symbol has less than maximum bit length of current Huffman table. So
+      // only asking for the size of end of block symbol (256).
+      TEST_AND_RETURN_FALSE(ht->EndOfBlockBitLength(&max_bits));
+    }
+    TEST_AND_RETURN_FALSE(br->CacheBits(max_bits));
+    // One lookup gives the kind of the symbol, the length of its code and
+    // for lengths, the base and number of extra bits.
+    auto entry = ht->LitLenEntry(br->ReadBits(max_bits));
+    if ((entry & kHuffmanEntryBitsMask) > max_bits) {
+      // Close to the end of the input, not all the literals of a
+      // multi-literal entry may have been read. But the code of the first
+      // symbol must have been, otherwise more bits than cached are dropped.
+      entry = ht->FirstSymbolEntry(entry);
+      TEST_AND_RETURN_FALSE((entry & kHuffmanEntryBitsMask) <= max_bits);
+    }
+    auto kind = entry & kHuffmanEntryKindMask;
+    if (kind < kHuffmanEntryLength) {
+      TEST_AND_RETURN_FALSE(kind != kHuffmanEntryInvalid);
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      // Unconditionally store three literals (|literals| has room for them)
+      // and only advance by the number of literals in the entry. This avoids
+      // hard to predict branches on the number of literals.
+      literals[num_literals] = entry >> kHuffmanEntryValueShift;
+      literals[num_literals + 1] = entry >> (kHuffmanEntryValueShift + 8);
+      literals[num_literals + 2] = entry >> kHuffmanEntryThirdLiteralShift;
+      num_literals += kind >> kHuffmanEntryKindShift;
+
+    } else if (kind == kHuffmanEntryEndOfBlock) {
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      TEST_AND_RETURN_FALSE(flush_literals());
+      pd.type = PuffData::Type::kEndOfBlock;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      if (stats != nullptr) {
+        stats->literals += total_literals;
+        stats->len_dists += total_len_dists;
+      }
+      *end_of_block = true;
+      return true;
+    } else {
+      if (kind != kHuffmanEntryLength) {
+        LOG(ERROR) << "Invalid literal/length Huffman code.";
+        return false;
+      }
+      TEST_AND_RETURN_FALSE(flush_literals());
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      // Reading length.
+      auto extra_bits_len =
+          (entry >> kHuffmanEntryExtraBitsShift) & kHuffmanEntryExtraBitsMask;
+      uint16_t extra_bits_value = 0;
+      if (extra_bits_len) {
+        TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
+        extra_bits_value = br->ReadAndDropBits(extra_bits_len);
+      }
+      auto length = (entry >> kHuffmanEntryValueShift) + extra_bits_value;
+
+      // Reading distance.
+      TEST_AND_RETURN_FALSE(br->CacheBits(ht->DistanceMaxBits()));
+      entry = ht->DistanceEntry(br->ReadBits(ht->DistanceMaxBits()));
+      if ((entry & kHuffmanEntryKindMask) != kHuffmanEntryDistance) {
+        LOG(ERROR) << "Invalid distance Huffman code.";
+        return false;
+      }
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      extra_bits_len =
+          (entry >> kHuffmanEntryExtraBitsShift) & kHuffmanEntryExtraBitsMask;
+      extra_bits_value = 0;
+      if (extra_bits_len) {
+        TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
+        extra_bits_value = br->ReadAndDropBits(extra_bits_len);
+      }
+
+      pd.type = PuffData::Type::kLenDist;
+      pd.length = length;
+      pd.distance = (entry >> kHuffmanEntryValueShift) + extra_bits_value;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      total_len_dists++;
+      // No run of literals is open here, so the puff can stop.
+      if (pw->Size() >= puff_size) {
+        if (stats != nullptr) {
+          stats->literals += total_literals;
+          stats->len_dists += total_len_dists;
+        }
+        *end_of_block = false;
+        return true;
+      }
+    }
+
+    if (num_literals > kMaxLiteralsRun - 3) {
+      TEST_AND_RETURN_FALSE(flush_literals());
+    }
+  }
+}
+
+// Calls |PuffBlockSymbols| timed as |DeflateStats::kSymbolsPhase| of |stats|.
+template <typename BitReaderType,
+          typename PuffWriterType,
+          typename HuffmanTableType>
+bool PuffCompressedBlock(BitReaderType* br,
+                         PuffWriterType* pw,
+                         HuffmanTableType* ht,
+                         size_t puff_size,
+                         bool* end_of_block,
+                         DeflateStats* stats) {
+  PhaseTimer timer(stats, DeflateStats::kSymbolsPhase);
+  return PuffBlockSymbols(br, pw, ht, puff_size, end_of_block, stats);
+}
+
+// Decodes the symbols of a compressed block with the Huffman table |ht| like
+// |PuffBlockSymbols|, but only adds the number of bytes they take in the puff
+// to |puff_size|.
+template <typename BitReaderType, typename HuffmanTableType>
+bool SizeBlockSymbols(BitReaderType* br,
+                      HuffmanTableType* ht,
+                      uint64_t* puff_size) {
+  // The number of literals decoded in a row.
+  uint64_t num_literals = 0;
+  while (true) {  // Returns when the end of block is reached.
+    auto max_bits = ht->LitLenMaxBits();
+    if (!br->CacheBits(max_bits)) {
+      TEST_AND_RETURN_FALSE(ht->EndOfBlockBitLength(&max_bits));
+    }
+    TEST_AND_RETURN_FALSE(br->CacheBits(max_bits));
+    auto entry = ht->LitLenEntry(br->ReadBits(max_bits));
+    if ((entry & kHuffmanEntryBitsMask) > max_bits) {
+      entry = ht->FirstSymbolEntry(entry);
+      TEST_AND_RETURN_FALSE((entry & kHuffmanEntryBitsMask) <= max_bits);
+    }
+    auto kind = entry & kHuffmanEntryKindMask;
+    if (kind < kHuffmanEntryLength) {
+      TEST_AND_RETURN_FALSE(kind != kHuffmanEntryInvalid);
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      num_literals += kind >> kHuffmanEntryKindShift;
+
+    } else if (kind == kHuffmanEntryEndOfBlock) {
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      *puff_size += PuffLiteralsSize(num_literals) + kPuffEndOfBlockSize;
+      return true;
+    } else {
+      if (kind != kHuffmanEntryLength) {
+        LOG(ERROR) << "Invalid literal/length Huffman code.";
+        return false;
+      }
+      *puff_size += PuffLiteralsSize(num_literals);
+      num_literals = 0;
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      auto extra_bits_len =
+          (entry >> kHuffmanEntryExtraBitsShift) & kHuffmanEntryExtraBitsMask;
+      uint16_t extra_bits_value = 0;
+      if (extra_bits_len) {
+        TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
+        extra_bits_value = br->ReadAndDropBits(extra_bits_len);
+      }
+      *puff_size += PuffLenDistSize((entry >> kHuffmanEntryValueShift) +
+                                    extra_bits_value);
+
+      // The distance is only skipped.
+      TEST_AND_RETURN_FALSE(br->CacheBits(ht->DistanceMaxBits()));
+      entry = ht->DistanceEntry(br->ReadBits(ht->DistanceMaxBits()));
+      if ((entry & kHuffmanEntryKindMask) != kHuffmanEntryDistance) {
+        LOG(ERROR) << "Invalid distance Huffman code.";
+        return false;
+      }
+      br->DropBits(entry & kHuffmanEntryBitsMask);
+      extra_bits_len =
+          (entry >> kHuffmanEntryExtraBitsShift) & kHuffmanEntryExtraBitsMask;
+      if (extra_bits_len) {
+        TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
+        br->DropBits(extra_bits_len);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+PuffDeflateState::PuffDeflateState()
+    : in_block_(false),
+      fixed_block_(false),
+      done_(false),
+      dyn_ht_(new HuffmanTable()) {}
+
+PuffDeflateState::~PuffDeflateState() {}
+
+Puffer::Puffer() : dyn_ht_(new HuffmanTable()), stats_(nullptr) {}
 
 Puffer::~Puffer() {}
 
+uint64_t Puffer::DynamicTableCacheHits() const {
+  return dyn_ht_->CacheHits();
+}
+
+uint64_t Puffer::DynamicTableCacheMisses() const {
+  return dyn_ht_->CacheMisses();
+}
+
 bool Puffer::PuffDeflate(BitReaderInterface* br,
                          PuffWriterInterface* pw,
                          vector<BitExtent>* deflates) const {
+  return PufferInternal::PuffDeflateImpl(
+      *this, br, pw, deflates, std::numeric_limits<size_t>::max(), nullptr);
+}
+
+bool PufferInternal::PuffDeflate(const Puffer& puffer,
+                                 BitReaderInterface* br,
+                                 PuffWriterInterface* pw,
+                                 vector<BitExtent>* deflates) {
+  return puffer.PuffDeflate(br, pw, deflates);
+}
+
+bool PufferInternal::PuffDeflate(const Puffer& puffer,
+                                 BufferBitReader* br,
+                                 BufferPuffWriter* pw,
+                                 vector<BitExtent>* deflates) {
+  return PuffDeflateImpl(puffer, br, pw, deflates,
+                         std::numeric_limits<size_t>::max(), nullptr);
+}
+
+bool PufferInternal::PuffDeflate(const Puffer& puffer,
+                                 StreamBitReader* br,
+                                 BufferPuffWriter* pw,
+                                 vector<BitExtent>* deflates) {
+  return PuffDeflateImpl(puffer, br, pw, deflates,
+                         std::numeric_limits<size_t>::max(), nullptr);
+}
+
+bool PufferInternal::PuffDeflateUntil(const Puffer& puffer,
+                                      BufferBitReader* br,
+                                      BufferPuffWriter* pw,
+                                      size_t puff_size,
+                                      PuffDeflateState* state) {
+  TEST_AND_RETURN_FALSE(!state->done_);
+  return PuffDeflateImpl(puffer, br, pw, nullptr, puff_size, state);
+}
+
+bool PufferInternal::PuffDeflateUntil(const Puffer& puffer,
+                                      StreamBitReader* br,
+                                      BufferPuffWriter* pw,
+                                      size_t puff_size,
+                                      PuffDeflateState* state) {
+  TEST_AND_RETURN_FALSE(!state->done_);
+  return PuffDeflateImpl(puffer, br, pw, nullptr, puff_size, state);
+}
+
+template <typename BitReaderType, typename PuffWriterType>
+bool PufferInternal::PuffDeflateImpl(const Puffer& puffer,
+                                     BitReaderType* br,
+                                     PuffWriterType* pw,
+                                     vector<BitExtent>* deflates,
+                                     size_t puff_size,
+                                     PuffDeflateState* state) {
+  if (puffer.stats_ == nullptr) {
+    return PuffDeflateBlocks(puffer, br, pw, deflates, puff_size, state);
+  }
+  auto deflate_offset = br->OffsetInBits();
+  auto puff_offset = pw->Size();
+  auto success =
+      PuffDeflateBlocks(puffer, br, pw, deflates, puff_size, state);
+  puffer.stats_->deflate_bits += br->OffsetInBits() - deflate_offset;
+  puffer.stats_->puff_bytes += pw->Size() - puff_offset;
+  return success;
+}
+
+template <typename BitReaderType, typename PuffWriterType>
+bool PufferInternal::PuffDeflateBlocks(const Puffer& puffer,
+                                       BitReaderType* br,
+                                       PuffWriterType* pw,
+                                       vector<BitExtent>* deflates,
+                                       size_t puff_size,
+                                       PuffDeflateState* state) {
   PuffData pd;
-  HuffmanTable* cur_ht;
+  FixedHuffmanTable fixed_ht;
+  // A stream puffed in steps keeps its own dynamic Huffman table, because the
+  // table of the block it stops in has to outlive this call.
+  HuffmanTable* dyn_ht =
+      state != nullptr ? state->dyn_ht_.get() : puffer.dyn_ht_.get();
+  bool end_of_block;
+  if (state != nullptr && state->in_block_) {
+    // Finish the compressed block where the last call stopped.
+    if (state->fixed_block_) {
+      TEST_AND_RETURN_FALSE(PuffCompressedBlock(br, pw, &fixed_ht, puff_size,
+                                                &end_of_block, puffer.stats_));
+    } else {
+      TEST_AND_RETURN_FALSE(PuffCompressedBlock(br, pw, dyn_ht, puff_size,
+                                                &end_of_block, puffer.stats_));
+    }
+    state->in_block_ = !end_of_block;
+    if (pw->Size() >= puff_size) {
+      return true;
+    }
+  }
+
   // No bits left to read, return. We try to cache at least eight bits because
   // the minimum length of a deflate bit stream is 8: (fixed huffman table) 3
   // bits header + 5 bits just one len/dist symbol.
@@ -39,10 +384,8 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
     auto start_bit_offset = br->OffsetInBits();
 
     TEST_AND_RETURN_FALSE(br->CacheBits(3));
-    uint8_t final_bit = br->ReadBits(1);  // BFINAL
-    br->DropBits(1);
-    uint8_t type = br->ReadBits(2);  // BTYPE
-    br->DropBits(2);
+    uint8_t final_bit = br->ReadAndDropBits(1);  // BFINAL
+    uint8_t type = br->ReadAndDropBits(2);       // BTYPE
     DVLOG(2) << "Read block type: "
              << BlockTypeToString(static_cast<BlockType>(type));
 
@@ -56,13 +399,12 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
     auto block_header = (final_bit << 7) | (type << 5);
     switch (static_cast<BlockType>(type)) {
       case BlockType::kUncompressed: {
+        PhaseTimer timer(puffer.stats_, DeflateStats::kUncompressedPhase);
         auto skipped_bits = br->ReadBoundaryBits();
         br->SkipBoundaryBits();
         TEST_AND_RETURN_FALSE(br->CacheBits(32));
-        auto len = br->ReadBits(16);  // LEN
-        br->DropBits(16);
-        auto nlen = br->ReadBits(16);  // NLEN
-        br->DropBits(16);
+        auto len = br->ReadAndDropBits(16);   // LEN
+        auto nlen = br->ReadAndDropBits(16);  // NLEN
 
         if ((len ^ nlen) != 0xFFFF) {
           LOG(ERROR) << "Length of uncompressed data is invalid;"
@@ -82,40 +424,55 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
         // Insert all the raw literals.
         pd.type = PuffData::Type::kLiterals;
         pd.length = len;
-        TEST_AND_RETURN_FALSE(br->GetByteReaderFn(pd.length, &pd.read_fn));
+        TEST_AND_RETURN_FALSE(br->GetBytes(pd.length, &pd.literals));
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
 
         pd.type = PuffData::Type::kEndOfBlock;
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
 
+        if (puffer.stats_ != nullptr) {
+          puffer.stats_->blocks[type]++;
+          puffer.stats_->literals += len;
+        }
         if (deflates != nullptr) {
           deflates->emplace_back(start_bit_offset,
                                  br->OffsetInBits() - start_bit_offset);
         }
 
+        if (pw->Size() >= puff_size) {
+          return true;
+        }
         // continue the loop. Do not read any literal/length/distance.
         continue;
       }
 
       case BlockType::kFixed:
-        fix_ht_->BuildFixedHuffmanTable();
-        cur_ht = fix_ht_.get();
         pd.type = PuffData::Type::kBlockMetadata;
         pd.block_metadata[0] = block_header;
         pd.length = 1;
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
+        if (puffer.stats_ != nullptr) {
+          puffer.stats_->blocks[type]++;
+        }
         break;
 
-      case BlockType::kDynamic:
+      case BlockType::kDynamic: {
+        PhaseTimer timer(puffer.stats_, DeflateStats::kBlockHeaderPhase);
+        auto cache_misses = dyn_ht->CacheMisses();
         pd.type = PuffData::Type::kBlockMetadata;
         pd.block_metadata[0] = block_header;
         pd.length = sizeof(pd.block_metadata) - 1;
-        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+        TEST_AND_RETURN_FALSE(dyn_ht->BuildDynamicHuffmanTable(
             br, &pd.block_metadata[1], &pd.length));
         pd.length += 1;  // For the header.
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
-        cur_ht = dyn_ht_.get();
+        if (puffer.stats_ != nullptr) {
+          puffer.stats_->blocks[type]++;
+          puffer.stats_->dynamic_table_builds +=
+              dyn_ht->CacheMisses() - cache_misses;
+        }
         break;
+      }
 
       default:
         LOG(ERROR) << "Invalid block compression type: "
@@ -123,72 +480,111 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
         return false;
     }
 
-    while (true) {  // Breaks when the end of block is reached.
-      auto max_bits = cur_ht->LitLenMaxBits();
-      if (!br->CacheBits(max_bits)) {
-        // It could be the end of buffer and the bit length of the end_of_block
-        // symbol has less than maximum bit length of current Huffman table. So
-        // only asking for the size of end of block symbol (256).
-        TEST_AND_RETURN_FALSE(cur_ht->EndOfBlockBitLength(&max_bits));
-      }
-      TEST_AND_RETURN_FALSE(br->CacheBits(max_bits));
-      auto bits = br->ReadBits(max_bits);
-      uint16_t lit_len_alphabet;
-      size_t nbits;
-      TEST_AND_RETURN_FALSE(
-          cur_ht->LitLenAlphabet(bits, &lit_len_alphabet, &nbits));
-      br->DropBits(nbits);
-      if (lit_len_alphabet < 256) {
-        pd.type = PuffData::Type::kLiteral;
-        pd.byte = lit_len_alphabet;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd));
+    bool fixed_block = static_cast<BlockType>(type) == BlockType::kFixed;
+    if (fixed_block) {
+      TEST_AND_RETURN_FALSE(PuffCompressedBlock(br, pw, &fixed_ht, puff_size,
+                                                &end_of_block, puffer.stats_));
+    } else {
+      TEST_AND_RETURN_FALSE(PuffCompressedBlock(br, pw, dyn_ht, puff_size,
+                                                &end_of_block, puffer.stats_));
+    }
+    if (!end_of_block) {
+      // Only a stream puffed in steps has a |puff_size| to stop at.
+      TEST_AND_RETURN_FALSE(state != nullptr);
+      state->in_block_ = true;
+      state->fixed_block_ = fixed_block;
+      return true;
+    }
+    if (deflates != nullptr) {
+      deflates->emplace_back(start_bit_offset,
+                             br->OffsetInBits() - start_bit_offset);
+    }
+    if (pw->Size() >= puff_size) {
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(pw->Flush());
+  if (state != nullptr) {
+    state->done_ = true;
+  }
+  return true;
+}
 
-      } else if (256 == lit_len_alphabet) {
-        pd.type = PuffData::Type::kEndOfBlock;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd));
-        if (deflates != nullptr) {
-          deflates->emplace_back(start_bit_offset,
-                                 br->OffsetInBits() - start_bit_offset);
-        }
-        break;  // Breaks the loop.
-      } else {
-        TEST_AND_RETURN_FALSE(lit_len_alphabet <= 285);
-        // Reading length.
-        auto len_code_start = lit_len_alphabet - 257;
-        auto extra_bits_len = kLengthExtraBits[len_code_start];
-        uint16_t extra_bits_value = 0;
-        if (extra_bits_len) {
-          TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
-          extra_bits_value = br->ReadBits(extra_bits_len);
-          br->DropBits(extra_bits_len);
-        }
-        auto length = kLengthBases[len_code_start] + extra_bits_value;
+bool PufferInternal::FindSubBlocksAndPuffSizes(
+    const Puffer& puffer,
+    BufferBitReader* br,
+    vector<BitExtent>* deflates,
+    vector<uint64_t>* puff_sizes) {
+  return FindSubBlocksAndPuffSizesImpl(puffer, br, deflates, puff_sizes);
+}
 
-        TEST_AND_RETURN_FALSE(br->CacheBits(cur_ht->DistanceMaxBits()));
-        auto bits = br->ReadBits(cur_ht->DistanceMaxBits());
-        uint16_t distance_alphabet;
-        size_t nbits;
-        TEST_AND_RETURN_FALSE(
-            cur_ht->DistanceAlphabet(bits, &distance_alphabet, &nbits));
-        br->DropBits(nbits);
-
-        // Reading distance.
-        extra_bits_len = kDistanceExtraBits[distance_alphabet];
-        extra_bits_value = 0;
-        if (extra_bits_len) {
-          TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
-          extra_bits_value = br->ReadBits(extra_bits_len);
-          br->DropBits(extra_bits_len);
+bool PufferInternal::FindSubBlocksAndPuffSizes(
+    const Puffer& puffer,
+    StreamBitReader* br,
+    vector<BitExtent>* deflates,
+    vector<uint64_t>* puff_sizes) {
+  return FindSubBlocksAndPuffSizesImpl(puffer, br, deflates, puff_sizes);
+}
+
+template <typename BitReaderType>
+bool PufferInternal::FindSubBlocksAndPuffSizesImpl(
+    const Puffer& puffer,
+    BitReaderType* br,
+    vector<BitExtent>* deflates,
+    vector<uint64_t>* puff_sizes) {
+  FixedHuffmanTable fixed_ht;
+  // The dynamic Huffman tables are written here, without the block header.
+  uint8_t block_metadata[sizeof(PuffData::block_metadata) - 1];
+  while (br->CacheBits(8)) {
+    auto start_bit_offset = br->OffsetInBits();
+
+    TEST_AND_RETURN_FALSE(br->CacheBits(3));
+    br->DropBits(1);  // BFINAL
+    uint8_t type = br->ReadAndDropBits(2);  // BTYPE
+
+    uint64_t puff_size = 0;
+    switch (static_cast<BlockType>(type)) {
+      case BlockType::kUncompressed: {
+        br->SkipBoundaryBits();
+        TEST_AND_RETURN_FALSE(br->CacheBits(32));
+        auto len = br->ReadAndDropBits(16);   // LEN
+        auto nlen = br->ReadAndDropBits(16);  // NLEN
+        if ((len ^ nlen) != 0xFFFF) {
+          LOG(ERROR) << "Length of uncompressed data is invalid;"
+                     << " LEN(" << len << ") NLEN(" << nlen << ")";
+          return false;
         }
+        const uint8_t* literals;
+        TEST_AND_RETURN_FALSE(br->GetBytes(len, &literals));
+        puff_size = PuffBlockMetadataSize(1) + PuffLiteralsSize(len) +
+                    kPuffEndOfBlockSize;
+        break;
+      }
 
-        pd.type = PuffData::Type::kLenDist;
-        pd.length = length;
-        pd.distance = kDistanceBases[distance_alphabet] + extra_bits_value;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      case BlockType::kFixed:
+        puff_size = PuffBlockMetadataSize(1);
+        TEST_AND_RETURN_FALSE(SizeBlockSymbols(br, &fixed_ht, &puff_size));
+        break;
+
+      case BlockType::kDynamic: {
+        size_t length = sizeof(block_metadata);
+        TEST_AND_RETURN_FALSE(puffer.dyn_ht_->BuildDynamicHuffmanTable(
+            br, block_metadata, &length));
+        puff_size = PuffBlockMetadataSize(length + 1);  // +1 for the header.
+        TEST_AND_RETURN_FALSE(
+            SizeBlockSymbols(br, puffer.dyn_ht_.get(), &puff_size));
+        break;
       }
+
+      default:
+        LOG(ERROR) << "Invalid block compression type: "
+                   << static_cast<int>(type);
+        return false;
     }
+    deflates->emplace_back(start_bit_offset,
+                           br->OffsetInBits() - start_bit_offset);
+    puff_sizes->push_back(puff_size);
   }
-  TEST_AND_RETURN_FALSE(pw->Flush());
   return true;
 }
 
@@ -0,0 +1,145 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PUFFER_INTERNAL_H_
+#define SRC_PUFFER_INTERNAL_H_
+
+#include <memory>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/puffer.h"
+
+namespace puffin {
+
+class BufferBitReader;
+class BufferPuffWriter;
+class StreamBitReader;
+
+// The state of a deflate stream that is puffed in steps with
+// |PufferInternal::PuffDeflateUntil|.
+class PuffDeflateState {
+ public:
+  PuffDeflateState();
+  ~PuffDeflateState();
+
+  // Returns true once the whole deflate stream has been puffed.
+  bool Done() const { return done_; }
+
+  // Prepares the state for puffing a new deflate stream.
+  void Reset() {
+    in_block_ = false;
+    done_ = false;
+  }
+
+ private:
+  friend class PufferInternal;
+
+  // True if puffing stopped in the middle of a compressed block, which is
+  // fixed if |fixed_block_| is true, or uses |dyn_ht_| otherwise.
+  bool in_block_;
+  bool fixed_block_;
+  bool done_;
+
+  std::unique_ptr<HuffmanTable> dyn_ht_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffDeflateState);
+};
+
+// The puffing methods of |Puffer| that take the concrete bit readers and puff
+// writers of puffin, so they are not a part of its exported API.
+class PufferInternal {
+ public:
+  // Same as |Puffer::PuffDeflate|. The overloads after this one are
+  // specialized for the buffer based writer and the buffer or stream based
+  // readers. The compiler picks them whenever the concrete types are known to
+  // the caller, which allows the bit reading and puff writing calls in the hot
+  // loops to be inlined instead of going through virtual calls.
+  static bool PuffDeflate(const Puffer& puffer,
+                          BitReaderInterface* br,
+                          PuffWriterInterface* pw,
+                          std::vector<BitExtent>* deflates);
+  static bool PuffDeflate(const Puffer& puffer,
+                          BufferBitReader* br,
+                          BufferPuffWriter* pw,
+                          std::vector<BitExtent>* deflates);
+  static bool PuffDeflate(const Puffer& puffer,
+                          StreamBitReader* br,
+                          BufferPuffWriter* pw,
+                          std::vector<BitExtent>* deflates);
+
+  // Puffs the deflate stream in |br| into |pw| the same way as |PuffDeflate|,
+  // but returns as soon as |pw| has at least |puff_size| bytes, at the end of a
+  // length/distance or a block. Puffing continues from there by calling it
+  // again with the same |br|, |pw| and |state|, so a part of a puff can be
+  // built without decoding the whole deflate stream. All the bytes in |pw| are
+  // final when it returns.
+  //
+  // |state| IN/OUT  A new (or |Reset()|) |PuffDeflateState| for each deflate
+  //                 stream. It is |Done()| once the whole stream has been
+  //                 puffed and |pw| has been flushed.
+  static bool PuffDeflateUntil(const Puffer& puffer,
+                               BufferBitReader* br,
+                               BufferPuffWriter* pw,
+                               size_t puff_size,
+                               PuffDeflateState* state);
+  static bool PuffDeflateUntil(const Puffer& puffer,
+                               StreamBitReader* br,
+                               BufferPuffWriter* pw,
+                               size_t puff_size,
+                               PuffDeflateState* state);
+
+  // Decodes the deflate stream in |br| the same way as |PuffDeflate|, but does
+  // not create the puff. It only populates |deflates| with the location of the
+  // subblocks in the input data and |puff_sizes| with the size of the puff of
+  // each subblock in |PuffFormat::kInterleaved|. The sizes are counted from
+  // the decoded symbols, so this is much cheaper than puffing into a
+  // |BufferPuffWriter| without a buffer.
+  static bool FindSubBlocksAndPuffSizes(const Puffer& puffer,
+                                        BufferBitReader* br,
+                                        std::vector<BitExtent>* deflates,
+                                        std::vector<uint64_t>* puff_sizes);
+  static bool FindSubBlocksAndPuffSizes(const Puffer& puffer,
+                                        StreamBitReader* br,
+                                        std::vector<BitExtent>* deflates,
+                                        std::vector<uint64_t>* puff_sizes);
+
+ private:
+  friend class Puffer;
+
+  // The actual implementation of all the puffing methods for any combination
+  // of bit reader and puff writer types. It counts the bytes read and written
+  // into the stats of |puffer| around |PuffDeflateBlocks|.
+  template <typename BitReaderType, typename PuffWriterType>
+  static bool PuffDeflateImpl(const Puffer& puffer,
+                              BitReaderType* br,
+                              PuffWriterType* pw,
+                              std::vector<BitExtent>* deflates,
+                              size_t puff_size,
+                              PuffDeflateState* state);
+
+  // Puffs the blocks of the deflate stream in |br| into |pw|. It puffs the
+  // whole stream at once if |state| is null.
+  template <typename BitReaderType, typename PuffWriterType>
+  static bool PuffDeflateBlocks(const Puffer& puffer,
+                                BitReaderType* br,
+                                PuffWriterType* pw,
+                                std::vector<BitExtent>* deflates,
+                                size_t puff_size,
+                                PuffDeflateState* state);
+
+  // The actual implementation of |FindSubBlocksAndPuffSizes| for any bit
+  // reader type.
+  template <typename BitReaderType>
+  static bool FindSubBlocksAndPuffSizesImpl(const Puffer& puffer,
+                                            BitReaderType* br,
+                                            std::vector<BitExtent>* deflates,
+                                            std::vector<uint64_t>* puff_sizes);
+
+  DISALLOW_COPY_AND_ASSIGN(PufferInternal);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_PUFFER_INTERNAL_H_
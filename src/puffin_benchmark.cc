@@ -0,0 +1,341 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A simple benchmark for the puff and huff hot paths. It compresses a few
+// synthetic inputs with zlib and measures the throughput of |Puffer| and
+// |Huffer| both through the generic (virtual) interfaces and through the
+// specializations for the buffer based readers and writers, and of puffing
+// from a stream with |StreamBitReader|. It also measures reading the puff of a
+// sample through a |PuffinStream|, both a few bytes at its start and all of it
+// in small chunks, and random reads from a stream of many small deflates whose
+// puffs are mostly in the cache of the |PuffinStream|.
+//
+// Usage: puffin_benchmark [iterations]
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/huffer_internal.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+#include "puffin/src/puffer_internal.h"
+#include "puffin/src/puffin_stream.h"
+
+using std::string;
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+constexpr size_t kInputSize = 4 * 1024 * 1024;  // 4 MB
+constexpr int kDefaultIterations = 5;
+
+struct Sample {
+  string name;
+  size_t original_size;
+  Buffer deflate;
+  Buffer puff;
+};
+
+// Compresses |original| into a raw deflate stream.
+bool Deflate(const Buffer& original, int level, int strategy, Buffer* comp) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  // -15 means we are encoding a 'raw' stream without zlib headers.
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+    return false;
+  }
+  comp->resize(deflateBound(&stream, original.size()));
+  stream.next_in = original.data();
+  stream.avail_in = original.size();
+  stream.next_out = comp->data();
+  stream.avail_out = comp->size();
+  auto ret = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    return false;
+  }
+  comp->resize(comp->size() - stream.avail_out);
+  return true;
+}
+
+// Creates text like data from a small vocabulary, which produces many
+// length/distance pairs and short literal runs.
+Buffer CreateText(size_t size) {
+  static const char* kWords[] = {
+      "puffin", "deflate", "huffman", "literal", "distance", "length",
+      "block",  "stream",  "patch",   "the",     "of",       "and",
+      "a",      "to",      "in",      "is",      "\n",       "."};
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<size_t> dist(
+      0, sizeof(kWords) / sizeof(kWords[0]) - 1);
+  Buffer text;
+  text.reserve(size);
+  while (text.size() < size) {
+    const char* word = kWords[dist(gen)];
+    text.insert(text.end(), word, word + strlen(word));
+    text.push_back(' ');
+  }
+  text.resize(size);
+  return text;
+}
+
+// Creates skewed random bytes, which mostly produces long literal runs.
+Buffer CreateBinary(size_t size) {
+  std::mt19937 gen(2);
+  std::geometric_distribution<int> dist(0.05);
+  Buffer binary(size);
+  for (auto& byte : binary) {
+    byte = static_cast<uint8_t>(dist(gen));
+  }
+  return binary;
+}
+
+bool CreateSample(const string& name,
+                  const Buffer& original,
+                  int level,
+                  int strategy,
+                  Sample* sample) {
+  sample->name = name;
+  sample->original_size = original.size();
+  if (!Deflate(original, level, strategy, &sample->deflate)) {
+    return false;
+  }
+  Puffer puffer;
+  BufferBitReader size_br(sample->deflate.data(), sample->deflate.size());
+  BufferPuffWriter size_pw(nullptr, 0);
+  if (!puffer.PuffDeflate(&size_br, &size_pw, nullptr)) {
+    return false;
+  }
+  sample->puff.resize(size_pw.Size());
+  BufferBitReader br(sample->deflate.data(), sample->deflate.size());
+  BufferPuffWriter pw(sample->puff.data(), sample->puff.size());
+  return puffer.PuffDeflate(&br, &pw, nullptr);
+}
+
+// Runs |fn| |iterations| times and returns the throughput in MB/s relative to
+// |size| (the size of the uncompressed data). Returns a negative value if |fn|
+// fails.
+double Measure(size_t size, int iterations, const std::function<bool()>& fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    if (!fn()) {
+      return -1;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return size * iterations / elapsed.count() / (1024 * 1024);
+}
+
+void RunPuffBenchmarks(const Sample& sample, int iterations) {
+  Puffer puffer;
+  Buffer puff(sample.puff.size());
+  auto generic = Measure(sample.original_size, iterations, [&]() {
+    BufferBitReader br(sample.deflate.data(), sample.deflate.size());
+    BufferPuffWriter pw(puff.data(), puff.size());
+    return puffer.PuffDeflate(static_cast<BitReaderInterface*>(&br),
+                              static_cast<PuffWriterInterface*>(&pw), nullptr);
+  });
+  auto specialized = Measure(sample.original_size, iterations, [&]() {
+    BufferBitReader br(sample.deflate.data(), sample.deflate.size());
+    BufferPuffWriter pw(puff.data(), puff.size());
+    return PufferInternal::PuffDeflate(puffer, &br, &pw, nullptr);
+  });
+  auto deflate_stream = MemoryStream::CreateForRead(sample.deflate);
+  auto stream = Measure(sample.original_size, iterations, [&]() {
+    StreamBitReader br(deflate_stream.get(), 0, sample.deflate.size());
+    BufferPuffWriter pw(puff.data(), puff.size());
+    return PufferInternal::PuffDeflate(puffer, &br, &pw, nullptr);
+  });
+  printf("%-12s puff  generic: %8.2f MB/s  specialized: %8.2f MB/s"
+         "  stream: %8.2f MB/s\n",
+         sample.name.c_str(), generic, specialized, stream);
+}
+
+void RunHuffBenchmarks(const Sample& sample, int iterations) {
+  Huffer huffer;
+  Buffer deflate(sample.deflate.size());
+  auto generic = Measure(sample.original_size, iterations, [&]() {
+    BufferPuffReader pr(sample.puff.data(), sample.puff.size());
+    BufferBitWriter bw(deflate.data(), deflate.size());
+    return huffer.HuffDeflate(static_cast<PuffReaderInterface*>(&pr),
+                              static_cast<BitWriterInterface*>(&bw));
+  });
+  auto specialized = Measure(sample.original_size, iterations, [&]() {
+    BufferPuffReader pr(sample.puff.data(), sample.puff.size());
+    BufferBitWriter bw(deflate.data(), deflate.size());
+    return HufferInternal::HuffDeflate(huffer, &pr, &bw);
+  });
+  printf("%-12s huff  generic: %8.2f MB/s  specialized: %8.2f MB/s\n",
+         sample.name.c_str(), generic, specialized);
+}
+
+// Creates a |PuffinStream| that puffs the whole deflate of |sample| as one
+// puff.
+UniqueStreamPtr CreatePuffStream(const Sample& sample) {
+  return PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(sample.deflate), std::make_shared<Puffer>(),
+      sample.puff.size(), {BitExtent(0, sample.deflate.size() * 8)},
+      {ByteExtent(0, sample.puff.size())});
+}
+
+void RunStreamBenchmarks(const Sample& sample, int iterations) {
+  constexpr size_t kChunkSize = 4096;
+  Buffer chunk(kChunkSize);
+  // Each read starts with a new stream, so nothing has been puffed yet.
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    auto stream = CreatePuffStream(sample);
+    if (!stream || !stream->Read(chunk.data(), 16)) {
+      fprintf(stderr, "Failed to read from the stream of %s\n",
+              sample.name.c_str());
+      return;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto chunks = Measure(sample.original_size, iterations, [&]() {
+    auto stream = CreatePuffStream(sample);
+    if (!stream) {
+      return false;
+    }
+    for (size_t offset = 0; offset < sample.puff.size();
+         offset += kChunkSize) {
+      auto size = std::min(kChunkSize, sample.puff.size() - offset);
+      if (!stream->Read(chunk.data(), size)) {
+        return false;
+      }
+    }
+    return true;
+  });
+  printf("%-12s read  first 16 bytes: %8.3f ms   4 KiB chunks: %8.2f MB/s\n",
+         sample.name.c_str(), elapsed.count() * 1000 / iterations, chunks);
+}
+
+// Reads random parts of the puffs of |kNumDeflates| small deflates through a
+// |PuffinStream| whose cache holds all of them, so after the first pass every
+// read is served from the cache and the time is mostly spent finding it.
+void RunCacheBenchmark(int iterations) {
+  constexpr size_t kNumDeflates = 10000;
+  constexpr size_t kOriginalSize = 1024;
+  constexpr size_t kNumReads = 200000;
+  constexpr size_t kReadSize = 64;
+
+  // Every deflate compresses a different part of the same text.
+  auto text = CreateText(kNumDeflates * kOriginalSize);
+  Buffer file;
+  vector<BitExtent> deflates;
+  vector<ByteExtent> puffs;
+  uint64_t puff_size = 0;
+  Puffer puffer;
+  for (size_t i = 0; i < kNumDeflates; i++) {
+    Buffer original(text.begin() + i * kOriginalSize,
+                    text.begin() + (i + 1) * kOriginalSize);
+    Buffer deflate;
+    if (!Deflate(original, 6, Z_DEFAULT_STRATEGY, &deflate)) {
+      fprintf(stderr, "Failed to create the deflates of the cache benchmark\n");
+      return;
+    }
+    BufferBitReader br(deflate.data(), deflate.size());
+    BufferPuffWriter pw(nullptr, 0);
+    if (!puffer.PuffDeflate(&br, &pw, nullptr)) {
+      fprintf(stderr, "Failed to puff the deflates of the cache benchmark\n");
+      return;
+    }
+    deflates.emplace_back(file.size() * 8, deflate.size() * 8);
+    puffs.emplace_back(puff_size, pw.Size());
+    file.insert(file.end(), deflate.begin(), deflate.end());
+    puff_size += pw.Size();
+  }
+
+  auto stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(file), std::make_shared<Puffer>(), puff_size,
+      deflates, puffs, puff_size * 2);
+  // Fill the cache.
+  Buffer puff(puff_size);
+  if (!stream->Read(puff.data(), puff.size())) {
+    fprintf(stderr, "Failed to read from the stream of many deflates\n");
+    return;
+  }
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<size_t> dist(0, kNumDeflates - 1);
+  Buffer chunk(kReadSize);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (size_t j = 0; j < kNumReads; j++) {
+      const auto& extent = puffs[dist(gen)];
+      auto size = std::min<uint64_t>(kReadSize, extent.length);
+      if (!stream->Seek(extent.offset) || !stream->Read(chunk.data(), size)) {
+        fprintf(stderr, "Failed to read from the stream of many deflates\n");
+        return;
+      }
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%-12s read  random %zu bytes of %zu puffs: %8.3f us per read\n",
+         "cache", kReadSize, kNumDeflates,
+         elapsed.count() * 1000000 / iterations / kNumReads);
+}
+
+}  // namespace
+
+}  // namespace puffin
+
+int main(int argc, char** argv) {
+  using puffin::Sample;
+  int iterations = puffin::kDefaultIterations;
+  if (argc > 1) {
+    iterations = std::max(1, atoi(argv[1]));
+  }
+
+  auto text = puffin::CreateText(puffin::kInputSize);
+  auto binary = puffin::CreateBinary(puffin::kInputSize);
+  struct {
+    const char* name;
+    const puffin::Buffer* original;
+    int level;
+    int strategy;
+  } configs[] = {
+      {"text-fast", &text, 1, Z_DEFAULT_STRATEGY},
+      {"text-best", &text, 9, Z_DEFAULT_STRATEGY},
+      {"text-fixed", &text, 6, Z_FIXED},
+      {"binary", &binary, 6, Z_DEFAULT_STRATEGY},
+      {"literals", &binary, 6, Z_HUFFMAN_ONLY},
+      {"stored", &binary, 0, Z_DEFAULT_STRATEGY},
+  };
+
+  for (const auto& config : configs) {
+    Sample sample;
+    if (!puffin::CreateSample(config.name, *config.original, config.level,
+                              config.strategy, &sample)) {
+      fprintf(stderr, "Failed to create sample %s\n", config.name);
+      return 1;
+    }
+    puffin::RunPuffBenchmarks(sample, iterations);
+    puffin::RunHuffBenchmarks(sample, iterations);
+    puffin::RunStreamBenchmarks(sample, iterations);
+  }
+  puffin::RunCacheBenchmark(iterations);
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include "puffin/src/puffin_stream.h"
 
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
@@ -12,13 +13,18 @@
 
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/huff_write_behind.h"
+#include "puffin/src/huffer_internal.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/logging.h"
+#include "puffin/src/puff_data.h"
+#include "puffin/src/puff_read_ahead.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
+#include "puffin/src/puffer_internal.h"
 
 using std::shared_ptr;
 using std::unique_ptr;
@@ -28,6 +34,9 @@ namespace puffin {
 
 namespace {
 
+// The position of the next read of a puff that is not read again.
+constexpr uint64_t kNoPuffAccess = std::numeric_limits<uint64_t>::max();
+
 bool CheckArgsIntegrity(uint64_t deflate_size,
                         bool ignore_deflate_size,
                         uint64_t puff_size,
@@ -58,6 +67,34 @@ bool CheckArgsIntegrity(uint64_t deflate_size,
   return true;
 }
 
+// Puffs the deflate stream in |br| into the |puff_size| bytes of |puff_buf|
+// with a puff writer of type |PuffWriterType|.
+template <typename PuffWriterType>
+bool PuffInto(const Puffer& puffer,
+              StreamBitReader* br,
+              uint8_t* puff_buf,
+              size_t puff_size) {
+  PuffWriterType puff_writer(puff_buf, puff_size);
+  TEST_AND_RETURN_FALSE(
+      PufferInternal::PuffDeflate(puffer, br, &puff_writer, nullptr));
+  TEST_AND_RETURN_FALSE(puff_size == puff_writer.Size());
+  return true;
+}
+
+// Huffs the |puff_size| bytes of |puff_buf| into |bw| with a puff reader of
+// type |PuffReaderType|.
+template <typename PuffReaderType>
+bool HuffFrom(const Huffer& huffer,
+              const uint8_t* puff_buf,
+              size_t puff_size,
+              BufferBitWriter* bw) {
+  PuffReaderType puff_reader(puff_buf, puff_size);
+  TEST_AND_RETURN_FALSE(
+      HufferInternal::HuffDeflate(huffer, &puff_reader, bw));
+  TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+  return true;
+}
+
 }  // namespace
 
 UniqueStreamPtr PuffinStream::CreateForPuff(
@@ -66,7 +103,10 @@ UniqueStreamPtr PuffinStream::CreateForPuff(
     uint64_t puff_size,
     const std::vector<BitExtent>& deflates,
     const std::vector<ByteExtent>& puffs,
-    size_t max_cache_size) {
+    size_t max_cache_size,
+    PuffFormat puff_format,
+    const std::vector<int>& puff_accesses,
+    size_t num_threads) {
   uint64_t deflate_size = 0;
   TEST_AND_RETURN_VALUE(stream->GetSize(&deflate_size), nullptr);
   TEST_AND_RETURN_VALUE(
@@ -75,9 +115,14 @@ UniqueStreamPtr PuffinStream::CreateForPuff(
       nullptr);
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
-  UniqueStreamPtr puffin_stream(new PuffinStream(std::move(stream), puffer,
-                                                 nullptr, puff_size, deflates,
-                                                 puffs, max_cache_size));
+  for (auto puff_id : puff_accesses) {
+    TEST_AND_RETURN_VALUE(
+        puff_id >= 0 && static_cast<size_t>(puff_id) < puffs.size(), nullptr);
+  }
+
+  UniqueStreamPtr puffin_stream(new PuffinStream(
+      std::move(stream), puffer, nullptr, puff_size, deflates, puffs,
+      max_cache_size, puff_format, puff_accesses, num_threads));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
@@ -88,7 +133,9 @@ UniqueStreamPtr PuffinStream::CreateForHuff(
     uint64_t puff_size,
     const std::vector<BitExtent>& deflates,
     const std::vector<ByteExtent>& puffs,
-    bool ignore_deflate_size) {
+    bool ignore_deflate_size,
+    PuffFormat puff_format,
+    size_t num_threads) {
   uint64_t deflate_size = 0;
   if (!ignore_deflate_size) {
     TEST_AND_RETURN_VALUE(stream->GetSize(&deflate_size), nullptr);
@@ -99,7 +146,8 @@ UniqueStreamPtr PuffinStream::CreateForHuff(
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
   UniqueStreamPtr puffin_stream(new PuffinStream(
-      std::move(stream), nullptr, huffer, puff_size, deflates, puffs, 0));
+      std::move(stream), nullptr, huffer, puff_size, deflates, puffs, 0,
+      puff_format, vector<int>(), num_threads));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
@@ -110,7 +158,10 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
                            uint64_t puff_size,
                            const vector<BitExtent>& deflates,
                            const vector<ByteExtent>& puffs,
-                           size_t max_cache_size)
+                           size_t max_cache_size,
+                           PuffFormat puff_format,
+                           const vector<int>& puff_accesses,
+                           size_t num_threads)
     : stream_(std::move(stream)),
       puffer_(puffer),
       huffer_(huffer),
@@ -124,8 +175,21 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
       extra_byte_(0),
       is_for_puff_(puffer_ ? true : false),
       closed_(false),
+      puff_access_pos_(0),
+      last_accessed_puff_(-1),
       max_cache_size_(max_cache_size),
-      cur_cache_size_(0) {
+      cur_cache_size_(0),
+      puff_format_(puff_format),
+      partial_puff_id_(-1),
+      partial_puff_size_(0),
+      pending_puff_size_(0),
+      huff_bits_(0),
+      huff_nbits_(0),
+      deflate_bytes_written_(0),
+      extra_puff_byte_(0),
+      max_read_ahead_size_(0),
+      read_ahead_count_(0),
+      read_ahead_puff_(-1) {
   // Building upper bounds for faster seek.
   upper_bounds_.reserve(puffs.size());
   for (const auto& puff : puffs) {
@@ -151,18 +215,67 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
   for (const auto& puff : puffs) {
     max_puff_length = std::max(max_puff_length, puff.length);
   }
-  puff_buffer_.reset(new Buffer(max_puff_length + 1));
+  // Huffing an interleaved puff only needs to keep an incomplete group of
+  // records.
+  bool huff_in_parts =
+      !is_for_puff_ && puff_format_ == PuffFormat::kInterleaved;
+  if (huff_in_parts) {
+    puff_buffer_.reset(new Buffer(
+        std::min<uint64_t>(max_puff_length + 1, kMaxWholeRecordsSize)));
+  } else {
+    puff_buffer_.reset(new Buffer(max_puff_length + 1));
+  }
   if (max_cache_size_ < max_puff_length) {
     max_cache_size_ = 0;  // It means we are not caching puffs.
   }
+  if (max_cache_size_ > 0 && !puff_accesses.empty()) {
+    // |puffs_| also has the empty puff at the end of the stream.
+    puff_accesses_.resize(puffs_.size());
+    next_puff_accesses_.resize(puffs_.size(), 0);
+    for (size_t pos = 0; pos < puff_accesses.size(); pos++) {
+      puff_accesses_[puff_accesses[pos]].push_back(pos);
+    }
+    // Puffs that are not worth caching are puffed into the buffer allocated
+    // above.
+    uncached_puff_buffer_ = puff_buffer_;
+    puff_access_order_ = puff_accesses;
+  }
+  if (is_for_puff_ && num_threads > 0 && max_cache_size_ > max_puff_length) {
+    // The workers read the deflates from |stream_| too.
+    auto shared_stream = new SharedStream(std::move(stream_));
+    stream_.reset(shared_stream);
+    max_read_ahead_size_ = max_cache_size_ - max_puff_length;
+    read_ahead_count_ = num_threads * 2;
+    read_ahead_.reset(new PuffReadAhead(shared_stream, deflates_, puffs_,
+                                        puff_format_, num_threads));
+  }
+  if (!is_for_puff_ && num_threads > 0) {
+    huff_write_behind_.reset(
+        new HuffWriteBehind(stream_.get(), puff_format_, num_threads));
+  }
 
+  // The length of deflates is in bits. A deflate can span two more bytes than
+  // its length in bytes when it does not start on a byte boundary.
   uint64_t max_deflate_length = 0;
   for (const auto& deflate : deflates) {
-    max_deflate_length = std::max(max_deflate_length, deflate.length * 8);
+    max_deflate_length = std::max(max_deflate_length, deflate.length / 8);
+  }
+  // Deflates are read through a |StreamBitReader| when puffing, so the buffer
+  // is only needed for huffing.
+  if (!is_for_puff_) {
+    uint64_t deflate_buffer_size = max_deflate_length + 2;
+    if (huff_in_parts) {
+      // A record is never huffed into more than two bytes per puff byte, plus
+      // the incomplete byte carried over from the last part.
+      deflate_buffer_size = std::min<uint64_t>(deflate_buffer_size,
+                                               puff_buffer_->size() * 2 + 2);
+    }
+    deflate_buffer_.reset(new Buffer(deflate_buffer_size));
   }
-  deflate_buffer_.reset(new Buffer(max_deflate_length + 2));
 }
 
+PuffinStream::~PuffinStream() {}
+
 bool PuffinStream::GetSize(uint64_t* size) const {
   *size = puff_stream_size_;
   return true;
@@ -209,6 +322,9 @@ bool PuffinStream::Seek(uint64_t offset) {
   }
   skip_bytes_ = offset - puff_pos_;
   if (!is_for_puff_ && offset == 0) {
+    if (huff_write_behind_) {
+      TEST_AND_RETURN_FALSE(huff_write_behind_->Flush());
+    }
     TEST_AND_RETURN_FALSE(stream_->Seek(0));
     TEST_AND_RETURN_FALSE(SetExtraByte());
   }
@@ -217,6 +333,12 @@ bool PuffinStream::Seek(uint64_t offset) {
 
 bool PuffinStream::Close() {
   closed_ = true;
+  read_ahead_.reset();
+  if (huff_write_behind_) {
+    // Write the puffs that are complete, like when they are huffed right away.
+    TEST_AND_RETURN_FALSE(huff_write_behind_->Flush());
+    huff_write_behind_.reset();
+  }
   return stream_->Close();
 }
 
@@ -279,43 +401,67 @@ bool PuffinStream::Read(void* buffer, size_t count) {
       auto start_byte = (cur_deflate_->offset / 8);
       auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
       auto bytes_to_read = end_byte - start_byte;
+      auto bytes_to_copy =
+          std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
       // Puff directly to buffer if it has space.
       bool puff_directly_into_buffer =
           max_cache_size_ == 0 && (skip_bytes_ == 0) &&
           (length - bytes_read >= cur_puff_->length);
 
       auto cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
-      if (max_cache_size_ == 0 ||
-          !GetPuffCache(cur_puff_idx, cur_puff_->length, &puff_buffer_)) {
-        // Did not find the puff buffer in cache. We have to build it.
-        deflate_buffer_->resize(bytes_to_read);
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
-        TEST_AND_RETURN_FALSE(
-            stream_->Read(deflate_buffer_->data(), bytes_to_read));
-        BufferBitReader bit_reader(deflate_buffer_->data(), bytes_to_read);
-
-        BufferPuffWriter puff_writer(puff_directly_into_buffer
-                                         ? bytes + bytes_read
-                                         : puff_buffer_->data(),
-                                     cur_puff_->length);
+      if (puff_directly_into_buffer) {
+        ResetPartialPuff();
+        StreamBitReader bit_reader(stream_.get(), start_byte, bytes_to_read);
 
         // Drop the first unused bits.
         size_t extra_bits_len = cur_deflate_->offset & 7;
         TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
         bit_reader.DropBits(extra_bits_len);
 
-        TEST_AND_RETURN_FALSE(
-            puffer_->PuffDeflate(&bit_reader, &puff_writer, nullptr));
+        if (puff_format_ == PuffFormat::kColumnar) {
+          TEST_AND_RETURN_FALSE(PuffInto<BufferColumnarPuffWriter>(
+              *puffer_, &bit_reader, bytes + bytes_read, cur_puff_->length));
+        } else {
+          TEST_AND_RETURN_FALSE(PuffInto<BufferPuffWriter>(
+              *puffer_, &bit_reader, bytes + bytes_read, cur_puff_->length));
+        }
         TEST_AND_RETURN_FALSE(bytes_to_read == bit_reader.Offset());
-        TEST_AND_RETURN_FALSE(cur_puff_->length == puff_writer.Size());
       } else {
-        // Just seek to proper location.
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte + bytes_to_read));
-      }
-      // Copy from puff buffer to output if needed.
-      auto bytes_to_copy =
-          std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
-      if (!puff_directly_into_buffer) {
+        if (max_cache_size_ == 0) {
+          if (partial_puff_id_ != cur_puff_idx) {
+            TEST_AND_RETURN_FALSE(StartPartialPuff(cur_puff_idx));
+          }
+        } else {
+          AccessPuff(cur_puff_idx);
+          auto found =
+              GetPuffCache(cur_puff_idx, cur_puff_->length, &puff_buffer_);
+          if (read_ahead_) {
+            ReadAhead(cur_puff_idx);
+          }
+          // Did not find the puff buffer in cache. We have to build it, unless
+          // it is the partial puff in |uncached_puff_buffer_|.
+          if (!found && partial_puff_id_ != cur_puff_idx) {
+            TEST_AND_RETURN_FALSE(StartPartialPuff(cur_puff_idx));
+            // A cached puff that is read again later is puffed completely, so
+            // the later reads find it whole in the cache instead of puffing it
+            // again after it has been dropped as an incomplete partial puff.
+            if (!puff_accesses_.empty() &&
+                puff_buffer_ != uncached_puff_buffer_ &&
+                NextPuffAccess(cur_puff_idx) != kNoPuffAccess) {
+              TEST_AND_RETURN_FALSE(ContinuePartialPuff(cur_puff_->length));
+            }
+          }
+        }
+
+        if (partial_puff_id_ == cur_puff_idx) {
+          // Only puff as much as this read needs.
+          TEST_AND_RETURN_FALSE(
+              ContinuePartialPuff(skip_bytes_ + bytes_to_copy));
+        } else {
+          // Just seek to proper location.
+          TEST_AND_RETURN_FALSE(stream_->Seek(start_byte + bytes_to_read));
+        }
+        // Copy from puff buffer to output.
         memcpy(bytes + bytes_read, puff_buffer_->data() + skip_bytes_,
                bytes_to_copy);
       }
@@ -357,7 +503,12 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
       auto copy_len =
           std::min((cur_deflate_->offset / 8) - (deflate_bit_pos_ / 8),
                    length - bytes_wrote);
-      TEST_AND_RETURN_FALSE(stream_->Write(bytes + bytes_wrote, copy_len));
+      if (huff_write_behind_) {
+        TEST_AND_RETURN_FALSE(
+            huff_write_behind_->Write(bytes + bytes_wrote, copy_len));
+      } else {
+        TEST_AND_RETURN_FALSE(stream_->Write(bytes + bytes_wrote, copy_len));
+      }
       bytes_wrote += copy_len;
       puff_pos_ += copy_len;
       deflate_bit_pos_ += copy_len * 8;
@@ -380,48 +531,92 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
 
       auto copy_len = std::min(length - bytes_wrote,
                                cur_puff_->length + extra_byte_ - skip_bytes_);
-      TEST_AND_RETURN_FALSE(puff_buffer_->size() >= skip_bytes_ + copy_len);
-      memcpy(puff_buffer_->data() + skip_bytes_, bytes + bytes_wrote, copy_len);
+      if (huff_write_behind_) {
+        if (skip_bytes_ == 0) {
+          huff_puff_.reset(new Buffer(cur_puff_->length + extra_byte_));
+        }
+        memcpy(huff_puff_->data() + skip_bytes_, bytes + bytes_wrote, copy_len);
+      } else if (puff_format_ == PuffFormat::kColumnar) {
+        TEST_AND_RETURN_FALSE(puff_buffer_->size() >= skip_bytes_ + copy_len);
+        memcpy(puff_buffer_->data() + skip_bytes_, bytes + bytes_wrote,
+               copy_len);
+      } else {
+        if (skip_bytes_ == 0) {
+          StartHuffPuff();
+        }
+        // The extra byte, if it is in this write, is not a part of the puff.
+        uint64_t puff_len = 0;
+        if (skip_bytes_ < cur_puff_->length) {
+          puff_len = std::min(copy_len, cur_puff_->length - skip_bytes_);
+        }
+        TEST_AND_RETURN_FALSE(HuffPuffBytes(bytes + bytes_wrote, puff_len));
+        if (copy_len > puff_len) {
+          extra_puff_byte_ = bytes[bytes_wrote + puff_len];
+        }
+      }
       skip_bytes_ += copy_len;
       bytes_wrote += copy_len;
 
       if (skip_bytes_ == cur_puff_->length + extra_byte_) {
-        // |puff_buffer_| is full, now huff into the |deflate_buffer_|.
-        auto start_byte = cur_deflate_->offset / 8;
-        auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
-        auto bytes_to_write = end_byte - start_byte;
-
-        deflate_buffer_->resize(bytes_to_write);
-        BufferBitWriter bit_writer(deflate_buffer_->data(), bytes_to_write);
-        BufferPuffReader puff_reader(puff_buffer_->data(), cur_puff_->length);
-
-        // Write last byte if it has any.
-        TEST_AND_RETURN_FALSE(
-            bit_writer.WriteBits(cur_deflate_->offset & 7, last_byte_));
-        last_byte_ = 0;
-
-        TEST_AND_RETURN_FALSE(huffer_->HuffDeflate(&puff_reader, &bit_writer));
-        TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
-        TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
-
-        deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
-        if (extra_byte_ == 1) {
-          deflate_buffer_->data()[bytes_to_write - 1] |=
-              puff_buffer_->data()[cur_puff_->length] << (deflate_bit_pos_ & 7);
-          deflate_bit_pos_ = (deflate_bit_pos_ + 7) & ~7ull;
-        } else if ((deflate_bit_pos_ & 7) != 0) {
-          // This happens if current and next deflate finish and end on the same
-          // byte, then we cannot write into output until we have huffed the
-          // next puff buffer, so untill then we cache it into |last_byte_| and
-          // we won't write it out.
-          last_byte_ = deflate_buffer_->data()[bytes_to_write - 1];
-          bytes_to_write--;
+        if (huff_write_behind_) {
+          // |huff_puff_| is full, hand it over with the bits before the deflate
+          // that are not in the last deflate.
+          TEST_AND_RETURN_FALSE(huff_write_behind_->Huff(
+              std::move(huff_puff_), cur_puff_->length, *cur_deflate_,
+              last_byte_, extra_byte_ == 1));
+          last_byte_ = 0;
+          deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
+          if (extra_byte_ == 1) {
+            deflate_bit_pos_ = (deflate_bit_pos_ + 7) & ~7ull;
+          }
+        } else {
+          size_t bytes_to_write;
+          uint8_t extra_puff_byte;
+          if (puff_format_ == PuffFormat::kColumnar) {
+            // |puff_buffer_| is full, now huff into the |deflate_buffer_|.
+            auto start_byte = cur_deflate_->offset / 8;
+            auto end_byte =
+                (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+            bytes_to_write = end_byte - start_byte;
+
+            deflate_buffer_->resize(bytes_to_write);
+            BufferBitWriter bit_writer(deflate_buffer_->data(), bytes_to_write);
+
+            // Write last byte if it has any.
+            TEST_AND_RETURN_FALSE(
+                bit_writer.WriteBits(cur_deflate_->offset & 7, last_byte_));
+
+            TEST_AND_RETURN_FALSE(HuffFrom<BufferColumnarPuffReader>(
+                *huffer_, puff_buffer_->data(), cur_puff_->length,
+                &bit_writer));
+            TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
+            extra_puff_byte = puff_buffer_->data()[cur_puff_->length];
+          } else {
+            // The rest of the deflate has already been written.
+            TEST_AND_RETURN_FALSE(FinishHuffPuff(&bytes_to_write));
+            extra_puff_byte = extra_puff_byte_;
+          }
+          last_byte_ = 0;
+
+          deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
+          if (extra_byte_ == 1) {
+            deflate_buffer_->data()[bytes_to_write - 1] |=
+                extra_puff_byte << (deflate_bit_pos_ & 7);
+            deflate_bit_pos_ = (deflate_bit_pos_ + 7) & ~7ull;
+          } else if ((deflate_bit_pos_ & 7) != 0) {
+            // This happens if current and next deflate finish and end on the
+            // same byte, then we cannot write into output until we have huffed
+            // the next puff buffer, so untill then we cache it into
+            // |last_byte_| and we won't write it out.
+            last_byte_ = deflate_buffer_->data()[bytes_to_write - 1];
+            bytes_to_write--;
+          }
+
+          // Write |deflate_buffer_| into output.
+          TEST_AND_RETURN_FALSE(
+              stream_->Write(deflate_buffer_->data(), bytes_to_write));
         }
 
-        // Write |deflate_buffer_| into output.
-        TEST_AND_RETURN_FALSE(
-            stream_->Write(deflate_buffer_->data(), bytes_to_write));
-
         // Move to the next deflate/puff.
         puff_pos_ += skip_bytes_;
         skip_bytes_ = 0;
@@ -437,6 +632,86 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
   }
 
   TEST_AND_RETURN_FALSE(bytes_wrote == length);
+  if (huff_write_behind_ && puff_pos_ + skip_bytes_ == puff_stream_size_) {
+    // The whole stream is written, so the last puffs have to be written out
+    // before returning.
+    TEST_AND_RETURN_FALSE(huff_write_behind_->Flush());
+  }
+  return true;
+}
+
+void PuffinStream::StartHuffPuff() {
+  huff_state_.Reset();
+  pending_puff_size_ = 0;
+  // The deflate starts with the bits of the byte it shares with the data
+  // before it.
+  huff_nbits_ = cur_deflate_->offset & 7;
+  huff_bits_ = last_byte_ & ((1 << huff_nbits_) - 1);
+  deflate_bytes_written_ = 0;
+}
+
+bool PuffinStream::HuffPuffBytes(const uint8_t* data, size_t size) {
+  auto capacity = puff_buffer_->size();
+  while (size > 0) {
+    if (pending_puff_size_ == 0) {
+      // Huff straight from the input and only keep the incomplete records.
+      auto part_size = std::min(size, capacity);
+      BufferPuffReader scanner(data, part_size, huff_state_.InBlock());
+      auto whole_size = scanner.WholeRecordsSize();
+      TEST_AND_RETURN_FALSE(HuffPuffPart(data, whole_size));
+      pending_puff_size_ = part_size - whole_size;
+      memcpy(puff_buffer_->data(), data + whole_size, pending_puff_size_);
+      data += part_size;
+      size -= part_size;
+    } else {
+      // Complete the pending records first.
+      auto copy_len = std::min(size, capacity - pending_puff_size_);
+      memcpy(puff_buffer_->data() + pending_puff_size_, data, copy_len);
+      pending_puff_size_ += copy_len;
+      data += copy_len;
+      size -= copy_len;
+      BufferPuffReader scanner(puff_buffer_->data(), pending_puff_size_,
+                               huff_state_.InBlock());
+      auto whole_size = scanner.WholeRecordsSize();
+      TEST_AND_RETURN_FALSE(HuffPuffPart(puff_buffer_->data(), whole_size));
+      pending_puff_size_ -= whole_size;
+      memmove(puff_buffer_->data(), puff_buffer_->data() + whole_size,
+              pending_puff_size_);
+    }
+    // The buffer holds any group of whole records, so a full buffer means the
+    // puff is not valid.
+    TEST_AND_RETURN_FALSE(pending_puff_size_ < capacity);
+  }
+  return true;
+}
+
+bool PuffinStream::HuffPuffPart(const uint8_t* part, size_t size) {
+  if (size == 0) {
+    return true;
+  }
+  BufferPuffReader puff_reader(part, size, huff_state_.InBlock());
+  BufferBitWriter bit_writer(deflate_buffer_->data(), deflate_buffer_->size());
+  TEST_AND_RETURN_FALSE(bit_writer.WriteBits(huff_nbits_, huff_bits_));
+  TEST_AND_RETURN_FALSE(HufferInternal::HuffDeflatePart(
+      *huffer_, &puff_reader, &bit_writer, &huff_state_));
+  TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+  bit_writer.TakeRemainingBits(&huff_bits_, &huff_nbits_);
+  TEST_AND_RETURN_FALSE(
+      stream_->Write(deflate_buffer_->data(), bit_writer.Size()));
+  deflate_bytes_written_ += bit_writer.Size();
+  return true;
+}
+
+bool PuffinStream::FinishHuffPuff(size_t* bytes_to_write) {
+  TEST_AND_RETURN_FALSE(pending_puff_size_ == 0 && !huff_state_.InBlock());
+  *bytes_to_write = 0;
+  if (huff_nbits_ > 0) {
+    deflate_buffer_->data()[(*bytes_to_write)++] = huff_bits_;
+  }
+  auto start_byte = cur_deflate_->offset / 8;
+  auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+  TEST_AND_RETURN_FALSE(deflate_bytes_written_ + *bytes_to_write ==
+                        end_byte - start_byte);
   return true;
 }
 
@@ -455,54 +730,281 @@ bool PuffinStream::SetExtraByte() {
   return true;
 }
 
+bool PuffinStream::StartPartialPuff(int puff_id) {
+  ResetPartialPuff();
+  partial_puff_id_ = -1;
+  auto start_byte = cur_deflate_->offset / 8;
+  auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+  auto bytes_to_read = end_byte - start_byte;
+  partial_bit_reader_.reset(
+      new StreamBitReader(stream_.get(), start_byte, bytes_to_read));
+
+  // Drop the first unused bits.
+  size_t extra_bits_len = cur_deflate_->offset & 7;
+  TEST_AND_RETURN_FALSE(partial_bit_reader_->CacheBits(extra_bits_len));
+  partial_bit_reader_->DropBits(extra_bits_len);
+
+  if (puff_format_ == PuffFormat::kColumnar) {
+    // The sections of a columnar puff are only written at the end, so it is
+    // puffed at once.
+    TEST_AND_RETURN_FALSE(PuffInto<BufferColumnarPuffWriter>(
+        *puffer_, partial_bit_reader_.get(), puff_buffer_->data(),
+        cur_puff_->length));
+    TEST_AND_RETURN_FALSE(bytes_to_read == partial_bit_reader_->Offset());
+    partial_bit_reader_.reset();
+    partial_puff_size_ = cur_puff_->length;
+  } else {
+    partial_puff_writer_.reset(
+        new BufferPuffWriter(puff_buffer_->data(), cur_puff_->length));
+    partial_puff_state_.Reset();
+    partial_puff_size_ = 0;
+  }
+  partial_puff_id_ = puff_id;
+  return true;
+}
+
+bool PuffinStream::ContinuePartialPuff(uint64_t puff_size) {
+  if (partial_puff_size_ >= puff_size) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(partial_puff_writer_ &&
+                        !partial_puff_state_.Done());
+  TEST_AND_RETURN_FALSE(PufferInternal::PuffDeflateUntil(
+      *puffer_, partial_bit_reader_.get(), partial_puff_writer_.get(),
+      puff_size, &partial_puff_state_));
+  partial_puff_size_ = partial_puff_writer_->Size();
+  if (partial_puff_state_.Done()) {
+    TEST_AND_RETURN_FALSE(partial_puff_size_ == cur_puff_->length);
+    auto start_byte = cur_deflate_->offset / 8;
+    auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+    TEST_AND_RETURN_FALSE(end_byte - start_byte ==
+                          partial_bit_reader_->Offset());
+    partial_bit_reader_.reset();
+    partial_puff_writer_.reset();
+  }
+  TEST_AND_RETURN_FALSE(partial_puff_size_ >= puff_size);
+  return true;
+}
+
+void PuffinStream::ResetPartialPuff() {
+  if (partial_puff_id_ >= 0 &&
+      partial_puff_size_ < puffs_[partial_puff_id_].length) {
+    // The rest of it cannot be puffed anymore.
+    RemovePuffCache(partial_puff_id_);
+    partial_puff_id_ = -1;
+  }
+  partial_bit_reader_.reset();
+  partial_puff_writer_.reset();
+}
+
+void PuffinStream::RemovePuffCache(int puff_id) {
+  auto index_iter = cache_index_.find(puff_id);
+  if (index_iter != cache_index_.end()) {
+    EvictPuffCache(index_iter->second);
+  }
+}
+
+void PuffinStream::InsertPuffCache(int puff_id, SharedBufferPtr cache) {
+  cur_cache_size_ += cache->capacity();
+  caches_.emplace_front(puff_id, std::move(cache));
+  cache_index_[puff_id] = caches_.begin();
+  if (!puff_accesses_.empty()) {
+    cached_puff_accesses_.emplace(NextPuffAccess(puff_id), puff_id);
+  }
+}
+
+SharedBufferPtr PuffinStream::EvictPuffCache(CacheList::iterator iter) {
+  if (!puff_accesses_.empty()) {
+    cached_puff_accesses_.erase({NextPuffAccess(iter->first), iter->first});
+  }
+  auto cache = std::move(iter->second);
+  cur_cache_size_ -= cache->capacity();
+  cache_index_.erase(iter->first);
+  caches_.erase(iter);
+  return cache;
+}
+
 bool PuffinStream::GetPuffCache(int puff_id,
                                 uint64_t puff_size,
                                 SharedBufferPtr* buffer) {
-  bool found = false;
-  // Search for it.
-  std::pair<int, SharedBufferPtr> cache;
-  // TODO(*): Find a faster way of doing this? Maybe change the data structure
-  // that supports faster search.
-  for (auto iter = caches_.begin(); iter != caches_.end(); ++iter) {
-    if (iter->first == puff_id) {
-      cache = std::move(*iter);
-      found = true;
-      // Remove it so later we can add it to the begining of the list.
-      caches_.erase(iter);
-      break;
-    }
+  auto index_iter = cache_index_.find(puff_id);
+  if (index_iter != cache_index_.end()) {
+    // Move it to the front of the list so it becomes the most recently used
+    // one.
+    caches_.splice(caches_.begin(), caches_, index_iter->second);
+    *buffer = caches_.front().second;
+    return true;
   }
 
-  // If not found, either create one or get one from the list.
-  if (!found) {
-    // If |caches_| were full, remove last ones in the list (least used), until
-    // we have enough space for the new cache.
-    while (!caches_.empty() && cur_cache_size_ + puff_size > max_cache_size_) {
-      cache = std::move(caches_.back());
-      caches_.pop_back();  // Remove it from the list.
-      cur_cache_size_ -= cache.second->capacity();
+  // The puffs that are puffed ahead take up part of the cache.
+  uint64_t read_ahead_size = 0;
+  if (read_ahead_) {
+    SharedBufferPtr cache;
+    if (read_ahead_->Take(puff_id, &cache)) {
+      *buffer = cache;
+      InsertPuffCache(puff_id, std::move(cache));
+      return true;
     }
-    // If we have not populated the cache yet, create one.
-    if (!cache.second) {
-      cache.second.reset(new Buffer(puff_size));
+    read_ahead_size = read_ahead_->Size();
+  }
+
+  if (!puff_accesses_.empty()) {
+    // A puff that is needed later than all the cached ones is not worth
+    // evicting any of them for. The partial puff that is not in the cache is
+    // in |uncached_puff_buffer_| too.
+    if (partial_puff_id_ == puff_id ||
+        (cur_cache_size_ + read_ahead_size + puff_size > max_cache_size_ &&
+         !cached_puff_accesses_.empty() &&
+         NextPuffAccess(puff_id) >= cached_puff_accesses_.rbegin()->first)) {
+      uncached_puff_buffer_->resize(puff_size);
+      *buffer = uncached_puff_buffer_;
+      return false;
     }
-    cache.second->resize(puff_size);
+  }
 
-    constexpr uint64_t kMaxSizeDifference = 20 * 1024;
-    if (puff_size + kMaxSizeDifference < cache.second->capacity()) {
-      cache.second->shrink_to_fit();
+  // If not found, either create one or get one from the list. If |caches_|
+  // were full, remove the ones needed again the latest if the order of reads
+  // is known, or else the last ones in the list (least used), until we have
+  // enough space for the new cache.
+  SharedBufferPtr cache;
+  while (!caches_.empty() &&
+         cur_cache_size_ + read_ahead_size + puff_size > max_cache_size_) {
+    auto iter = std::prev(caches_.end());
+    if (!puff_accesses_.empty()) {
+      iter = cache_index_[cached_puff_accesses_.rbegin()->second];
     }
+    cache = EvictPuffCache(iter);
+  }
+  // If we have not populated the cache yet, create one.
+  if (!cache) {
+    cache.reset(new Buffer(puff_size));
+  }
+  cache->resize(puff_size);
+
+  constexpr uint64_t kMaxSizeDifference = 20 * 1024;
+  if (puff_size + kMaxSizeDifference < cache->capacity()) {
+    cache->shrink_to_fit();
+  }
+
+  *buffer = cache;
+  InsertPuffCache(puff_id, std::move(cache));
+  return false;
+}
+
+void PuffinStream::AccessPuff(int puff_id) {
+  // Empty puffs are not in the order of reads.
+  if (puff_accesses_.empty() || puff_id == last_accessed_puff_ ||
+      puffs_[puff_id].length == 0) {
+    return;
+  }
+  last_accessed_puff_ = puff_id;
+  bool cached = cache_index_.find(puff_id) != cache_index_.end();
+  if (cached) {
+    cached_puff_accesses_.erase({NextPuffAccess(puff_id), puff_id});
+  }
+  // Reads of this puff that should have been done before the current position
+  // are skipped, so a read that was not in the order does not move the
+  // position back.
+  const auto& accesses = puff_accesses_[puff_id];
+  auto& next = next_puff_accesses_[puff_id];
+  while (next < accesses.size() && accesses[next] < puff_access_pos_) {
+    next++;
+  }
+  if (next < accesses.size()) {
+    puff_access_pos_ = accesses[next++] + 1;
+  }
+  if (cached) {
+    cached_puff_accesses_.emplace(NextPuffAccess(puff_id), puff_id);
+  }
+}
+
+uint64_t PuffinStream::NextPuffAccess(int puff_id) const {
+  const auto& accesses = puff_accesses_[puff_id];
+  auto next = next_puff_accesses_[puff_id];
+  return next < accesses.size() ? accesses[next] : kNoPuffAccess;
+}
+
+void PuffinStream::ReadAhead(int puff_id) {
+  if (puff_id == read_ahead_puff_) {
+    return;
+  }
+  bool sequential = puff_id == read_ahead_puff_ + 1;
+  read_ahead_puff_ = puff_id;
+
+  // The puffs that are still waiting are scheduled again below if they are
+  // still needed next.
+  read_ahead_->Schedule({});
+  vector<std::pair<int, SharedBufferPtr>> done;
+  read_ahead_->TakeDone(&done);
+  for (auto& puff : done) {
+    InsertPuffCache(puff.first, std::move(puff.second));
+  }
 
-    cur_cache_size_ += cache.second->capacity();
-    cache.first = puff_id;
+  // The next puffs and the positions of their reads in the order of reads, if
+  // it is known. Otherwise they are the ones after a puff read right after the
+  // one before it. The last puff in |puffs_| is the empty one at the end.
+  vector<std::pair<int, uint64_t>> next_puffs;
+  if (!puff_access_order_.empty()) {
+    for (auto pos = puff_access_pos_;
+         pos < puff_access_order_.size() &&
+         next_puffs.size() < read_ahead_count_;
+         pos++) {
+      auto next_puff_id = puff_access_order_[pos];
+      if (next_puff_id != puff_id &&
+          std::none_of(next_puffs.begin(), next_puffs.end(),
+                       [next_puff_id](const std::pair<int, uint64_t>& puff) {
+                         return puff.first == next_puff_id;
+                       })) {
+        next_puffs.emplace_back(next_puff_id, pos);
+      }
+    }
+  } else if (sequential) {
+    for (size_t next_puff_id = puff_id + 1;
+         next_puff_id + 1 < puffs_.size() &&
+         next_puffs.size() < read_ahead_count_;
+         next_puff_id++) {
+      next_puffs.emplace_back(next_puff_id, kNoPuffAccess);
+    }
   }
 
-  *buffer = cache.second;
-  // By now we have either removed a cache or created new one. Now we have to
-  // insert it in the front of the list so it becomes the most recently used
-  // one.
-  caches_.push_front(std::move(cache));
-  return found;
+  vector<int> puff_ids;
+  auto read_ahead_size = read_ahead_->Size();
+  for (const auto& next_puff : next_puffs) {
+    auto next_puff_id = next_puff.first;
+    auto length = puffs_[next_puff_id].length;
+    if (length == 0 || next_puff_id == partial_puff_id_ ||
+        cache_index_.find(next_puff_id) != cache_index_.end() ||
+        read_ahead_->Contains(next_puff_id)) {
+      continue;
+    }
+    if (read_ahead_size + length > max_read_ahead_size_) {
+      break;
+    }
+    // Evict the caches that are needed later than this puff if the order of
+    // reads is known, or else the least recently used ones. The puff being
+    // read and the partial puff are kept.
+    while (!caches_.empty() &&
+           cur_cache_size_ + read_ahead_size + length > max_cache_size_) {
+      auto iter = std::prev(caches_.end());
+      if (!puff_accesses_.empty()) {
+        const auto& last = *cached_puff_accesses_.rbegin();
+        if (last.first <= next_puff.second) {
+          break;
+        }
+        iter = cache_index_[last.second];
+      }
+      if (iter->first == puff_id || iter->first == partial_puff_id_) {
+        break;
+      }
+      EvictPuffCache(iter);
+    }
+    if (cur_cache_size_ + read_ahead_size + length > max_cache_size_) {
+      break;
+    }
+    puff_ids.push_back(next_puff_id);
+    read_ahead_size += length;
+  }
+  read_ahead_->Schedule(puff_ids);
 }
 
 }  // namespace puffin
@@ -7,17 +7,24 @@
 
 #include <list>
 #include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/huffer_internal.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/puffer_internal.h"
 #include "puffin/src/include/puffin/stream.h"
 
 namespace puffin {
 
+class HuffWriteBehind;
+class PuffReadAhead;
+
 // A class for puffing a deflate stream and huffing into a deflate stream. The
 // puff stream is "imaginary", which means it doesn't really exists; It is build
 // and used on demand. This class uses a given deflate stream, and puffs the
@@ -30,7 +37,7 @@ namespace puffin {
 // reading and writing at the same time.
 class PuffinStream : public StreamInterface {
  public:
-  ~PuffinStream() override = default;
+  ~PuffinStream() override;
 
   // Creates a |PuffinStream| for reading puff buffers from a deflate stream.
   // |stream|    IN  The deflate stream.
@@ -43,12 +50,27 @@ class PuffinStream : public StreamInterface {
   //                      If the mount is smaller than the maximum puff buffer
   //                      size in |puffs|, then its value will be set to zero
   //                      and no puff will be cached.
-  static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
-                                       std::shared_ptr<Puffer> puffer,
-                                       uint64_t puff_size,
-                                       const std::vector<BitExtent>& deflates,
-                                       const std::vector<ByteExtent>& puffs,
-                                       size_t max_cache_size = 0);
+  // |puff_format| IN  The layout of the puffs.
+  // |puff_accesses| IN  The indices into |puffs| of the puffs in the order they
+  //                     are going to be read, if it is known. A puff read more
+  //                     than once in a row is listed once. With it, the cache
+  //                     evicts the puff that is needed again the latest
+  //                     instead of the least recently used one.
+  // |num_threads| IN  The number of threads that puff the deflates ahead of
+  //                   the reads into the cache. They puff the next puffs in
+  //                   |puff_accesses|, or the ones after a puff that is read
+  //                   right after the one before it. Zero puffs every deflate
+  //                   when it is read.
+  static UniqueStreamPtr CreateForPuff(
+      UniqueStreamPtr stream,
+      std::shared_ptr<Puffer> puffer,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      size_t max_cache_size = 0,
+      PuffFormat puff_format = PuffFormat::kInterleaved,
+      const std::vector<int>& puff_accesses = std::vector<int>(),
+      size_t num_threads = 0);
 
   // Creates a |PuffinStream| for writing puff buffers into a deflate stream.
   // |stream|    IN  The deflate stream.
@@ -59,12 +81,19 @@ class PuffinStream : public StreamInterface {
   // |puffs|     IN  The location of puffs into the input puff stream.
   // |ignore_deflate_size| IN  Ignores integrity checking the size of the
   //                           |stream|.
-  static UniqueStreamPtr CreateForHuff(UniqueStreamPtr stream,
-                                       std::shared_ptr<Huffer> huffer,
-                                       uint64_t puff_size,
-                                       const std::vector<BitExtent>& deflates,
-                                       const std::vector<ByteExtent>& puffs,
-                                       bool ignore_deflate_size);
+  // |puff_format| IN  The layout of the puffs.
+  // |num_threads| IN  The number of threads that huff the puffs once they are
+  //                   written completely. Zero huffs every puff with |huffer|
+  //                   while it is written.
+  static UniqueStreamPtr CreateForHuff(
+      UniqueStreamPtr stream,
+      std::shared_ptr<Huffer> huffer,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      bool ignore_deflate_size,
+      PuffFormat puff_format = PuffFormat::kInterleaved,
+      size_t num_threads = 0);
 
   bool GetSize(uint64_t* size) const override;
 
@@ -81,9 +110,12 @@ class PuffinStream : public StreamInterface {
   // Reads the puff stream from |buffer|, huffs it and writes it into the
   // deflate stream |stream_|. The current assumption for write is that data is
   // wrote from beginning to end with no retraction or random change of offset.
-  // This function, writes non-puff data directly to |stream_| and caches the
-  // puff data into |puff_buffer_|. When |puff_buffer_| is full, it huffs it
-  // into |deflate_buffer_| and writes it to |stream_|.
+  // This function, writes non-puff data directly to |stream_|. Puffs in the
+  // interleaved layout are huffed as their records arrive (see
+  // |huff_state_|). Puffs in the columnar layout are cached into
+  // |puff_buffer_|, and when it is full, it huffs it into |deflate_buffer_| and
+  // writes it to |stream_|. With |huff_write_behind_|, all the puffs are cached
+  // into their own buffer and huffed on other threads instead.
   bool Write(const void* buffer, size_t length) override;
 
   bool Close() override;
@@ -96,17 +128,76 @@ class PuffinStream : public StreamInterface {
                uint64_t puff_size,
                const std::vector<BitExtent>& deflates,
                const std::vector<ByteExtent>& puffs,
-               size_t max_cache_size);
+               size_t max_cache_size,
+               PuffFormat puff_format,
+               const std::vector<int>& puff_accesses,
+               size_t num_threads);
 
  private:
+  using CacheList = std::list<std::pair<int, SharedBufferPtr>>;
+
   // See |extra_byte_|.
   bool SetExtraByte();
 
+  // Starts puffing the current puff into |puff_buffer_| in steps. See
+  // |partial_puff_id_|.
+  bool StartPartialPuff(int puff_id);
+
+  // Continues puffing the current puff until at least its first |puff_size|
+  // bytes are in |puff_buffer_|.
+  bool ContinuePartialPuff(uint64_t puff_size);
+
+  // Stops puffing the partial puff. If it is not complete it is dropped, and
+  // removed from the caches.
+  void ResetPartialPuff();
+
+  // Prepares for huffing the current puff in parts. See |huff_state_|.
+  void StartHuffPuff();
+
+  // Huffs the next |size| bytes of the current puff as far as they hold whole
+  // records and keeps the rest in |puff_buffer_| for the next write.
+  bool HuffPuffBytes(const uint8_t* data, size_t size);
+
+  // Huffs the |size| bytes of whole records in |part| and writes the whole
+  // bytes of the deflate into |stream_|.
+  bool HuffPuffPart(const uint8_t* part, size_t size);
+
+  // Puts the last byte of the current deflate, if it has one that is not
+  // written yet, into |deflate_buffer_| once its puff is complete.
+  //
+  // |bytes_to_write| OUT  The number of bytes put into |deflate_buffer_|.
+  bool FinishHuffPuff(size_t* bytes_to_write);
+
+  // Removes the cache of the |puff_id|th puff, if there is one.
+  void RemovePuffCache(int puff_id);
+
+  // Puts |cache| into the caches as the |puff_id|th puff.
+  void InsertPuffCache(int puff_id, SharedBufferPtr cache);
+
+  // Removes the cache |iter| points to and returns its buffer.
+  SharedBufferPtr EvictPuffCache(CacheList::iterator iter);
+
   // Returns the cache for the |puff_id|th puff. If it does not find it, either
-  // returns the least accessed cached (if cache is full) or creates a new empty
-  // buffer. It returns false if it cannot find the |puff_id|th puff cache.
+  // returns the buffer of the cache it evicts (if cache is full) or creates a
+  // new empty buffer. It returns false if it cannot find the |puff_id|th puff
+  // cache. When the order of the reads is known, it returns
+  // |uncached_puff_buffer_| instead of evicting puffs that are needed sooner
+  // than the |puff_id|th one.
   bool GetPuffCache(int puff_id, uint64_t puff_size, SharedBufferPtr* buffer);
 
+  // Moves past the read of the |puff_id|th puff in |puff_accesses_|, if it is
+  // not the puff read last.
+  void AccessPuff(int puff_id);
+
+  // Returns the position in the order of reads of the next read of the
+  // |puff_id|th puff, or |kNoPuffAccess| if it is not read again.
+  uint64_t NextPuffAccess(int puff_id) const;
+
+  // Moves the puffs |read_ahead_| has puffed into the caches, and schedules the
+  // puffs that are read next after the |puff_id|th one. It evicts caches for
+  // them as long as the evicted ones are not read before them.
+  void ReadAhead(int puff_id);
+
   UniqueStreamPtr stream_;
 
   std::shared_ptr<Puffer> puffer_;
@@ -152,17 +243,84 @@ class PuffinStream : public StreamInterface {
   // True if the |Close()| is called.
   bool closed_;
 
+  // Only used for huffing. Deflates are puffed through a |StreamBitReader|.
   UniqueBufferPtr deflate_buffer_;
   SharedBufferPtr puff_buffer_;
 
-  // The list of puff buffer caches.
-  std::list<std::pair<int, SharedBufferPtr>> caches_;
+  // The list of puff buffer caches, from the most to the least recently used,
+  // and the index of its entries by puff id. Entries are moved to the front
+  // with |splice|, which keeps the iterators in |cache_index_| valid.
+  CacheList caches_;
+  std::unordered_map<int, CacheList::iterator> cache_index_;
+
+  // The positions at which each puff is read in the order of reads given to
+  // |CreateForPuff|, if any. The reads before |next_puff_accesses_| of each
+  // puff are done, and |puff_access_pos_| is the position after the last read
+  // done. The cached puffs are also kept in |cached_puff_accesses_| by the
+  // position of their next read, so the one needed the latest is evicted
+  // first. A puff that would be needed later than all the cached ones is
+  // puffed into |uncached_puff_buffer_| instead.
+  std::vector<int> puff_access_order_;
+  std::vector<std::vector<uint64_t>> puff_accesses_;
+  std::vector<size_t> next_puff_accesses_;
+  uint64_t puff_access_pos_;
+  int last_accessed_puff_;
+  std::set<std::pair<uint64_t, int>> cached_puff_accesses_;
+  SharedBufferPtr uncached_puff_buffer_;
+
   // The maximum memory (in bytes) kept for caching puff buffers by an object of
   // this class.
   size_t max_cache_size_;
   // The current amount of memory (in bytes) used for caching puff buffers.
   uint64_t cur_cache_size_;
 
+  // The layout of the puffs.
+  PuffFormat puff_format_;
+
+  // Reads that need only a part of a puff, only puff its deflate as far as
+  // needed. The |partial_puff_id_|th puff (or -1 if none) is being puffed this
+  // way into |puff_buffer_|, and its first |partial_puff_size_| bytes are
+  // ready. The state of the decoding is kept until the puff is complete, so a
+  // later read of the same puff continues from where the last one stopped.
+  int partial_puff_id_;
+  uint64_t partial_puff_size_;
+  std::unique_ptr<StreamBitReader> partial_bit_reader_;
+  std::unique_ptr<BufferPuffWriter> partial_puff_writer_;
+  PuffDeflateState partial_puff_state_;
+
+  // A puff in the interleaved layout is huffed while it is being written, as
+  // soon as its records are whole, so only the first |pending_puff_size_|
+  // bytes of |puff_buffer_| (less than |kMaxWholeRecordsSize|) are kept between
+  // writes. The bits of the last deflate byte that are not complete yet are in
+  // |huff_bits_| and |huff_nbits_|, and |deflate_bytes_written_| bytes of the
+  // current deflate are in |stream_|. The extra byte of the puff (see
+  // |extra_byte_|) is kept in |extra_puff_byte_|. Puffs in the columnar layout
+  // are huffed when they are complete.
+  HuffDeflateState huff_state_;
+  size_t pending_puff_size_;
+  uint8_t huff_bits_;
+  size_t huff_nbits_;
+  uint64_t deflate_bytes_written_;
+  uint8_t extra_puff_byte_;
+
+  // Huffs the puffs on other threads if |num_threads| was given for huffing.
+  // The current puff is cached into |huff_puff_| until it is complete, and the
+  // data between puffs is written through |huff_write_behind_| too, so it is
+  // written into |stream_| in order.
+  std::unique_ptr<HuffWriteBehind> huff_write_behind_;
+  UniqueBufferPtr huff_puff_;
+
+  // Puffs the next deflates on other threads if |num_threads| was given. Then
+  // |stream_| is a |SharedStream|. The puffs it has scheduled, is puffing or
+  // has puffed take up to |max_read_ahead_size_| bytes of the cache, which
+  // leaves room for the largest puff. It schedules the next
+  // |read_ahead_count_| puffs when the reads move to a new puff.
+  std::unique_ptr<PuffReadAhead> read_ahead_;
+  uint64_t max_read_ahead_size_;
+  size_t read_ahead_count_;
+  // The puff the reads were at when the last puffs were scheduled.
+  int read_ahead_puff_;
+
   DISALLOW_COPY_AND_ASSIGN(PuffinStream);
 };
 
@@ -2,7 +2,10 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <zlib.h>
+
 #include <algorithm>
+#include <numeric>
 #include <string>
 #include <vector>
 
@@ -10,6 +13,8 @@
 
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/huffer_internal.h"
+#include "puffin/src/huffman_table.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
@@ -18,6 +23,7 @@
 #include "puffin/src/memory_stream.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
+#include "puffin/src/puffer_internal.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/sample_generator.h"
 #include "puffin/src/unittest_common.h"
@@ -57,7 +63,7 @@ class PuffinTest : public ::testing::Test {
           start++;
 
         case PuffData::Type::kLiterals:
-          pd.read_fn(start, pd.length);
+          memcpy(start, pd.literals, pd.length);
           start += pd.length;
           break;
 
@@ -92,10 +98,21 @@ class PuffinTest : public ::testing::Test {
     BufferBitReader bit_reader(comp_buf, comp_size);
     BufferPuffWriter puff_writer(puff_buf, puff_size);
 
-    TEST_AND_RETURN_FALSE(
-        puffer_.PuffDeflate(&bit_reader, &puff_writer, nullptr));
+    TEST_AND_RETURN_FALSE(PufferInternal::PuffDeflate(puffer_, &bit_reader,
+                                                      &puff_writer, nullptr));
     TEST_AND_RETURN_FALSE(comp_size == bit_reader.Offset());
     TEST_AND_RETURN_FALSE(puff_size == puff_writer.Size());
+
+    // Decoding only for the sizes agrees with the puff writer.
+    BufferBitReader size_bit_reader(comp_buf, comp_size);
+    vector<BitExtent> subblocks;
+    vector<uint64_t> puff_sizes;
+    TEST_AND_RETURN_FALSE(PufferInternal::FindSubBlocksAndPuffSizes(
+        puffer_, &size_bit_reader, &subblocks, &puff_sizes));
+    TEST_AND_RETURN_FALSE(comp_size == size_bit_reader.Offset());
+    TEST_AND_RETURN_FALSE(
+        puff_size == std::accumulate(puff_sizes.begin(), puff_sizes.end(),
+                                     static_cast<uint64_t>(0)));
     return true;
   }
 
@@ -106,12 +123,28 @@ class PuffinTest : public ::testing::Test {
     BufferPuffReader puff_reader(puff_buf, puff_size);
     BufferBitWriter bit_writer(comp_buf, comp_size);
 
-    TEST_AND_RETURN_FALSE(huffer_.HuffDeflate(&puff_reader, &bit_writer));
+    TEST_AND_RETURN_FALSE(
+        HufferInternal::HuffDeflate(huffer_, &puff_reader, &bit_writer));
     TEST_AND_RETURN_FALSE(comp_size == bit_writer.Size());
     TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
     return true;
   }
 
+  // Puffs |deflate| with |puffer_| into |puff|, which is resized to the size of
+  // the puff found by puffing it once without a buffer.
+  void PuffDeflateToBuffer(const Buffer& deflate, Buffer* puff) {
+    BufferBitReader size_bit_reader(deflate.data(), deflate.size());
+    BufferPuffWriter puff_size_writer(nullptr, 0);
+    ASSERT_TRUE(PufferInternal::PuffDeflate(puffer_, &size_bit_reader,
+                                            &puff_size_writer, nullptr));
+    puff->resize(puff_size_writer.Size());
+    BufferBitReader bit_reader(deflate.data(), deflate.size());
+    BufferPuffWriter puff_writer(puff->data(), puff->size());
+    ASSERT_TRUE(PufferInternal::PuffDeflate(puffer_, &bit_reader, &puff_writer,
+                                            nullptr));
+    ASSERT_EQ(deflate.size(), bit_reader.Offset());
+  }
+
   // Puffs |compressed| into |out_puff| and checks its equality with
   // |expected_puff|.
   void TestPuffDeflate(const Buffer& compressed,
@@ -197,6 +230,12 @@ class PuffinTest : public ::testing::Test {
     EXPECT_EQ(puff_size, puff_buffer.size());
     EXPECT_EQ(out_puff_extents, puff_extents);
 
+    Buffer one_pass_puff_buffer;
+    ASSERT_TRUE(PuffDeflateStream(deflate_stream, deflate_extents,
+                                  &out_puff_extents, &one_pass_puff_buffer));
+    EXPECT_EQ(one_pass_puff_buffer, puff_buffer);
+    EXPECT_EQ(out_puff_extents, puff_extents);
+
     auto src_puffin_stream =
         PuffinStream::CreateForPuff(std::move(deflate_stream), puffer,
                                     puff_size, deflate_extents, puff_extents);
@@ -419,6 +458,306 @@ TEST_F(PuffinTest, DynamicHuffmanTableTest) {
   CheckSample(kDynamicHTRaw, kDynamicHTDeflate, kDynamicHTPuff);
 }
 
+// Tests a dynamic Huffman table with codes longer than the root of the decode
+// tables, so they have to be decoded through the subtables.
+TEST_F(PuffinTest, LongHuffmanCodesTest) {
+  // The frequency of each byte is half of the previous one, which results in
+  // code lengths of up to 15 bits.
+  Buffer original;
+  for (size_t idx = 0; idx < 17; idx++) {
+    original.insert(original.end(), 1 << (17 - idx), idx);
+  }
+  // Interleave them so the decoder jumps between short and long codes.
+  for (size_t idx = 0; idx < original.size(); idx += 7) {
+    std::swap(original[idx], original[(idx * 7919) % original.size()]);
+  }
+
+  Buffer compressed(original.size() * 2);
+  ASSERT_TRUE(sample_generator::CompressToDeflate(
+      original, &compressed, Z_DEFAULT_COMPRESSION, Z_HUFFMAN_ONLY));
+
+  Buffer puffed;
+  ASSERT_NO_FATAL_FAILURE(PuffDeflateToBuffer(compressed, &puffed));
+
+  CheckSample(original, compressed, puffed);
+}
+
+// Tests fixed Huffman blocks using all the literals and most of the lengths and
+// distances.
+TEST_F(PuffinTest, FixedHuffmanTableAllSymbolsTest) {
+  Buffer original;
+  for (size_t idx = 0; idx < 256; idx++) {
+    original.push_back(idx);
+  }
+  // Repeat growing prefixes of the data at growing distances.
+  for (size_t len = 3; len <= 258; len += 5) {
+    original.insert(original.end(), original.begin(), original.begin() + len);
+    for (size_t idx = 0; idx < len * 11; idx++) {
+      original.push_back((idx * 7919) >> 3);
+    }
+  }
+
+  Buffer compressed(original.size() * 2);
+  ASSERT_TRUE(sample_generator::CompressToDeflate(
+      original, &compressed, Z_BEST_COMPRESSION, Z_FIXED));
+
+  Buffer puffed;
+  ASSERT_NO_FATAL_FAILURE(PuffDeflateToBuffer(compressed, &puffed));
+
+  CheckSample(original, compressed, puffed);
+}
+
+// Tests the symbols and extra bits of all the lengths and distances.
+TEST_F(PuffinTest, LenDistSymbolsTest) {
+  for (size_t length = 3; length <= 258; length++) {
+    const auto& symbol = LengthSymbol(length);
+    ASSERT_LT(symbol.symbol, 29);
+    EXPECT_EQ(symbol.extra_bits_len, kLengthExtraBits[symbol.symbol]);
+    EXPECT_EQ(kLengthBases[symbol.symbol] + symbol.extra_bits_value, length);
+    EXPECT_LT(symbol.extra_bits_value, 1 << symbol.extra_bits_len);
+  }
+  for (size_t distance = 1; distance <= 32768; distance++) {
+    auto symbol = DistanceSymbol(distance);
+    ASSERT_LT(symbol.symbol, 30);
+    EXPECT_EQ(symbol.extra_bits_len, kDistanceExtraBits[symbol.symbol]);
+    EXPECT_EQ(kDistanceBases[symbol.symbol] + symbol.extra_bits_value,
+              distance);
+    EXPECT_LT(symbol.extra_bits_value, 1 << symbol.extra_bits_len);
+  }
+}
+
+// Tests that identical dynamic Huffman tables are reused from the cache.
+TEST_F(PuffinTest, DynamicHuffmanTableCacheTest) {
+  Buffer chunk(20000);
+  for (size_t idx = 0; idx < chunk.size(); idx++) {
+    chunk[idx] = "puffin huff"[(idx * idx) % 11];
+  }
+  // Compress the same chunk several times after resetting the compression
+  // state, so all of them produce the same dynamic Huffman table.
+  const size_t kNumChunks = 4;
+  Buffer compressed(chunk.size() * kNumChunks);
+  z_stream stream = {};
+  ASSERT_EQ(Z_OK, deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8,
+                               Z_DEFAULT_STRATEGY));
+  stream.next_out = compressed.data();
+  stream.avail_out = compressed.size();
+  for (size_t idx = 0; idx < kNumChunks; idx++) {
+    stream.next_in = chunk.data();
+    stream.avail_in = chunk.size();
+    ASSERT_EQ(Z_OK, deflate(&stream, Z_FULL_FLUSH));
+  }
+  ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  compressed.resize(stream.total_out);
+  ASSERT_EQ(Z_OK, deflateEnd(&stream));
+
+  // The table is only built for the first block.
+  BufferBitReader bit_reader(compressed.data(), compressed.size());
+  BufferPuffWriter puff_size_writer(nullptr, 0);
+  ASSERT_TRUE(PufferInternal::PuffDeflate(puffer_, &bit_reader,
+                                          &puff_size_writer, nullptr));
+  EXPECT_EQ(1, puffer_.DynamicTableCacheMisses());
+  EXPECT_EQ(kNumChunks - 1, puffer_.DynamicTableCacheHits());
+
+  // And not again when the deflate is puffed twice more into a buffer.
+  Buffer puffed;
+  ASSERT_NO_FATAL_FAILURE(PuffDeflateToBuffer(compressed, &puffed));
+  EXPECT_EQ(1, puffer_.DynamicTableCacheMisses());
+  EXPECT_EQ(kNumChunks * 3 - 1, puffer_.DynamicTableCacheHits());
+
+  Huffer huffer;
+  Buffer deflate_buffer(compressed.size());
+  BufferPuffReader puff_reader(puffed.data(), puffed.size());
+  BufferBitWriter bit_writer(deflate_buffer.data(), deflate_buffer.size());
+  ASSERT_TRUE(huffer.HuffDeflate(&puff_reader, &bit_writer));
+  EXPECT_EQ(compressed, deflate_buffer);
+  EXPECT_EQ(1, huffer.DynamicTableCacheMisses());
+  EXPECT_EQ(kNumChunks - 1, huffer.DynamicTableCacheHits());
+}
+
+// Creates a deflate stream with dynamic, uncompressed and fixed blocks.
+void CreateMixedBlocksDeflate(Buffer* compressed) {
+  Buffer chunk(50000);
+  for (size_t idx = 0; idx < chunk.size(); idx++) {
+    chunk[idx] = "puffin huff"[(idx * idx) % 11];
+  }
+  compressed->resize(chunk.size() * 4);
+  z_stream stream = {};
+  ASSERT_EQ(Z_OK, deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8,
+                               Z_DEFAULT_STRATEGY));
+  stream.next_out = compressed->data();
+  stream.avail_out = compressed->size();
+  const int kParams[][2] = {{Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY},
+                            {Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY},
+                            {Z_BEST_SPEED, Z_FIXED}};
+  for (const auto& params : kParams) {
+    ASSERT_EQ(Z_OK, deflateParams(&stream, params[0], params[1]));
+    stream.next_in = chunk.data();
+    stream.avail_in = chunk.size();
+    ASSERT_EQ(Z_OK, deflate(&stream, Z_FULL_FLUSH));
+  }
+  ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  compressed->resize(stream.total_out);
+  ASSERT_EQ(Z_OK, deflateEnd(&stream));
+}
+
+// Tests puffing a deflate stream in steps, stopping after every |step| bytes.
+TEST_F(PuffinTest, PuffDeflateUntilTest) {
+  Buffer compressed;
+  ASSERT_NO_FATAL_FAILURE(CreateMixedBlocksDeflate(&compressed));
+
+  Buffer puffed;
+  ASSERT_NO_FATAL_FAILURE(PuffDeflateToBuffer(compressed, &puffed));
+
+  for (size_t step : {1, 100, 5000, 70000}) {
+    Buffer puffed_in_steps(puffed.size());
+    BufferBitReader step_bit_reader(compressed.data(), compressed.size());
+    BufferPuffWriter step_puff_writer(puffed_in_steps.data(),
+                                      puffed_in_steps.size());
+    PuffDeflateState state;
+    size_t puff_size = 0;
+    size_t num_steps = 0;
+    while (!state.Done()) {
+      puff_size += step;
+      ASSERT_TRUE(PufferInternal::PuffDeflateUntil(
+          puffer_, &step_bit_reader, &step_puff_writer, puff_size, &state));
+      // The puff so far is already final.
+      size_t size = step_puff_writer.Size();
+      ASSERT_TRUE(size >= puff_size || state.Done());
+      ASSERT_TRUE(std::equal(puffed_in_steps.begin(),
+                             puffed_in_steps.begin() + size, puffed.begin()));
+      puff_size = size;
+      num_steps++;
+    }
+    EXPECT_EQ(puffed, puffed_in_steps);
+    EXPECT_EQ(compressed.size(), step_bit_reader.Offset());
+    EXPECT_FALSE(PufferInternal::PuffDeflateUntil(
+        puffer_, &step_bit_reader, &step_puff_writer, puff_size, &state));
+    if (step < puffed.size()) {
+      EXPECT_GT(num_steps, 1);
+    }
+  }
+}
+
+// Tests huffing a puff in parts of whole records, as they become available
+// every |step| bytes.
+TEST_F(PuffinTest, HuffDeflatePartTest) {
+  Buffer compressed;
+  ASSERT_NO_FATAL_FAILURE(CreateMixedBlocksDeflate(&compressed));
+
+  Buffer puffed;
+  ASSERT_NO_FATAL_FAILURE(PuffDeflateToBuffer(compressed, &puffed));
+
+  Huffer huffer;
+  for (size_t step : {1, 100, 5000, 70000}) {
+    Buffer deflate(compressed.size());
+    BufferBitWriter bit_writer(deflate.data(), deflate.size());
+    HuffDeflateState state;
+    size_t offset = 0;
+    size_t available = 0;
+    bool ended_in_block = false;
+    while (offset < puffed.size()) {
+      available = std::min(available + step, puffed.size());
+      BufferPuffReader scanner(&puffed[offset], available - offset,
+                               state.InBlock());
+      size_t part_size = scanner.WholeRecordsSize();
+      BufferPuffReader puff_reader(&puffed[offset], part_size, state.InBlock());
+      ASSERT_TRUE(HufferInternal::HuffDeflatePart(huffer, &puff_reader,
+                                                  &bit_writer, &state));
+      EXPECT_EQ(0, puff_reader.BytesLeft());
+      ended_in_block |= state.InBlock();
+      offset += part_size;
+    }
+    EXPECT_FALSE(state.InBlock());
+    ASSERT_TRUE(bit_writer.Flush());
+    EXPECT_EQ(compressed, deflate);
+    if (step <= 100) {
+      EXPECT_TRUE(ended_in_block);
+    }
+  }
+
+  // But a whole puff can not end in the middle of a block.
+  BufferPuffReader puff_reader(puffed.data(), puffed.size() - 2);
+  Buffer deflate(compressed.size());
+  BufferBitWriter bit_writer(deflate.data(), deflate.size());
+  EXPECT_FALSE(huffer.HuffDeflate(&puff_reader, &bit_writer));
+}
+
+// Expects the same counters, except for the time, in |stats1| and |stats2|.
+void ExpectEqualCounters(const DeflateStats& stats1,
+                         const DeflateStats& stats2) {
+  for (size_t type = 0; type < 3; type++) {
+    EXPECT_EQ(stats1.blocks[type], stats2.blocks[type]);
+  }
+  EXPECT_EQ(stats1.literals, stats2.literals);
+  EXPECT_EQ(stats1.len_dists, stats2.len_dists);
+  EXPECT_EQ(stats1.dynamic_table_builds, stats2.dynamic_table_builds);
+  // Huffing a whole puff pads the deflate to a whole byte.
+  EXPECT_EQ((stats1.deflate_bits + 7) / 8, (stats2.deflate_bits + 7) / 8);
+  EXPECT_EQ(stats1.puff_bytes, stats2.puff_bytes);
+}
+
+// Tests the stats collected by |Puffer| and |Huffer|.
+TEST_F(PuffinTest, StatsTest) {
+  Buffer compressed;
+  ASSERT_NO_FATAL_FAILURE(CreateMixedBlocksDeflate(&compressed));
+
+  Buffer puffed;
+  ASSERT_NO_FATAL_FAILURE(PuffDeflateToBuffer(compressed, &puffed));
+
+  Puffer puffer;
+  DeflateStats puff_stats;
+  puffer.SetStats(&puff_stats);
+  BufferBitReader bit_reader(compressed.data(), compressed.size());
+  BufferPuffWriter puff_writer(puffed.data(), puffed.size());
+  ASSERT_TRUE(PufferInternal::PuffDeflate(puffer, &bit_reader, &puff_writer,
+                                          nullptr));
+  for (size_t type = 0; type < 3; type++) {
+    EXPECT_GT(puff_stats.blocks[type], 0);
+  }
+  // The uncompressed block alone has 50000 literals.
+  EXPECT_GT(puff_stats.literals, 50000);
+  EXPECT_GT(puff_stats.len_dists, 0);
+  EXPECT_EQ(puff_stats.dynamic_table_builds, 1);
+  EXPECT_EQ((puff_stats.deflate_bits + 7) / 8, compressed.size());
+  EXPECT_EQ(puff_stats.puff_bytes, puffed.size());
+  EXPECT_GT(puff_stats.phase_nanoseconds[DeflateStats::kSymbolsPhase], 0);
+  EXPECT_FALSE(puff_stats.ToString().empty());
+
+  // Puffing in steps counts the same.
+  DeflateStats step_stats;
+  puffer.SetStats(&step_stats);
+  BufferBitReader step_bit_reader(compressed.data(), compressed.size());
+  BufferPuffWriter step_puff_writer(puffed.data(), puffed.size());
+  PuffDeflateState state;
+  for (size_t puff_size = 1000; !state.Done(); puff_size += 1000) {
+    ASSERT_TRUE(PufferInternal::PuffDeflateUntil(
+        puffer, &step_bit_reader, &step_puff_writer, puff_size, &state));
+  }
+  // The dynamic Huffman table is built again for the table of |state|.
+  EXPECT_EQ(step_stats.dynamic_table_builds, 1);
+  ExpectEqualCounters(puff_stats, step_stats);
+
+  // Huffing counts the same symbols.
+  Huffer huffer;
+  DeflateStats huff_stats;
+  huffer.SetStats(&huff_stats);
+  Buffer deflate(compressed.size());
+  BufferPuffReader puff_reader(puffed.data(), puffed.size());
+  BufferBitWriter bit_writer(deflate.data(), deflate.size());
+  ASSERT_TRUE(huffer.HuffDeflate(&puff_reader, &bit_writer));
+  EXPECT_EQ(compressed, deflate);
+  ExpectEqualCounters(puff_stats, huff_stats);
+
+  // Nothing is counted once the stats are detached.
+  puff_stats.Reset();
+  puffer.SetStats(nullptr);
+  BufferBitReader detached_bit_reader(compressed.data(), compressed.size());
+  BufferPuffWriter detached_puff_writer(puffed.data(), puffed.size());
+  ASSERT_TRUE(PufferInternal::PuffDeflate(puffer, &detached_bit_reader,
+                                          &detached_puff_writer, nullptr));
+  ExpectEqualCounters(DeflateStats(), puff_stats);
+}
+
 // Tests an uncompressed deflate block with invalid LEN/NLEN.
 TEST_F(PuffinTest, PuffInvalidUncompressedLengthDeflateTest) {
   const Buffer kDeflate = {0x01, 0x05, 0x00, 0xFF, 0xFF,
@@ -434,6 +773,29 @@ TEST_F(PuffinTest, PuffInvalidBlockHeaderDeflateTest) {
   FailPuffDeflate(kDeflate, &puffed);
 }
 
+// Tests puffing a fixed block whose last eight bits are only the beginning of
+// the nine bit code of literal 144, so they are less than the maximum code
+// length but not less than the length of the end of block code.
+TEST_F(PuffinTest, PuffTruncatedSymbolDeflateTest) {
+  const Buffer kDeflate = {0x9B, 0x30, 0x61, 0xC2, 0x84, 0x09, 0x13};
+  Buffer puffed;
+  FailPuffDeflate(kDeflate, &puffed);
+
+  // Puffing in steps returns at the end of the block, so it does not fail
+  // later on by chance.
+  BufferBitReader bit_reader(kDeflate.data(), kDeflate.size());
+  BufferPuffWriter puff_writer(nullptr, 0);
+  PuffDeflateState state;
+  EXPECT_FALSE(PufferInternal::PuffDeflateUntil(puffer_, &bit_reader,
+                                                &puff_writer, 1, &state));
+
+  BufferBitReader size_bit_reader(kDeflate.data(), kDeflate.size());
+  vector<BitExtent> subblocks;
+  vector<uint64_t> puff_sizes;
+  EXPECT_FALSE(PufferInternal::FindSubBlocksAndPuffSizes(
+      puffer_, &size_bit_reader, &subblocks, &puff_sizes));
+}
+
 // Tests puffing a block with final block bit unset so it returns false.
 TEST_F(PuffinTest, PuffDeflateNoFinalBlockBitTest) {
   const Buffer kDeflate = {0x62, 0x04, 0x00};
@@ -13,7 +13,9 @@
 #include <vector>
 
 #include "bsdiff/bspatch.h"
+#include "bsdiff/control_entry.h"
 #include "bsdiff/file_interface.h"
+#include "bsdiff/patch_reader.h"
 
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
@@ -53,7 +55,8 @@ bool DecodePatch(const uint8_t* patch,
                  vector<ByteExtent>* src_puffs,
                  vector<ByteExtent>* dst_puffs,
                  uint64_t* src_puff_size,
-                 uint64_t* dst_puff_size) {
+                 uint64_t* dst_puff_size,
+                 PuffFormat* puff_format) {
   size_t offset = 0;
   uint32_t header_size;
   TEST_AND_RETURN_FALSE(patch_length >= (kMagicLength + sizeof(header_size)));
@@ -75,6 +78,17 @@ bool DecodePatch(const uint8_t* patch,
   TEST_AND_RETURN_FALSE(header.ParseFromArray(patch + offset, header_size));
   offset += header_size;
 
+  // The version of the patch is the layout of its puffs.
+  switch (header.version()) {
+    case static_cast<int32_t>(PuffFormat::kInterleaved):
+    case static_cast<int32_t>(PuffFormat::kColumnar):
+      *puff_format = static_cast<PuffFormat>(header.version());
+      break;
+    default:
+      LOG(ERROR) << "Unsupported Puffin patch version: " << header.version();
+      return false;
+  }
+
   CopyRpfToVector(header.src().deflates(), src_deflates, 1);
   CopyRpfToVector(header.dst().deflates(), dst_deflates, 1);
   CopyRpfToVector(header.src().puffs(), src_puffs, 8);
@@ -88,6 +102,52 @@ bool DecodePatch(const uint8_t* patch,
   return true;
 }
 
+// Finds the order in which bspatch reads the puffs of the source from the
+// control entries of the bsdiff patch, so the cache of the source puffs can
+// keep the ones that are needed again the soonest. bspatch reads the
+// |diff_size| bytes of the source at the current position of each control
+// entry (only the bytes inside the source), and then moves the position by
+// |offset_increment|. A puff read more than once in a row is listed once, and
+// empty puffs are not listed.
+bool FindPuffAccesses(const uint8_t* bsdiff_patch,
+                      size_t bsdiff_patch_size,
+                      uint64_t src_puff_size,
+                      const vector<ByteExtent>& src_puffs,
+                      vector<int>* puff_accesses) {
+  bsdiff::BsdiffPatchReader patch_reader;
+  TEST_AND_RETURN_FALSE(patch_reader.Init(bsdiff_patch, bsdiff_patch_size));
+  puff_accesses->clear();
+  int64_t old_pos = 0;
+  uint64_t new_pos = 0;
+  while (new_pos < patch_reader.new_file_size()) {
+    bsdiff::ControlEntry control_entry(0, 0, 0);
+    TEST_AND_RETURN_FALSE(patch_reader.ParseControlEntry(&control_entry));
+    auto start = std::max<int64_t>(old_pos, 0);
+    auto end = std::min<int64_t>(old_pos + control_entry.diff_size,
+                                 src_puff_size);
+    if (start < end) {
+      // The first puff that ends after |start|.
+      auto puff = std::upper_bound(
+          src_puffs.begin(), src_puffs.end(), static_cast<uint64_t>(start),
+          [](uint64_t offset, const ByteExtent& extent) {
+            return offset < extent.offset + extent.length;
+          });
+      for (; puff != src_puffs.end() &&
+             puff->offset < static_cast<uint64_t>(end);
+           ++puff) {
+        int puff_id = std::distance(src_puffs.begin(), puff);
+        if (puff->length > 0 && (puff_accesses->empty() ||
+                                 puff_accesses->back() != puff_id)) {
+          puff_accesses->push_back(puff_id);
+        }
+      }
+    }
+    old_pos += control_entry.diff_size + control_entry.offset_increment;
+    new_pos += control_entry.diff_size + control_entry.extra_size;
+  }
+  return true;
+}
+
 class BsdiffStream : public bsdiff::FileInterface {
  public:
   ~BsdiffStream() override = default;
@@ -141,31 +201,42 @@ bool PuffPatch(UniqueStreamPtr src,
                UniqueStreamPtr dst,
                const uint8_t* patch,
                size_t patch_length,
-               size_t max_cache_size) {
-  size_t bsdiff_patch_offset;  // bsdiff offset in |patch|.
+               size_t max_cache_size,
+               size_t num_threads) {
+  size_t bsdiff_patch_offset = 0;  // bsdiff offset in |patch|.
   size_t bsdiff_patch_size = 0;
   vector<BitExtent> src_deflates, dst_deflates;
   vector<ByteExtent> src_puffs, dst_puffs;
-  uint64_t src_puff_size, dst_puff_size;
+  uint64_t src_puff_size = 0, dst_puff_size = 0;
+  PuffFormat puff_format = PuffFormat::kInterleaved;
 
   // Decode the patch and get the bsdiff_patch.
   TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &bsdiff_patch_offset,
                                     &bsdiff_patch_size, &src_deflates,
                                     &dst_deflates, &src_puffs, &dst_puffs,
-                                    &src_puff_size, &dst_puff_size));
+                                    &src_puff_size, &dst_puff_size,
+                                    &puff_format));
   auto puffer = std::make_shared<Puffer>();
   auto huffer = std::make_shared<Huffer>();
 
+  // The order of the reads of the source puffs is only needed for the cache.
+  vector<int> src_puff_accesses;
+  if (max_cache_size > 0) {
+    TEST_AND_RETURN_FALSE(FindPuffAccesses(
+        &patch[bsdiff_patch_offset], bsdiff_patch_size, src_puff_size,
+        src_puffs, &src_puff_accesses));
+  }
+
   // For reading from source.
-  auto reader = BsdiffStream::Create(
-      PuffinStream::CreateForPuff(std::move(src), puffer, src_puff_size,
-                                  src_deflates, src_puffs, max_cache_size));
+  auto reader = BsdiffStream::Create(PuffinStream::CreateForPuff(
+      std::move(src), puffer, src_puff_size, src_deflates, src_puffs,
+      max_cache_size, puff_format, src_puff_accesses, num_threads));
   TEST_AND_RETURN_FALSE(reader);
 
   // For writing into destination.
   auto writer = BsdiffStream::Create(PuffinStream::CreateForHuff(
       std::move(dst), huffer, dst_puff_size, dst_deflates, dst_puffs,
-      /*ignore_deflate_size=*/false));
+      /*ignore_deflate_size=*/false, puff_format, num_threads));
   TEST_AND_RETURN_FALSE(writer);
 
   // Running bspatch itself.
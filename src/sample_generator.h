@@ -13,6 +13,14 @@
 namespace puffin {
 namespace sample_generator {
 
+// Compresses |uncomp| into a raw deflate stream |comp| using zlib. |comp|
+// should be large enough to hold the result and is resized to the size of the
+// deflate stream.
+bool CompressToDeflate(const Buffer& uncomp,
+                       Buffer* comp,
+                       int compression,
+                       int strategy);
+
 void PrintArray(const std::string& name, const Buffer& array);
 
 // Creates and prints a sample for for adding to the list of unit tests for
@@ -0,0 +1,67 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/stats.h"
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+
+using std::string;
+using std::to_string;
+
+namespace puffin {
+
+namespace {
+// Returns |part| as a percentage of |total|.
+string Percentage(uint64_t part, uint64_t total) {
+  return to_string(total == 0 ? 0 : part * 100 / total) + "%";
+}
+}  // namespace
+
+DeflateStats::DeflateStats() {
+  Reset();
+}
+
+void DeflateStats::Reset() {
+  std::fill(std::begin(blocks), std::end(blocks), 0);
+  literals = 0;
+  len_dists = 0;
+  dynamic_table_builds = 0;
+  deflate_bits = 0;
+  puff_bytes = 0;
+  std::fill(std::begin(phase_nanoseconds), std::end(phase_nanoseconds), 0);
+}
+
+string DeflateStats::ToString() const {
+  uint64_t total_nanoseconds = 0;
+  for (auto nanoseconds : phase_nanoseconds) {
+    total_nanoseconds += nanoseconds;
+  }
+  auto symbols = literals + len_dists;
+  string str;
+  str += "blocks: " + to_string(blocks[0]) + " uncompressed, " +
+         to_string(blocks[1]) + " fixed, " + to_string(blocks[2]) +
+         " dynamic\n";
+  str += "symbols: " + to_string(literals) + " literals (" +
+         Percentage(literals, symbols) + "), " + to_string(len_dists) +
+         " lengths/distances (" + Percentage(len_dists, symbols) + ")\n";
+  str += "dynamic Huffman tables built: " + to_string(dynamic_table_builds) +
+         "\n";
+  str += "bytes: " + to_string((deflate_bits + 7) / 8) + " deflate, " +
+         to_string(puff_bytes) + " puff\n";
+  str += "time: " + to_string(phase_nanoseconds[kBlockHeaderPhase] / 1000) +
+         " us block headers (" +
+         Percentage(phase_nanoseconds[kBlockHeaderPhase], total_nanoseconds) +
+         "), " + to_string(phase_nanoseconds[kSymbolsPhase] / 1000) +
+         " us symbols (" +
+         Percentage(phase_nanoseconds[kSymbolsPhase], total_nanoseconds) +
+         "), " + to_string(phase_nanoseconds[kUncompressedPhase] / 1000) +
+         " us uncompressed (" +
+         Percentage(phase_nanoseconds[kUncompressedPhase], total_nanoseconds) +
+         ")\n";
+  return str;
+}
+
+}  // namespace puffin
@@ -2,7 +2,10 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <map>
 #include <numeric>
+#include <thread>
+#include <utility>
 
 #include "gtest/gtest.h"
 
@@ -10,7 +13,9 @@
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_read_ahead.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/unittest_common.h"
 
@@ -155,6 +160,39 @@ class StreamTest : public ::testing::Test {
   }
 
   void TestClose(StreamInterface* stream) { ASSERT_TRUE(stream->Close()); }
+
+  // Reads the |puff_ids|th puffs of |kPuffsSample1| from |stream|, which puffs
+  // |kDeflatesSample1|, in that order.
+  void TestReadPuffs(StreamInterface* stream, const vector<int>& puff_ids) {
+    for (auto puff_id : puff_ids) {
+      const auto& extent = kPuffExtentsSample1[puff_id];
+      Buffer buf(extent.length);
+      ASSERT_TRUE(stream->Seek(extent.offset));
+      ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+      ASSERT_EQ(buf, Buffer(kPuffsSample1.begin() + extent.offset,
+                            kPuffsSample1.begin() + extent.offset +
+                                extent.length));
+    }
+  }
+
+  // Reads the whole puff of |sample|, whose deflates are |deflates|, in
+  // |puff_format| from a |PuffinStream| into |puff_buf| and the location of
+  // its puffs into |puffs|.
+  void ReadSamplePuff(const Buffer& sample,
+                      const vector<BitExtent>& deflates,
+                      PuffFormat puff_format,
+                      vector<ByteExtent>* puffs,
+                      Buffer* puff_buf) {
+    uint64_t puff_size;
+    ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(sample),
+                                  deflates, puffs, &puff_size, puff_format));
+    auto read_stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(sample), std::make_shared<Puffer>(),
+        puff_size, deflates, *puffs, 0, puff_format);
+    puff_buf->resize(puff_size);
+    ASSERT_TRUE(read_stream->Read(puff_buf->data(), puff_buf->size()));
+    TestRead(read_stream.get(), *puff_buf);
+  }
 };
 
 TEST_F(StreamTest, MemoryStreamTest) {
@@ -214,6 +252,16 @@ TEST_F(StreamTest, PuffinStreamTest) {
   TestSeek(read_stream.get(), false);
   TestClose(read_stream.get());
 
+  // Test the stream with a cache for one puff at a time, so partially puffed
+  // puffs are evicted from it.
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1), puffer,
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      kPuffExtentsSample1[0].length /* max_cache_size */);
+  TestRead(read_stream.get(), kPuffsSample1);
+  TestSeek(read_stream.get(), false);
+  TestClose(read_stream.get());
+
   Buffer buf(kDeflatesSample1.size());
   shared_ptr<Huffer> huffer(new Huffer());
   auto write_stream = PuffinStream::CreateForHuff(
@@ -248,6 +296,177 @@ TEST_F(StreamTest, PuffinStreamTest) {
   TestClose(write_stream.get());
 }
 
+TEST_F(StreamTest, PuffinStreamCacheTest) {
+  // The cache holds at most two of the three puffs at a time, so reading them
+  // in this order both finds puffs in the cache and evicts them from it.
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1),
+      std::make_shared<Puffer>(), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      kPuffExtentsSample1[0].length + kPuffExtentsSample1[2].length);
+  TestReadPuffs(read_stream.get(), {0, 1, 0, 2, 2, 1, 0, 1, 2, 0, 0});
+  TestRead(read_stream.get(), kPuffsSample1);
+}
+
+TEST_F(StreamTest, PuffinStreamAccessOrderTest) {
+  // The cache holds at most two of the three puffs at a time. Reading them in
+  // a cycle evicts every puff before it is read again from a least recently
+  // used cache, but if the order is known, every puff is only puffed once.
+  const vector<int> puff_accesses = {0, 1, 2, 0, 1, 2};
+  uint64_t deflates_size = 0;
+  for (const auto& deflate : kSubblockDeflateExtentsSample1) {
+    deflates_size += deflate.length;
+  }
+  for (auto known_order : {false, true}) {
+    DeflateStats stats;
+    auto puffer = std::make_shared<Puffer>();
+    puffer->SetStats(&stats);
+    auto read_stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(kDeflatesSample1), puffer,
+        kPuffsSample1.size(), kSubblockDeflateExtentsSample1,
+        kPuffExtentsSample1,
+        kPuffExtentsSample1[0].length + kPuffExtentsSample1[2].length,
+        PuffFormat::kInterleaved,
+        known_order ? puff_accesses : vector<int>());
+    TestReadPuffs(read_stream.get(), puff_accesses);
+    EXPECT_EQ(stats.deflate_bits,
+              known_order ? deflates_size : deflates_size * 2);
+  }
+
+  // Reads that are not in the given order still read the right puffs.
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1), std::make_shared<Puffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      kPuffExtentsSample1[0].length + kPuffExtentsSample1[2].length,
+      PuffFormat::kInterleaved, {2, 1, 0, 2});
+  TestRead(read_stream.get(), kPuffsSample1);
+  TestSeek(read_stream.get(), false);
+
+  // The order can only have the puffs of the stream.
+  EXPECT_FALSE(PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1), std::make_shared<Puffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      kPuffsSample1.size(), PuffFormat::kInterleaved, {0, 3}));
+}
+
+TEST_F(StreamTest, PuffReadAheadTest) {
+  SharedStream stream(MemoryStream::CreateForRead(kDeflatesSample1));
+  PuffReadAhead read_ahead(&stream, kSubblockDeflateExtentsSample1,
+                           kPuffExtentsSample1, PuffFormat::kInterleaved, 2);
+  const vector<int> puff_ids = {0, 1, 2};
+  read_ahead.Schedule(puff_ids);
+  uint64_t puffs_size = 0;
+  for (auto puff_id : puff_ids) {
+    EXPECT_TRUE(read_ahead.Contains(puff_id));
+    puffs_size += kPuffExtentsSample1[puff_id].length;
+  }
+  EXPECT_EQ(puffs_size, read_ahead.Size());
+
+  // The puffs are kept until they are taken, so all of them are puffed by the
+  // workers, the same way as the reader puffs them.
+  std::map<int, SharedBufferPtr> puffs;
+  while (read_ahead.Size() != 0) {
+    vector<std::pair<int, SharedBufferPtr>> done;
+    read_ahead.TakeDone(&done);
+    puffs.insert(done.begin(), done.end());
+    std::this_thread::yield();
+  }
+  ASSERT_EQ(puff_ids.size(), puffs.size());
+  for (const auto& puff : puffs) {
+    const auto& extent = kPuffExtentsSample1[puff.first];
+    EXPECT_FALSE(read_ahead.Contains(puff.first));
+    EXPECT_EQ(*puff.second, Buffer(kPuffsSample1.begin() + extent.offset,
+                                   kPuffsSample1.begin() + extent.offset +
+                                       extent.length));
+  }
+
+  // Taking a puff waits for it if a worker has started puffing it, and drops
+  // it otherwise.
+  read_ahead.Schedule({1});
+  SharedBufferPtr puff;
+  if (read_ahead.Take(1, &puff)) {
+    const auto& extent = kPuffExtentsSample1[1];
+    EXPECT_EQ(*puff, Buffer(kPuffsSample1.begin() + extent.offset,
+                            kPuffsSample1.begin() + extent.offset +
+                                extent.length));
+  }
+  EXPECT_FALSE(read_ahead.Contains(1));
+  EXPECT_EQ(0, read_ahead.Size());
+}
+
+TEST_F(StreamTest, PuffinStreamReadAheadTest) {
+  // The puffs read by the workers are the same as the ones puffed by the
+  // reader, whether the next puffs are known from the given order or guessed
+  // from sequential reads.
+  const vector<int> puff_accesses = {0, 1, 2, 0, 1, 2};
+  for (auto known_order : {false, true}) {
+    auto read_stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(kDeflatesSample1),
+        std::make_shared<Puffer>(), kPuffsSample1.size(),
+        kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+        kPuffExtentsSample1[0].length + kPuffExtentsSample1[2].length,
+        PuffFormat::kInterleaved,
+        known_order ? puff_accesses : vector<int>(), 2);
+    TestReadPuffs(read_stream.get(), puff_accesses);
+    TestRead(read_stream.get(), kPuffsSample1);
+    TestSeek(read_stream.get(), false);
+    ASSERT_TRUE(read_stream->Close());
+  }
+}
+
+TEST_F(StreamTest, ColumnarPuffinStreamTest) {
+  shared_ptr<Huffer> huffer(new Huffer());
+  for (size_t i = 0; i < 2; i++) {
+    const auto& sample = i == 0 ? kDeflatesSample1 : kDeflatesSample2;
+    const auto& deflates = i == 0 ? kSubblockDeflateExtentsSample1
+                                  : kSubblockDeflateExtentsSample2;
+    vector<ByteExtent> puffs;
+    Buffer puff_buf;
+    ASSERT_NO_FATAL_FAILURE(ReadSamplePuff(
+        sample, deflates, PuffFormat::kColumnar, &puffs, &puff_buf));
+
+    Buffer buf(sample.size());
+    auto write_stream = PuffinStream::CreateForHuff(
+        MemoryStream::CreateForWrite(&buf), huffer, puff_buf.size(), deflates,
+        puffs, /*ignore_deflate_size=*/false, PuffFormat::kColumnar);
+    ASSERT_TRUE(write_stream->Write(puff_buf.data(), puff_buf.size()));
+    ASSERT_EQ(buf, sample);
+  }
+}
+
+TEST_F(StreamTest, PuffinStreamHuffThreadsTest) {
+  // The deflates huffed on other threads are stitched together into the same
+  // stream as the one huffed while writing, including the bytes shared by two
+  // deflates of the sub-block samples.
+  shared_ptr<Huffer> huffer(new Huffer());
+  for (auto puff_format : {PuffFormat::kInterleaved, PuffFormat::kColumnar}) {
+    for (size_t i = 0; i < 2; i++) {
+      const auto& sample = i == 0 ? kDeflatesSample1 : kDeflatesSample2;
+      const auto& deflates = i == 0 ? kSubblockDeflateExtentsSample1
+                                    : kSubblockDeflateExtentsSample2;
+      vector<ByteExtent> puffs;
+      Buffer puff_buf;
+      ASSERT_NO_FATAL_FAILURE(
+          ReadSamplePuff(sample, deflates, puff_format, &puffs, &puff_buf));
+
+      Buffer buf(sample.size());
+      auto write_stream = PuffinStream::CreateForHuff(
+          MemoryStream::CreateForWrite(&buf), huffer, puff_buf.size(),
+          deflates, puffs, /*ignore_deflate_size=*/false, puff_format, 2);
+      ASSERT_TRUE(write_stream->Write(puff_buf.data(), puff_buf.size()));
+      ASSERT_EQ(buf, sample);
+
+      std::fill(buf.begin(), buf.end(), 0);
+      ASSERT_TRUE(write_stream->Seek(0));
+      for (const auto& byte : puff_buf) {
+        ASSERT_TRUE(write_stream->Write(&byte, 1));
+      }
+      ASSERT_EQ(buf, sample);
+      TestClose(write_stream.get());
+    }
+  }
+}
+
 TEST_F(StreamTest, ExtentStreamTest) {
   Buffer buf(100);
   std::iota(buf.begin(), buf.end(), 0);
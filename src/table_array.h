@@ -0,0 +1,38 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_TABLE_ARRAY_H_
+#define SRC_TABLE_ARRAY_H_
+
+#include <cstddef>
+
+namespace puffin {
+
+// Wraps the arrays of the precomputed tables, so they can be returned by the
+// constexpr functions that generate them at compile time.
+template <typename T, size_t N>
+struct TableArray {
+  T data[N];
+};
+
+// C++11 does not have std::index_sequence.
+template <size_t... Indices>
+struct IndexSequence {};
+
+template <size_t N, size_t... Indices>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Indices...> {};
+
+template <size_t... Indices>
+struct MakeIndexSequence<0, Indices...> : IndexSequence<Indices...> {};
+
+// Returns the array of |Generate(index)| for all the |Indices|.
+template <typename T, T (*Generate)(size_t), size_t... Indices>
+constexpr TableArray<T, sizeof...(Indices)> GenerateArray(
+    IndexSequence<Indices...>) {
+  return {{Generate(Indices)...}};
+}
+
+}  // namespace puffin
+
+#endif  // SRC_TABLE_ARRAY_H_
@@ -19,7 +19,9 @@
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/logging.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_data.h"
 #include "puffin/src/puff_writer.h"
+#include "puffin/src/puffer_internal.h"
 
 using std::set;
 using std::string;
@@ -151,23 +153,21 @@ bool LocateDeflatesInZlib(const Buffer& data,
   return true;
 }
 
-bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
-                          const vector<ByteExtent>& deflates,
-                          vector<BitExtent>* subblock_deflates) {
+namespace {
+// Finds the subblocks of |deflates| in |src| like |FindDeflateSubBlocks| and
+// the size of the puff of each subblock in |PuffFormat::kInterleaved|.
+bool FindSubBlocksAndPuffSizes(const UniqueStreamPtr& src,
+                               const vector<ByteExtent>& deflates,
+                               vector<BitExtent>* subblock_deflates,
+                               vector<uint64_t>* puff_sizes) {
   Puffer puffer;
-  Buffer deflate_buffer;
+  vector<BitExtent> subblocks;
   for (const auto& deflate : deflates) {
-    TEST_AND_RETURN_FALSE(src->Seek(deflate.offset));
-    // Read from src into deflate_buffer.
-    deflate_buffer.resize(deflate.length);
-    TEST_AND_RETURN_FALSE(src->Read(deflate_buffer.data(), deflate.length));
-
     // Find all the subblocks.
-    BufferBitReader bit_reader(deflate_buffer.data(), deflate.length);
-    BufferPuffWriter puff_writer(nullptr, 0);
-    vector<BitExtent> subblocks;
-    TEST_AND_RETURN_FALSE(
-        puffer.PuffDeflate(&bit_reader, &puff_writer, &subblocks));
+    StreamBitReader bit_reader(src.get(), deflate.offset, deflate.length);
+    subblocks.clear();
+    TEST_AND_RETURN_FALSE(PufferInternal::FindSubBlocksAndPuffSizes(
+        puffer, &bit_reader, &subblocks, puff_sizes));
     TEST_AND_RETURN_FALSE(deflate.length == bit_reader.Offset());
     for (const auto& subblock : subblocks) {
       subblock_deflates->emplace_back(subblock.offset + deflate.offset * 8,
@@ -177,6 +177,78 @@ bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
   return true;
 }
 
+// Returns the size of a puff in |puff_format| that has |interleaved_size|
+// bytes in |PuffFormat::kInterleaved|.
+uint64_t PuffSizeInFormat(uint64_t interleaved_size, PuffFormat puff_format) {
+  if (puff_format == PuffFormat::kColumnar && interleaved_size != 0) {
+    return interleaved_size + kColumnarSectionSizesLength;
+  }
+  return interleaved_size;
+}
+
+// Lays out the puffs of |deflates| in |src|, whose sizes are |puff_sizes|, and
+// populates |puffs| and |out_puff_size| as described in |FindPuffLocations|.
+bool CalculatePuffLocations(const UniqueStreamPtr& src,
+                            const vector<BitExtent>& deflates,
+                            const vector<uint64_t>& puff_sizes,
+                            vector<ByteExtent>* puffs,
+                            uint64_t* out_puff_size) {
+  TEST_AND_RETURN_FALSE(deflates.size() == puff_sizes.size());
+  // Here accumulate the size difference between each corresponding deflate and
+  // puff. At the end we add this cummulative size difference to the size of the
+  // deflate stream to get the size of the puff stream. We use signed size
+  // because puff size could be smaller than deflate size.
+  int64_t total_size_difference = 0;
+  for (size_t index = 0; index < deflates.size(); index++) {
+    const auto& deflate = deflates[index];
+    auto puff_size = puff_sizes[index];
+
+    // 1 if a deflate ends at the same byte that the next deflate starts and
+    // there is a few bits gap between them. In practice this may never happen,
+    // but it is a good idea to support it anyways. If there is a gap, the value
+    // of the gap will be saved as an integer byte to the puff stream. The parts
+    // of the byte that belogs to the deflates are shifted out.
+    int gap = 0;
+    if (index != 0) {
+      const auto& prev_deflate = deflates[index - 1];
+      if ((prev_deflate.offset + prev_deflate.length == deflate.offset)
+          // If deflates are on byte boundary the gap will not be counted later,
+          // so we won't worry about it.
+          && (deflate.offset % 8 != 0)) {
+        gap = 1;
+      }
+    }
+
+    auto start_byte = ((deflate.offset + 7) / 8);
+    auto end_byte = (deflate.offset + deflate.length) / 8;
+    int64_t deflate_length_in_bytes = end_byte - start_byte;
+
+    // If there was no gap bits between the current and previous deflates, there
+    // will be no extra gap byte, so the offset will be shifted one byte back.
+    auto puff_offset = start_byte - gap + total_size_difference;
+    // Add the location into puff.
+    puffs->emplace_back(puff_offset, puff_size);
+    total_size_difference +=
+        static_cast<int64_t>(puff_size) - deflate_length_in_bytes - gap;
+  }
+
+  uint64_t src_size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
+  auto final_size = static_cast<int64_t>(src_size) + total_size_difference;
+  TEST_AND_RETURN_FALSE(final_size >= 0);
+  *out_puff_size = final_size;
+  return true;
+}
+}  // namespace
+
+bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
+                          const vector<ByteExtent>& deflates,
+                          vector<BitExtent>* subblock_deflates) {
+  vector<uint64_t> puff_sizes;
+  return FindSubBlocksAndPuffSizes(src, deflates, subblock_deflates,
+                                   &puff_sizes);
+}
+
 bool LocateDeflatesInZlibBlocks(const string& file_path,
                                 const vector<ByteExtent>& zlibs,
                                 vector<BitExtent>* deflates) {
@@ -369,69 +441,142 @@ bool LocateDeflateSubBlocksInZipArchive(const Buffer& data,
 bool FindPuffLocations(const UniqueStreamPtr& src,
                        const vector<BitExtent>& deflates,
                        vector<ByteExtent>* puffs,
-                       uint64_t* out_puff_size) {
+                       uint64_t* out_puff_size,
+                       PuffFormat puff_format) {
   Puffer puffer;
-  Buffer deflate_buffer;
-
-  // Here accumulate the size difference between each corresponding deflate and
-  // puff. At the end we add this cummulative size difference to the size of the
-  // deflate stream to get the size of the puff stream. We use signed size
-  // because puff size could be smaller than deflate size.
-  int64_t total_size_difference = 0;
-  for (auto deflate = deflates.begin(); deflate != deflates.end(); ++deflate) {
-    // Read from src into deflate_buffer.
-    auto start_byte = deflate->offset / 8;
-    auto end_byte = (deflate->offset + deflate->length + 7) / 8;
-    deflate_buffer.resize(end_byte - start_byte);
-    TEST_AND_RETURN_FALSE(src->Seek(start_byte));
-    TEST_AND_RETURN_FALSE(
-        src->Read(deflate_buffer.data(), deflate_buffer.size()));
+  vector<BitExtent> subblocks;
+  vector<uint64_t> subblock_puff_sizes;
+  vector<uint64_t> puff_sizes;
+  puff_sizes.reserve(deflates.size());
+  for (const auto& deflate : deflates) {
     // Find the size of the puff.
-    BufferBitReader bit_reader(deflate_buffer.data(), deflate_buffer.size());
-    uint64_t bits_to_skip = deflate->offset % 8;
+    auto start_byte = deflate.offset / 8;
+    auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+    StreamBitReader bit_reader(src.get(), start_byte, end_byte - start_byte);
+    uint64_t bits_to_skip = deflate.offset % 8;
     TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
     bit_reader.DropBits(bits_to_skip);
 
-    BufferPuffWriter puff_writer(nullptr, 0);
-    TEST_AND_RETURN_FALSE(
-        puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr));
-    TEST_AND_RETURN_FALSE(deflate_buffer.size() == bit_reader.Offset());
+    subblocks.clear();
+    subblock_puff_sizes.clear();
+    TEST_AND_RETURN_FALSE(PufferInternal::FindSubBlocksAndPuffSizes(
+        puffer, &bit_reader, &subblocks, &subblock_puff_sizes));
+    TEST_AND_RETURN_FALSE(end_byte - start_byte == bit_reader.Offset());
+    uint64_t puff_size = 0;
+    for (auto subblock_puff_size : subblock_puff_sizes) {
+      puff_size += subblock_puff_size;
+    }
+    puff_sizes.push_back(PuffSizeInFormat(puff_size, puff_format));
+  }
+  return CalculatePuffLocations(src, deflates, puff_sizes, puffs,
+                                out_puff_size);
+}
 
-    // 1 if a deflate ends at the same byte that the next deflate starts and
-    // there is a few bits gap between them. In practice this may never happen,
-    // but it is a good idea to support it anyways. If there is a gap, the value
-    // of the gap will be saved as an integer byte to the puff stream. The parts
-    // of the byte that belogs to the deflates are shifted out.
-    int gap = 0;
-    if (deflate != deflates.begin()) {
-      auto prev_deflate = std::prev(deflate);
-      if ((prev_deflate->offset + prev_deflate->length == deflate->offset)
-          // If deflates are on byte boundary the gap will not be counted later,
-          // so we won't worry about it.
-          && (deflate->offset % 8 != 0)) {
-        gap = 1;
-      }
+namespace {
+// Writes the bytes of |src| between the bits |start_bit| and |end_bit| into
+// |dst| the same way |PuffinStream| does, in chunks of the size of |buffer|:
+// The bits of a byte that belong to deflates are masked and shifted out.
+bool WriteRawBytes(const UniqueStreamPtr& src,
+                   uint64_t start_bit,
+                   uint64_t end_bit,
+                   const UniqueStreamPtr& dst,
+                   Buffer* buffer) {
+  auto start_byte = start_bit / 8;
+  auto end_byte = (end_bit + 7) / 8;
+  TEST_AND_RETURN_FALSE(src->Seek(start_byte));
+  for (auto offset = start_byte; offset < end_byte;) {
+    auto size = std::min(static_cast<uint64_t>(buffer->size()),
+                         end_byte - offset);
+    TEST_AND_RETURN_FALSE(src->Read(buffer->data(), size));
+    if (offset + size == end_byte && end_byte * 8 > end_bit) {
+      (*buffer)[size - 1] &= (1 << (end_bit & 7)) - 1;
     }
+    if (offset == start_byte && start_byte * 8 < start_bit) {
+      (*buffer)[0] >>= start_bit & 7;
+    }
+    TEST_AND_RETURN_FALSE(dst->Write(buffer->data(), size));
+    offset += size;
+  }
+  return true;
+}
+}  // namespace
 
-    start_byte = ((deflate->offset + 7) / 8);
-    end_byte = (deflate->offset + deflate->length) / 8;
-    int64_t deflate_length_in_bytes = end_byte - start_byte;
+bool PuffDeflateStream(const UniqueStreamPtr& src,
+                       const vector<BitExtent>& deflates,
+                       const UniqueStreamPtr& dst,
+                       vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size,
+                       PuffFormat puff_format,
+                       DeflateStats* stats) {
+  uint64_t src_size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
+  Puffer puffer;
+  puffer.SetStats(stats);
+  puffs->clear();
+  // The interleaved puffs and the raw bytes go through |buffer|. The columnar
+  // puffs are only complete after |Flush|, so each is put together in
+  // |columnar_buffer| first.
+  Buffer buffer(std::max(static_cast<size_t>(1024 * 1024),
+                         static_cast<size_t>(kMaxWholeRecordsSize)));
+  Buffer columnar_buffer;
+
+  // The bit right after the last puffed deflate and the size of the puff
+  // stream written so far.
+  uint64_t bit_offset = 0;
+  uint64_t puff_offset = 0;
+  for (const auto& deflate : deflates) {
+    TEST_AND_RETURN_FALSE(deflate.offset >= bit_offset);
+    TEST_AND_RETURN_FALSE(deflate.offset + deflate.length <= src_size * 8);
+    if (deflate.offset != bit_offset) {
+      TEST_AND_RETURN_FALSE(
+          WriteRawBytes(src, bit_offset, deflate.offset, dst, &buffer));
+      puff_offset += (deflate.offset + 7) / 8 - bit_offset / 8;
+    }
 
-    // If there was no gap bits between the current and previous deflates, there
-    // will be no extra gap byte, so the offset will be shifted one byte back.
-    auto puff_offset = start_byte - gap + total_size_difference;
-    auto puff_size = puff_writer.Size();
-    // Add the location into puff.
+    auto start_byte = deflate.offset / 8;
+    auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+    StreamBitReader bit_reader(src.get(), start_byte, end_byte - start_byte);
+    uint64_t bits_to_skip = deflate.offset % 8;
+    TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
+    bit_reader.DropBits(bits_to_skip);
+
+    uint64_t puff_size;
+    if (puff_format == PuffFormat::kColumnar) {
+      columnar_buffer.clear();
+      BufferColumnarPuffWriter puff_writer(&columnar_buffer);
+      TEST_AND_RETURN_FALSE(
+          puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr));
+      TEST_AND_RETURN_FALSE(
+          dst->Write(columnar_buffer.data(), columnar_buffer.size()));
+      puff_size = columnar_buffer.size();
+    } else {
+      BufferPuffWriter puff_writer(dst, &buffer);
+      TEST_AND_RETURN_FALSE(PufferInternal::PuffDeflate(puffer, &bit_reader,
+                                                        &puff_writer, nullptr));
+      puff_size = puff_writer.Size();
+    }
+    TEST_AND_RETURN_FALSE(end_byte - start_byte == bit_reader.Offset());
     puffs->emplace_back(puff_offset, puff_size);
-    total_size_difference +=
-        static_cast<int64_t>(puff_size) - deflate_length_in_bytes - gap;
+    puff_offset += puff_size;
+    bit_offset = deflate.offset + deflate.length;
   }
+  TEST_AND_RETURN_FALSE(
+      WriteRawBytes(src, bit_offset, src_size * 8, dst, &buffer));
+  *out_puff_size = puff_offset + src_size - bit_offset / 8;
+  return true;
+}
 
-  uint64_t src_size;
-  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
-  auto final_size = static_cast<int64_t>(src_size) + total_size_difference;
-  TEST_AND_RETURN_FALSE(final_size >= 0);
-  *out_puff_size = final_size;
+bool PuffDeflateStream(const UniqueStreamPtr& src,
+                       const vector<BitExtent>& deflates,
+                       vector<ByteExtent>* puffs,
+                       Buffer* puff_buffer,
+                       PuffFormat puff_format) {
+  puff_buffer->clear();
+  auto dst = MemoryStream::CreateForWrite(puff_buffer);
+  uint64_t puff_size;
+  TEST_AND_RETURN_FALSE(PuffDeflateStream(src, deflates, dst, puffs,
+                                          &puff_size, puff_format));
+  TEST_AND_RETURN_FALSE(puff_size == puff_buffer->size());
   return true;
 }
 
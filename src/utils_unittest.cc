@@ -123,6 +123,59 @@ TEST(UtilsTest, FindPuffLocations2Test) {
                         kPuffExtentsSample2, kPuffsSample2.size());
 }
 
+TEST(UtilsTest, PuffDeflateStreamTest) {
+  auto src = MemoryStream::CreateForRead(kDeflatesSample1);
+  vector<ByteExtent> puffs;
+  Buffer puff_buffer;
+  ASSERT_TRUE(PuffDeflateStream(src, kSubblockDeflateExtentsSample1, &puffs,
+                                &puff_buffer));
+  EXPECT_EQ(puffs, kPuffExtentsSample1);
+  EXPECT_EQ(puff_buffer, kPuffsSample1);
+
+  src = MemoryStream::CreateForRead(kDeflatesSample2);
+  ASSERT_TRUE(PuffDeflateStream(src, kSubblockDeflateExtentsSample2, &puffs,
+                                &puff_buffer));
+  EXPECT_EQ(puffs, kPuffExtentsSample2);
+  EXPECT_EQ(puff_buffer, kPuffsSample2);
+
+  // The columnar puffs are where |FindPuffLocations| puts them.
+  vector<ByteExtent> expected_puffs;
+  uint64_t expected_puff_size;
+  ASSERT_TRUE(FindPuffLocations(src, kSubblockDeflateExtentsSample2,
+                                &expected_puffs, &expected_puff_size,
+                                PuffFormat::kColumnar));
+  ASSERT_TRUE(PuffDeflateStream(src, kSubblockDeflateExtentsSample2, &puffs,
+                                &puff_buffer, PuffFormat::kColumnar));
+  EXPECT_EQ(puffs, expected_puffs);
+  EXPECT_EQ(puff_buffer.size(), expected_puff_size);
+
+  // Unsorted deflates.
+  vector<BitExtent> deflates(kSubblockDeflateExtentsSample2.rbegin(),
+                             kSubblockDeflateExtentsSample2.rend());
+  EXPECT_FALSE(PuffDeflateStream(src, deflates, &puffs, &puff_buffer));
+}
+
+TEST(UtilsTest, PuffDeflateStreamIntoStreamTest) {
+  for (auto puff_format : {PuffFormat::kInterleaved, PuffFormat::kColumnar}) {
+    auto src = MemoryStream::CreateForRead(kDeflatesSample2);
+    vector<ByteExtent> expected_puffs;
+    Buffer expected_puff_buffer;
+    ASSERT_TRUE(PuffDeflateStream(src, kSubblockDeflateExtentsSample2,
+                                  &expected_puffs, &expected_puff_buffer,
+                                  puff_format));
+
+    vector<ByteExtent> puffs;
+    Buffer puff_buffer;
+    uint64_t puff_size;
+    auto dst = MemoryStream::CreateForWrite(&puff_buffer);
+    ASSERT_TRUE(PuffDeflateStream(src, kSubblockDeflateExtentsSample2, dst,
+                                  &puffs, &puff_size, puff_format));
+    EXPECT_EQ(puffs, expected_puffs);
+    EXPECT_EQ(puff_buffer, expected_puff_buffer);
+    EXPECT_EQ(puff_size, puff_buffer.size());
+  }
+}
+
 TEST(UtilsTest, LocateDeflatesInZlib) {
   Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
   vector<ByteExtent> deflates;